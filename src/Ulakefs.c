@@ -10,20 +10,60 @@
 #include "Ulakefs.h"
 #include "options.h"
 #include "debug.h"
+#include "session.h"
+#include "branches.h"
 
 static struct fuse_opt ulakefs_opts[] = {
+        FUSE_OPT_KEY("async_close", KEY_ASYNC_CLOSE),
+        FUSE_OPT_KEY("async_close=%s", KEY_ASYNC_CLOSE),
+        FUSE_OPT_KEY("branch_degraded=%s", KEY_BRANCH_DEGRADED),
+        FUSE_OPT_KEY("branch_queue=%s", KEY_BRANCH_QUEUE),
+        FUSE_OPT_KEY("branch_slow=%s", KEY_BRANCH_SLOW),
+        FUSE_OPT_KEY("branch_threads=%s", KEY_BRANCH_THREADS),
+        FUSE_OPT_KEY("branch_timeout=%s", KEY_BRANCH_TIMEOUT),
+        FUSE_OPT_KEY("cache_watch", KEY_CACHE_WATCH),
         FUSE_OPT_KEY("chroot=%s,", KEY_CHROOT),
+        FUSE_OPT_KEY("clone_fd", KEY_CLONE_FD),
+        FUSE_OPT_KEY("copy_chunk_size=%s", KEY_COPY_CHUNK_SIZE),
+        FUSE_OPT_KEY("copy_threads=%s", KEY_COPY_THREADS),
+        FUSE_OPT_KEY("copyup_bwlimit=%s", KEY_COPYUP_BWLIMIT),
+        FUSE_OPT_KEY("copyup_ioprio=%s", KEY_COPYUP_IOPRIO),
+        FUSE_OPT_KEY("copyup_threads=%s", KEY_COPYUP_THREADS),
         FUSE_OPT_KEY("cow", KEY_COW),
+        FUSE_OPT_KEY("create_policy=%s", KEY_CREATE_POLICY),
+        FUSE_OPT_KEY("create_policy_path=%s", KEY_CREATE_POLICY_PATH),
         FUSE_OPT_KEY("debug_file=%s", KEY_DEBUG_FILE),
+        FUSE_OPT_KEY("direct_io_auto", KEY_DIRECT_IO_AUTO),
+        FUSE_OPT_KEY("direct_io_odirect", KEY_DIRECT_IO_ODIRECT),
+        FUSE_OPT_KEY("direct_io_prefix=%s", KEY_DIRECT_IO_PREFIX),
+        FUSE_OPT_KEY("dirmap", KEY_DIRMAP),
         FUSE_OPT_KEY("dirs=%s", KEY_DIRS),
+        FUSE_OPT_KEY("fd_cache", KEY_FD_CACHE),
+        FUSE_OPT_KEY("fsync_group", KEY_FSYNC_GROUP),
+        FUSE_OPT_KEY("fsync_group=%s", KEY_FSYNC_GROUP),
         FUSE_OPT_KEY("--help", KEY_HELP),
         FUSE_OPT_KEY("-h", KEY_HELP),
         FUSE_OPT_KEY("hide_meta_dir", KEY_HIDE_METADIR),
         FUSE_OPT_KEY("hide_meta_files", KEY_HIDE_META_FILES),
         FUSE_OPT_KEY("max_files=%s", KEY_MAX_FILES),
+        FUSE_OPT_KEY("max_idle_threads=%s", KEY_MAX_IDLE_THREADS),
+        FUSE_OPT_KEY("no_ro_cache", KEY_NO_RO_CACHE),
         FUSE_OPT_KEY("noinitgroups", KEY_NOINITGROUPS),
+        FUSE_OPT_KEY("pin_threads", KEY_PIN_THREADS),
+        FUSE_OPT_KEY("readahead", KEY_READAHEAD),
+        FUSE_OPT_KEY("readahead_max=%s", KEY_READAHEAD_MAX),
         FUSE_OPT_KEY("relaxed_permissions", KEY_RELAXED_PERMISSIONS),
+        FUSE_OPT_KEY("rw_auto_cache", KEY_RW_AUTO_CACHE),
+        FUSE_OPT_KEY("statfs_interval=%s", KEY_STATFS_INTERVAL),
         FUSE_OPT_KEY("statfs_omit_ro", KEY_STATFS_OMIT_RO),
+        FUSE_OPT_KEY("statfs_timeout=%s", KEY_STATFS_TIMEOUT),
+        FUSE_OPT_KEY("stripe_chunk=%s", KEY_STRIPE_CHUNK),
+        FUSE_OPT_KEY("stripe_prefix=%s", KEY_STRIPE_PREFIX),
+        FUSE_OPT_KEY("threads=%s", KEY_THREADS),
+        FUSE_OPT_KEY("tier_branch=%s", KEY_TIER_BRANCH),
+        FUSE_OPT_KEY("tier_hits=%s", KEY_TIER_HITS),
+        FUSE_OPT_KEY("tier_size=%s", KEY_TIER_SIZE),
+        FUSE_OPT_KEY("whiteout_store", KEY_WHITEOUT_STORE),
         FUSE_OPT_KEY("--version", KEY_VERSION),
         FUSE_OPT_KEY("-V", KEY_VERSION),
         FUSE_OPT_END
@@ -67,6 +107,7 @@ int main(int argc, char *argv[]) {
         }
     }
     ulakefs_post_opts();
+    if (branches_init()) exit(1);
 
 #ifdef FUSE_CAP_BIG_WRITES
     /* libfuse > 0.8 supports large IO, also for reads, to increase performance
@@ -77,7 +118,11 @@ int main(int argc, char *argv[]) {
     }
 #endif
 
-    umask(0);
-    int res = fuse_main(args.argc, args.argv, &ulakefs_oper, NULL);
+    uopt.umask = umask(0);
+    int res;
+    if (uopt.session_loop && !uopt.doexit)
+        res = session_main(args.argc, args.argv);
+    else
+        res = fuse_main(args.argc, args.argv, &ulakefs_oper, NULL);
     RETURN(uopt.doexit ? uopt.retval : res);
 }
\ No newline at end of file
@@ -5,12 +5,22 @@
 #ifndef ULAKEFS_FUSE_ULAKEFS_H
 #define ULAKEFS_FUSE_ULAKEFS_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #define PATHLEN_MAX 1024
 #define HIDETAG "_HIDDEN~"
+#define TIERTAG "_TIER~"	// promoted copy of -o tier_branch
+#define STRIPETAG "_STRIPE~"	// member of a striped file
+#define LAYOUTTAG "_LAYOUT~"	// manifest of a striped file
 
 #define METANAME ".ulakefs"
 #define METADIR (METANAME  "/") // string
 
+// virtual directory with statistics and control files
+#define CTLNAME ".ulakefs.ctl"
+#define CTLDIR ("/" CTLNAME)
+
 // fuse meta files, we might want to hide those
 #define FUSE_META_FILE ".fuse_hidden"
 #define FUSE_META_LENGTH 12
@@ -38,8 +48,36 @@ typedef struct {
     int path_len;		// strlen(path)
     int fd;			 // used to prevent accidental umounts of path
     unsigned char rw;	 // the writable flag
+    unsigned char immutable; // read-only and never changed, see manifest.c
+    int mirror;		 // mirror group of identical ro-branches, 0 = none
+    int id;			 // stable across branch list changes, < BRANCHES_MAX
 } branch_entry_t;
 
+#define BRANCHES_MAX 64	// branches added during the lifetime of a mount
+
+struct branch_set;
+
+struct fdcache_entry;
+struct readahead;
+struct stripe;
+
+// an open file, fi->fh points to it
+typedef struct {
+    int fd;
+    int branch;		// -1 for files below CTLDIR
+    bool odirect;	// fd has O_DIRECT, reads need aligned buffers
+    struct fdcache_entry *fdc; // fd is shared through the fd cache
+    struct readahead *ra;	// access pattern of -o readahead
+    bool tier_hit;		// the first read counts for -o tier_branch
+    int mirror_fd;		// same file on another mirror after EIO, -1 = none
+    int mirror_branch;
+    struct stripe *stripe;	// members of a striped file
+    bool stripe_pending;	// below a stripe prefix, striped once it grows
+    const struct branch_set *set;	// branch list the file was opened on
+} ufile_t;
+
+#define UFILE(fi) ((ufile_t *)(uintptr_t)(fi)->fh)
+
 extern struct fuse_operations ulakefs_oper;
 
 
@@ -0,0 +1,452 @@
+//
+// Per-branch worker threads for calls with a deadline
+//
+/*
+ * Every branch has its own -o branch_threads worker threads, which run the
+ * blocking calls against the branch: lstat() of the lookups, open() and
+ * pread(). bpool_call() queues a function for a branch and waits until it
+ * returned or the deadline passed. A slow or hanging branch therefore only
+ * holds the workers of that branch and the requests which actually touch
+ * it. Inline copies take long by nature, bpool_copy() runs them on a
+ * second pool of the branch, started on first use, so they neither wait
+ * in front of lookups nor make the branch look stuck.
+ *
+ * The queue of a branch holds at most -o branch_queue calls, further
+ * callers wait for space. The wait counts against their deadline.
+ * bpool_stuck() tells whether a call has been running on the branch for
+ * longer than a deadline, a full queue alone only means it is busy.
+ *
+ * The argument of the function is copied into the job and copied back
+ * once the function returned, so an abandoned job never touches the stack
+ * of the fuse thread that gave up on it. Whoever of the caller and the
+ * worker finishes last frees the job.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "branches.h"
+#include "bpool.h"
+
+struct bpool_job {
+    struct bpool_job *next;
+    struct bpool_job *rnext;	// running jobs of the pool
+    bpool_fn fn;
+    int res, err;
+    bool started;	// a worker runs it
+    unsigned long long start_us;	// when the worker started it
+    bool done;
+    bool abandoned;	// the caller gave up, the result is not needed
+    pthread_cond_t cond;
+    char arg[];
+};
+
+struct bpool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t space;	// the queue is not full anymore
+    struct bpool_job *head, *tail;
+    struct bpool_job *running;	// linked by rnext
+    unsigned int queued;
+    unsigned int pending;	// queued or running
+    unsigned long calls, timeouts, full;
+    int started;		// workers run, branches added later start on first use
+};
+
+#define BPOOL_QUEUE 64	// default -o branch_queue
+
+static struct bpool *pools;	// per branch id, then the copy pools, NULL if not started
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_condattr_t monotonic;
+
+static unsigned long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Take job off the running list of pool, the lock MUST be held
+ */
+static void running_remove(struct bpool *pool, struct bpool_job *job) {
+    struct bpool_job **prev = &pool->running;
+
+    while (*prev != job) prev = &(*prev)->rnext;
+    *prev = job->rnext;
+}
+
+static void *bpool_thread(void *arg) {
+    struct bpool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->head) pthread_cond_wait(&pool->work, &pool->lock);
+
+        struct bpool_job *job = pool->head;
+        pool->head = job->next;
+        if (!pool->head) pool->tail = NULL;
+        pool->queued--;
+        pthread_cond_signal(&pool->space);
+
+        job->started = true;
+        if (!job->abandoned) {
+            job->start_us = now_us();
+            job->rnext = pool->running;
+            pool->running = job;
+
+            pthread_mutex_unlock(&pool->lock);
+            int res = job->fn(job->arg);
+            int err = errno;
+            pthread_mutex_lock(&pool->lock);
+
+            running_remove(pool, job);
+            job->res = res;
+            job->err = err;
+        }
+        pool->pending--;
+
+        if (job->abandoned) {
+            pthread_cond_destroy(&job->cond);
+            free(job);
+        } else {
+            job->done = true;
+            pthread_cond_signal(&job->cond);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the workers of pool, returns 0 or an error number
+ */
+static int bpool_start(struct bpool *pool) {
+    pthread_mutex_lock(&start_lock);
+    if (pool->started) {
+        pthread_mutex_unlock(&start_lock);
+        return 0;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    int t, res = 0;
+    for (t = 0; t < uopt.branch_threads && !res; t++) {
+        pthread_t thread;
+        res = pthread_create(&thread, &attr, bpool_thread, pool);
+    }
+    pthread_attr_destroy(&attr);
+
+    // with some workers the queue is still served
+    if (t > 1 || !res) (void)__sync_lock_test_and_set(&pool->started, 1);
+
+    pthread_mutex_unlock(&start_lock);
+    return pool->started ? 0 : res;
+}
+
+/**
+ * Start -o branch_threads workers per branch, called from ulakefs_init()
+ */
+int bpool_init(void) {
+    if (pools) RETURN(0);
+
+    // health tracking needs workers to give up hanging calls
+    if (!uopt.branch_threads && uopt.branch_timeout) uopt.branch_threads = 2;
+    if (!uopt.branch_threads) RETURN(0);
+    if (!uopt.branch_queue) uopt.branch_queue = BPOOL_QUEUE;
+
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+
+    struct bpool *p = calloc(2 * BRANCHES_MAX, sizeof(struct bpool));
+    if (!p) RETURN(-ENOMEM);
+
+    int i, res = 0;
+    for (i = 0; i < 2 * BRANCHES_MAX; i++) {
+        pthread_mutex_init(&p[i].lock, NULL);
+        pthread_cond_init(&p[i].work, NULL);
+        pthread_cond_init(&p[i].space, &monotonic);
+    }
+
+    for (i = 0; i < NBRANCHES && !res; i++) res = bpool_start(&p[BRANCHES[i].id]);
+
+    // threads which run already wait for work forever, p is never freed
+    if (res) RETURN(-res);
+
+    pools = p;
+    RETURN(0);
+}
+
+/**
+ * Take a job which no worker started yet off the queue, the lock MUST be
+ * held
+ */
+static void queue_remove(struct bpool *pool, struct bpool_job *job) {
+    struct bpool_job **prev = &pool->head, *last = NULL;
+
+    while (*prev != job) {
+        last = *prev;
+        prev = &(*prev)->next;
+    }
+    *prev = job->next;
+    if (pool->tail == job) pool->tail = last;
+
+    pool->queued--;
+    pool->pending--;
+    pthread_cond_signal(&pool->space);
+}
+
+static int pool_call(struct bpool *pool, bpool_fn fn, void *arg, size_t argsize,
+                     unsigned int timeout_ms) {
+    if (!__sync_fetch_and_add(&pool->started, 0) && bpool_start(pool)) return fn(arg);
+
+    struct bpool_job *job = malloc(sizeof(struct bpool_job) + argsize);
+    if (!job) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(job, 0, sizeof(*job));
+    job->fn = fn;
+    memcpy(job->arg, arg, argsize);
+    pthread_cond_init(&job->cond, &monotonic);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->queued >= uopt.branch_queue) pool->full++;
+    while (pool->queued >= uopt.branch_queue) {
+        if (!timeout_ms) {
+            pthread_cond_wait(&pool->space, &pool->lock);
+        } else if (pthread_cond_timedwait(&pool->space, &pool->lock, &deadline) == ETIMEDOUT) {
+            pool->timeouts++;
+            pthread_mutex_unlock(&pool->lock);
+
+            pthread_cond_destroy(&job->cond);
+            free(job);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+
+    if (pool->tail)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pool->queued++;
+    pool->pending++;
+    pool->calls++;
+    pthread_cond_signal(&pool->work);
+
+    while (!job->done) {
+        if (!timeout_ms) {
+            pthread_cond_wait(&job->cond, &pool->lock);
+        } else if (pthread_cond_timedwait(&job->cond, &pool->lock, &deadline) == ETIMEDOUT
+                   && !job->done) {
+            pool->timeouts++;
+
+            if (job->started) {
+                // the worker frees it
+                job->abandoned = true;
+                pthread_mutex_unlock(&pool->lock);
+            } else {
+                queue_remove(pool, job);
+                pthread_mutex_unlock(&pool->lock);
+
+                pthread_cond_destroy(&job->cond);
+                free(job);
+            }
+
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    int res = job->res;
+    int err = job->err;
+    memcpy(arg, job->arg, argsize);
+    pthread_cond_destroy(&job->cond);
+    free(job);
+
+    errno = err;
+    return res;
+}
+
+/**
+ * Run fn(arg) on a worker of branch and wait at most timeout_ms for it,
+ * 0 waits forever. arg is copied to the job and back. Returns the result
+ * of fn with its errno, or -1 with ETIMEDOUT after the deadline. Without
+ * workers fn runs in the calling thread.
+ */
+int bpool_call(int branch, bpool_fn fn, void *arg, size_t argsize, unsigned int timeout_ms) {
+    if (!pools || branch < 0) return fn(arg); // -1 for the files of CTLDIR
+
+    return pool_call(&pools[BRANCHES[branch].id], fn, arg, argsize, timeout_ms);
+}
+
+/**
+ * Run the copy fn(arg) on a copy worker of branch and wait for it
+ */
+int bpool_copy(int branch, bpool_fn fn, void *arg, size_t argsize) {
+    if (!pools) return fn(arg);
+
+    return pool_call(&pools[BRANCHES_MAX + BRANCHES[branch].id], fn, arg, argsize, 0);
+}
+
+bool bpool_enabled(void) {
+    return pools != NULL;
+}
+
+struct lstat_call {
+    char path[PATHLEN_MAX];
+    struct stat st;
+    unsigned long long us;
+};
+
+static int lstat_fn(void *arg) {
+    struct lstat_call *c = arg;
+
+    unsigned long long start = now_us();
+    int res = lstat(c->path, &c->st);
+    c->us = now_us() - start;
+
+    return res;
+}
+
+/**
+ * lstat() of p on a worker of branch, the path is copied so the call may
+ * be given up after timeout_ms. If us is not NULL, it is set to the time
+ * the lstat() itself took, without the wait in the queue.
+ */
+int bpool_lstat(int branch, const char *p, struct stat *st, unsigned int timeout_ms,
+                unsigned long long *us) {
+    if (!pools) {
+        unsigned long long start = now_us();
+        int res = lstat(p, st);
+        if (us) *us = now_us() - start;
+        return res;
+    }
+
+    struct lstat_call c;
+    if (strlen(p) >= sizeof(c.path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(c.path, p);
+
+    int res = bpool_call(branch, lstat_fn, &c, sizeof(c), timeout_ms);
+    if (res == 0) *st = c.st;
+    if (us) *us = res == -1 && errno == ETIMEDOUT ? timeout_ms * 1000ULL : c.us;
+
+    return res;
+}
+
+struct open_call {
+    const char *path;
+    int flags;
+};
+
+static int open_fn(void *arg) {
+    struct open_call *c = arg;
+    return open(c->path, c->flags);
+}
+
+/**
+ * open() on a worker of branch
+ */
+int bpool_open(int branch, const char *p, int flags) {
+    if (!pools) return open(p, flags);
+
+    struct open_call c = { p, flags };
+    return bpool_call(branch, open_fn, &c, sizeof(c), 0);
+}
+
+struct pread_call {
+    int fd;
+    void *buf;
+    size_t size;
+    off_t offset;
+    ssize_t res;
+};
+
+static int pread_fn(void *arg) {
+    struct pread_call *c = arg;
+    c->res = pread(c->fd, c->buf, c->size, c->offset);
+    return c->res == -1 ? -1 : 0;
+}
+
+/**
+ * pread() on a worker of branch. Without a deadline the caller waits and
+ * buf stays valid.
+ */
+ssize_t bpool_pread(int branch, int fd, void *buf, size_t size, off_t offset) {
+    if (!pools || branch < 0) return pread(fd, buf, size, offset);
+
+    struct pread_call c = { fd, buf, size, offset, -1 };
+    if (bpool_call(branch, pread_fn, &c, sizeof(c), 0) == -1) return -1;
+
+    return c.res;
+}
+
+/**
+ * Has a call been running on branch for longer than timeout_ms?
+ */
+bool bpool_stuck(int branch, unsigned int timeout_ms) {
+    if (!pools) return false;
+
+    struct bpool *pool = &pools[BRANCHES[branch].id];
+    unsigned long long since = now_us() - timeout_ms * 1000ULL;
+    bool stuck = false;
+
+    pthread_mutex_lock(&pool->lock);
+
+    struct bpool_job *job;
+    for (job = pool->running; job && !stuck; job = job->rnext) stuck = job->start_us < since;
+
+    pthread_mutex_unlock(&pool->lock);
+    return stuck;
+}
+
+void bpool_stats(FILE *f) {
+    if (!pools) return;
+
+    int i;
+    for (i = 0; i < NBRANCHES; i++) {
+        struct bpool *pool = &pools[BRANCHES[i].id];
+
+        pthread_mutex_lock(&pool->lock);
+        fprintf(f, "bpool %s pending %u calls %lu timeouts %lu full %lu\n",
+                BRANCHES[i].path, pool->pending, pool->calls, pool->timeouts, pool->full);
+        pthread_mutex_unlock(&pool->lock);
+
+        pool = &pools[BRANCHES_MAX + BRANCHES[i].id];
+        if (!__sync_fetch_and_add(&pool->started, 0)) continue;
+
+        pthread_mutex_lock(&pool->lock);
+        fprintf(f, "bpool %s copy pending %u calls %lu full %lu\n",
+                BRANCHES[i].path, pool->pending, pool->calls, pool->full);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
@@ -0,0 +1,27 @@
+//
+// Per-branch worker threads for calls with a deadline
+//
+
+#ifndef ULAKEFS_FUSE_BPOOL_H
+#define ULAKEFS_FUSE_BPOOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+typedef int (*bpool_fn)(void *arg);
+
+int bpool_init(void);
+bool bpool_enabled(void);
+int bpool_call(int branch, bpool_fn fn, void *arg, size_t argsize, unsigned int timeout_ms);
+int bpool_copy(int branch, bpool_fn fn, void *arg, size_t argsize);
+int bpool_lstat(int branch, const char *p, struct stat *st, unsigned int timeout_ms,
+                unsigned long long *us);
+int bpool_open(int branch, const char *p, int flags);
+ssize_t bpool_pread(int branch, int fd, void *buf, size_t size, off_t offset);
+bool bpool_stuck(int branch, unsigned int timeout_ms);
+void bpool_stats(FILE *f);
+
+#endif //ULAKEFS_FUSE_BPOOL_H
@@ -0,0 +1,282 @@
+//
+// Snapshots of the branch list, changed at runtime through CTLDIR/control
+//
+/*
+ * The branch list is an immutable snapshot. Every fuse operation takes the
+ * latest one with branches_enter() and works on it until it returns, an
+ * operation on an open file takes the snapshot the file was opened with.
+ * BRANCHES and NBRANCHES read the snapshot of the calling thread, so
+ * readers never lock.
+ *
+ * Writes to CTLDIR/control build a new snapshot and publish it:
+ *
+ *   add /path[=RO|RW|IMMUTABLE] [position]
+ *   remove /path
+ *   move /path position
+ *   mode /path RO|RW
+ *
+ * Positions count from 0, the first branch has the highest priority.
+ * Paths are as seen by the mounted daemon, so below -o chroot.
+ *
+ * Old snapshots are never freed, threads may still run on them. A change
+ * costs one array of branch entries, the paths are shared. Every branch
+ * keeps the id it got when it was added, per-branch state of the other
+ * modules is indexed by it and survives reordering.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "branches.h"
+#include "manifest.h"
+
+__thread const branch_set_t *branch_snap;
+
+static branch_set_t *published;
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER; // serializes writers
+static int next_id;
+static unsigned long generation;
+
+/**
+ * Publish the mount-time branches of uopt as the first snapshot, called
+ * from main() after ulakefs_post_opts()
+ */
+int branches_init(void) {
+    branch_set_t *set = malloc(sizeof(branch_set_t));
+    if (!set) RETURN(-ENOMEM);
+
+    set->nbranches = uopt.nbranches;
+    set->branches = uopt.branches;
+
+    int i;
+    for (i = 0; i < set->nbranches; i++) set->branches[i].id = next_id++;
+
+    if (next_id > BRANCHES_MAX) {
+        fprintf(stderr, "At most %d branches are supported\n", BRANCHES_MAX);
+        free(set);
+        RETURN(-EINVAL);
+    }
+
+    published = set;
+    RETURN(0);
+}
+
+/**
+ * Work on set from now on, NULL takes the latest snapshot. Called at the
+ * start of every fuse operation and by background threads before they
+ * look at the branches.
+ */
+void branches_enter(const branch_set_t *set) {
+    branch_snap = set ? set : __sync_fetch_and_add(&published, 0);
+}
+
+/**
+ * Take the latest snapshot for a thread which did not enter one yet
+ */
+const branch_set_t *branches_pin(void) {
+    branches_enter(NULL);
+    return branch_snap;
+}
+
+/**
+ * Index of the branch with id in the snapshot of the calling thread,
+ * -1 if it is not part of it
+ */
+int branches_index(int id) {
+    const branch_set_t *set = BRANCH_SET();
+
+    int i;
+    for (i = 0; i < set->nbranches; i++) {
+        if (set->branches[i].id == id) return i;
+    }
+
+    return -1;
+}
+
+/**
+ * Index of path in set, path with or without trailing slash
+ */
+static int find_path(const branch_set_t *set, const char *path) {
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') len--;
+
+    int i;
+    for (i = 0; i < set->nbranches; i++) {
+        const char *p = set->branches[i].path;
+        if (strncmp(p, path, len) == 0 && p[len] == '/' && p[len + 1] == '\0') return i;
+    }
+
+    return -1;
+}
+
+static int parse_position(const char *arg, int max) {
+    if (!arg) return max;
+
+    char *end;
+    long pos = strtol(arg, &end, 10);
+    if (*end || pos < 0 || pos > max) return -1;
+
+    return pos;
+}
+
+/**
+ * Open a new branch like ulakefs_post_opts() does at mount time
+ */
+static int branch_open(branch_entry_t *b, const char *path, const char *mode) {
+    if (path[0] != '/') return -EINVAL;
+
+    memset(b, 0, sizeof(*b));
+    if (mode && strcasecmp(mode, "rw") == 0) {
+        b->rw = 1;
+    } else if (mode && strcasecmp(mode, "immutable") == 0) {
+        b->immutable = 1;
+    } else if (mode && strcasecmp(mode, "ro") != 0) {
+        return -EINVAL;
+    }
+
+    b->path = malloc(strlen(path) + 2);
+    if (!b->path) return -ENOMEM;
+    strcpy(b->path, path);
+    if (b->path[strlen(b->path) - 1] != '/') strcat(b->path, "/");
+
+    // prevents accidental umounts, see ulakefs_post_opts()
+    b->fd = open(b->path, O_RDONLY | O_DIRECTORY);
+    if (b->fd == -1) {
+        int err = errno;
+        free(b->path);
+        return -err;
+    }
+    b->path_len = strlen(b->path);
+
+    return 0;
+}
+
+/**
+ * Run a command of CTLDIR/control, returns 0 or -errno
+ */
+int branches_control(char *cmd) {
+    char *args[4];
+    int nargs = 0;
+
+    char *tok;
+    while ((tok = strsep(&cmd, " \t")) != NULL) {
+        if (!*tok) continue;
+        if (nargs == 4) return -EINVAL;
+        args[nargs++] = tok;
+    }
+    if (!nargs) return 0;
+
+    pthread_mutex_lock(&control_lock);
+
+    const branch_set_t *cur = __sync_fetch_and_add(&published, 0);
+    branch_set_t *set = malloc(sizeof(branch_set_t));
+    branch_entry_t *b = malloc((cur->nbranches + 1) * sizeof(branch_entry_t));
+    if (!set || !b) {
+        free(set);
+        free(b);
+        pthread_mutex_unlock(&control_lock);
+        return -ENOMEM;
+    }
+    memcpy(b, cur->branches, cur->nbranches * sizeof(branch_entry_t));
+    set->branches = b;
+    set->nbranches = cur->nbranches;
+
+    int res = 0;
+    int i = nargs > 1 ? find_path(set, args[1]) : -1;
+
+    if (strcmp(args[0], "add") == 0 && (nargs == 2 || nargs == 3)) {
+        char *mode = args[1];
+        char *path = strsep(&mode, "=");
+        int pos = parse_position(nargs == 3 ? args[2] : NULL, set->nbranches);
+
+        branch_entry_t nb;
+        if (pos < 0) {
+            res = -EINVAL;
+        } else if (find_path(set, path) != -1) {
+            res = -EEXIST;
+        } else if (next_id >= BRANCHES_MAX) {
+            res = -ENOSPC;
+        } else if ((res = branch_open(&nb, path, mode)) == 0) {
+            nb.id = next_id++;
+            manifest_load(&nb);
+            memmove(&b[pos + 1], &b[pos], (set->nbranches - pos) * sizeof(branch_entry_t));
+            b[pos] = nb;
+            set->nbranches++;
+        }
+    } else if (strcmp(args[0], "remove") == 0 && nargs == 2) {
+        if (i < 0) {
+            res = -ENOENT;
+        } else if (set->nbranches == 1) {
+            res = -EBUSY;
+        } else {
+            // the fd stays open, files of older snapshots still use the branch
+            memmove(&b[i], &b[i + 1], (set->nbranches - i - 1) * sizeof(branch_entry_t));
+            set->nbranches--;
+        }
+    } else if (strcmp(args[0], "move") == 0 && nargs == 3) {
+        int pos = parse_position(args[2], set->nbranches - 1);
+        if (i < 0) {
+            res = -ENOENT;
+        } else if (pos < 0) {
+            res = -EINVAL;
+        } else {
+            branch_entry_t mb = b[i];
+            memmove(&b[i], &b[i + 1], (set->nbranches - i - 1) * sizeof(branch_entry_t));
+            memmove(&b[pos + 1], &b[pos], (set->nbranches - 1 - pos) * sizeof(branch_entry_t));
+            b[pos] = mb;
+        }
+    } else if (strcmp(args[0], "mode") == 0 && nargs == 3) {
+        if (i < 0) {
+            res = -ENOENT;
+        } else if (strcasecmp(args[2], "rw") == 0 && !b[i].mirror) {
+            b[i].rw = 1;
+            b[i].immutable = 0; // its manifest gets stale
+        } else if (strcasecmp(args[2], "ro") == 0) {
+            b[i].rw = 0;
+        } else {
+            res = -EINVAL; // mirrors are read-only
+        }
+    } else {
+        res = -EINVAL;
+    }
+
+    if (res) {
+        pthread_mutex_unlock(&control_lock);
+        free(b);
+        free(set);
+        return res;
+    }
+
+    __sync_synchronize();
+    (void)__sync_lock_test_and_set(&published, set);
+    generation++;
+
+    USYSLOG(LOG_INFO, "branch list changed: %s %s\n", args[0], args[1]);
+
+    pthread_mutex_unlock(&control_lock);
+    return 0;
+}
+
+void branches_stats(FILE *f) {
+    pthread_mutex_lock(&control_lock);
+
+    const branch_set_t *set = published;
+    fprintf(f, "branches_generation %lu\n", generation);
+
+    int i;
+    for (i = 0; i < set->nbranches; i++) {
+        fprintf(f, "branch %d %s %s id %d\n", i, set->branches[i].path,
+                set->branches[i].rw ? "RW" : "RO", set->branches[i].id);
+    }
+
+    pthread_mutex_unlock(&control_lock);
+}
@@ -0,0 +1,31 @@
+//
+// Snapshots of the branch list, changed at runtime through CTLDIR/control
+//
+
+#ifndef ULAKEFS_FUSE_BRANCHES_H
+#define ULAKEFS_FUSE_BRANCHES_H
+
+#include <stdio.h>
+#include "Ulakefs.h"
+
+typedef struct branch_set {
+    int nbranches;
+    branch_entry_t *branches;
+} branch_set_t;
+
+// snapshot the calling thread works on, see branches_enter()
+extern __thread const branch_set_t *branch_snap;
+
+const branch_set_t *branches_pin(void);
+
+#define BRANCH_SET() (branch_snap ? branch_snap : branches_pin())
+#define BRANCHES (BRANCH_SET()->branches)
+#define NBRANCHES (BRANCH_SET()->nbranches)
+
+int branches_init(void);
+void branches_enter(const branch_set_t *set);
+int branches_index(int id);
+int branches_control(char *cmd);
+void branches_stats(FILE *f);
+
+#endif //ULAKEFS_FUSE_BRANCHES_H
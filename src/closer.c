@@ -0,0 +1,126 @@
+//
+// Background closing of branch fds on release()
+//
+/*
+ * close() of a file on NFS flushes its dirty data and may block for a long
+ * time. The return value of release() is not seen by anybody, so with
+ * -o async_close the fds are handed to closer threads instead. The queue
+ * is bounded, once it is full release() closes inline again. Errors are
+ * counted and logged.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "closer.h"
+
+#define CLOSER_THREADS 4
+
+static pthread_mutex_t closer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t closer_cond = PTHREAD_COND_INITIALIZER;
+
+static int *queue;		// ring buffer of fds, NULL if disabled
+static unsigned int qhead, qlen;
+
+static unsigned long st_queued, st_inline, st_errors;
+
+static void *closer_thread(void *arg) {
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&closer_lock);
+        while (!qlen) pthread_cond_wait(&closer_cond, &closer_lock);
+
+        int fd = queue[qhead];
+        qhead = (qhead + 1) % uopt.async_close;
+        qlen--;
+        pthread_mutex_unlock(&closer_lock);
+
+        if (close(fd) == -1) {
+            int err = errno;
+            __sync_fetch_and_add(&st_errors, 1);
+            USYSLOG(LOG_ERR, "%s: closing fd %d failed: %s\n",
+                    __func__, fd, strerror(err));
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the closer threads, called from ulakefs_init()
+ */
+int closer_init(void) {
+    if (!uopt.async_close) RETURN(0);
+
+    int *q = malloc(uopt.async_close * sizeof(int));
+    if (!q) RETURN(-ENOMEM);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    int i, res = 0;
+    for (i = 0; i < CLOSER_THREADS; i++) {
+        pthread_t thread;
+        res = pthread_create(&thread, &attr, closer_thread, NULL);
+        if (res) break;
+    }
+    pthread_attr_destroy(&attr);
+
+    // threads might be waiting already, they never touch the queue if it
+    // is not published
+    if (i == 0) {
+        free(q);
+        uopt.async_close = 0;
+        RETURN(-res);
+    }
+
+    pthread_mutex_lock(&closer_lock);
+    queue = q;
+    pthread_mutex_unlock(&closer_lock);
+
+    RETURN(0);
+}
+
+/**
+ * close() fd now or later. Returns 0 if fd was queued, otherwise the result
+ * of close().
+ */
+int closer_close(int fd) {
+    if (!uopt.async_close) return close(fd);
+
+    pthread_mutex_lock(&closer_lock);
+
+    if (!queue || qlen == uopt.async_close) {
+        if (queue) st_inline++;
+        pthread_mutex_unlock(&closer_lock);
+        return close(fd);
+    }
+
+    queue[(qhead + qlen) % uopt.async_close] = fd;
+    qlen++;
+    st_queued++;
+
+    pthread_cond_signal(&closer_cond);
+    pthread_mutex_unlock(&closer_lock);
+
+    return 0;
+}
+
+void closer_stats(FILE *f) {
+    if (!uopt.async_close) return;
+
+    pthread_mutex_lock(&closer_lock);
+    fprintf(f, "closer_queued %lu\n", st_queued);
+    fprintf(f, "closer_inline %lu\n", st_inline);
+    fprintf(f, "closer_pending %u\n", qlen);
+    fprintf(f, "closer_errors %lu\n", st_errors);
+    pthread_mutex_unlock(&closer_lock);
+}
@@ -0,0 +1,17 @@
+//
+// Background closing of branch fds on release()
+//
+
+#ifndef ULAKEFS_FUSE_CLOSER_H
+#define ULAKEFS_FUSE_CLOSER_H
+
+#include <stdio.h>
+
+// queue length of -o async_close without a value
+#define CLOSER_QUEUE 1024
+
+int closer_init(void);
+int closer_close(int fd);
+void closer_stats(FILE *f);
+
+#endif //ULAKEFS_FUSE_CLOSER_H
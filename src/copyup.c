@@ -0,0 +1,392 @@
+//
+// Copy-up scheduler, runs copy-on-write copies on background threads
+//
+/*
+ * Large copy-ups used to run on the FUSE worker thread at full speed and
+ * starved foreground reads on the same disks. With -o copyup_threads=N
+ * regular files are copied by a pool of scheduler threads instead. Callers
+ * either wait for their copy (copyup_run()) or hand it off completely
+ * (copyup_queue()). Concurrent copy-ups of the same file are coalesced
+ * into a single job.
+ *
+ * Only queued copies run with the lowered I/O priority and share the
+ * optional bandwidth cap. A copy somebody waits for, e.g. the COW of an
+ * open(), runs at normal priority, and a queued copy is raised to it as
+ * soon as a waiter joins it. The COW paths always wait, copyup_queue() is
+ * used by the tiering engine.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "general.h"
+#include "hashtable.h"
+#include "copyup.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+#ifdef __linux__
+// from linux/ioprio.h, which is not always installed
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_NONE 0
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#endif
+
+struct copyup_job {
+    struct cow cow;
+    struct stat stat;
+    char from[PATHLEN_MAX];
+    char to[PATHLEN_MAX];
+
+    int res;		// copy_file() result
+    bool done;
+    pid_t tid;		// of the thread copying, 0 while queued
+    int refs;		// the queue and every waiter hold a reference
+    pthread_cond_t cond;	// signalled once done is set
+
+    copyup_done_t done_cb;	// optional, for copyup_queue()
+    void *arg;
+
+    struct copyup_job *next;
+};
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER; // queue not empty
+static struct copyup_job *queue_head, *queue_tail;
+static struct hashtable *inflight; // to_path -> job, for queued and active jobs
+static bool started;
+
+// statistics, protected by sched_lock
+static unsigned long st_queued, st_active, st_completed, st_failed, st_coalesced, st_raised;
+
+// bandwidth cap and throughput, protected by bw_lock
+static pthread_mutex_t bw_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t bw_next;	// earliest time (ns) the next chunk may be copied
+static uint64_t bytes_total;
+static uint64_t rate_start, rate_bytes, rate_bps;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * Set the I/O priority of the copy-up thread tid, lowered for background
+ * copies and the default otherwise
+ */
+static void set_ioprio(pid_t tid, bool background) {
+#ifdef __linux__
+    int prio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_NONE, 0);
+    if (background && uopt.copyup_ioprio == COPYUP_IOPRIO_IDLE)
+        prio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+    else if (background)
+        prio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, uopt.copyup_ioprio);
+
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, prio) == -1)
+        USYSLOG(LOG_WARNING, "%s: ioprio_set failed: %s\n", __func__, strerror(errno));
+#else
+    (void)tid;
+    (void)background;
+#endif
+}
+
+/**
+ * Drop a job reference, sched_lock MUST be held
+ */
+static void job_put(struct copyup_job *job) {
+    if (--job->refs > 0) return;
+
+    pthread_cond_destroy(&job->cond);
+    free(job);
+}
+
+/**
+ * Allocate a job for cow and make it visible to other copy-ups of the
+ * same file, sched_lock MUST be held. Background jobs are throttled.
+ */
+static struct copyup_job *job_new(struct cow *cow, bool background) {
+    struct copyup_job *job = calloc(1, sizeof(*job));
+    if (!job) return NULL;
+
+    char *key = strdup(cow->to_path);
+    if (!key) {
+        free(job);
+        return NULL;
+    }
+
+    snprintf(job->from, PATHLEN_MAX, "%s", cow->from_path);
+    snprintf(job->to, PATHLEN_MAX, "%s", cow->to_path);
+    memcpy(&job->stat, cow->stat, sizeof(job->stat));
+
+    job->cow = *cow;
+    job->cow.from_path = job->from;
+    job->cow.to_path = job->to;
+    job->cow.stat = &job->stat;
+    job->cow.background = background;
+
+    job->refs = 1; // the queue
+    pthread_cond_init(&job->cond, NULL);
+
+    hashtable_insert(inflight, key, job);
+
+    return job;
+}
+
+/**
+ * Append a job to the queue, sched_lock MUST be held
+ */
+static void job_enqueue(struct copyup_job *job) {
+    if (queue_tail)
+        queue_tail->next = job;
+    else
+        queue_head = job;
+    queue_tail = job;
+
+    st_queued++;
+    pthread_cond_signal(&sched_cond);
+}
+
+static void *copyup_thread(void *arg) {
+    (void)arg;
+
+#ifdef __linux__
+    pid_t tid = syscall(SYS_gettid);
+#else
+    pid_t tid = 0;
+#endif
+    bool lowered = false;	// I/O priority of this thread
+
+    pthread_mutex_lock(&sched_lock);
+    while (1) {
+        while (!queue_head) pthread_cond_wait(&sched_cond, &sched_lock);
+
+        struct copyup_job *job = queue_head;
+        queue_head = job->next;
+        if (!queue_head) queue_tail = NULL;
+        st_queued--;
+        st_active++;
+        job->tid = tid;
+
+        // copyup_run() raises the priority of a job it waits for
+        bool background = job->cow.background;
+        if (background != lowered) {
+            set_ioprio(0, background);
+            lowered = background;
+        }
+        pthread_mutex_unlock(&sched_lock);
+
+        int res = copy_file(&job->cow);
+
+        pthread_mutex_lock(&sched_lock);
+        st_active--;
+        if (!job->cow.background) lowered = false;
+        if (res)
+            st_failed++;
+        else
+            st_completed++;
+
+        hashtable_remove(inflight, job->to);
+        job->res = res;
+        job->done = true;
+        pthread_cond_broadcast(&job->cond);
+
+        if (job->done_cb) {
+            pthread_mutex_unlock(&sched_lock);
+            job->done_cb(job->to, res, job->arg);
+            pthread_mutex_lock(&sched_lock);
+        }
+
+        job_put(job);
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the copy-up threads. Called from ulakefs_init(), threads created
+ * before fuse_main() daemonizes would not survive the fork.
+ */
+int copyup_init(void) {
+    if (uopt.copyup_threads <= 0) RETURN(0);
+
+    inflight = create_hashtable(16, string_hash, string_equal);
+    if (!inflight) RETURN(-ENOMEM);
+
+    rate_start = now_ns();
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    int i;
+    for (i = 0; i < uopt.copyup_threads; i++) {
+        pthread_t thread;
+        int res = pthread_create(&thread, &attr, copyup_thread, NULL);
+        if (res != 0) {
+            USYSLOG(LOG_ERR, "Failed to start copy-up thread: %s\n", strerror(res));
+            // copies are done inline if not even a single thread is there
+            if (i == 0) break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    if (i > 0) started = true;
+
+    RETURN(started ? 0 : -EAGAIN);
+}
+
+/**
+ * Are copy-ups done by the scheduler threads?
+ */
+bool copyup_enabled(void) {
+    return started;
+}
+
+/**
+ * Copy a regular file on a scheduler thread and wait until it is done.
+ * Returns the copy_file() result.
+ */
+int copyup_run(struct cow *cow) {
+    DBG("from %s to %s\n", cow->from_path, cow->to_path);
+
+    pthread_mutex_lock(&sched_lock);
+
+    struct copyup_job *job = hashtable_search(inflight, cow->to_path);
+    if (job) {
+        // somebody else is already copying this file
+        st_coalesced++;
+    } else {
+        job = job_new(cow, false);
+        if (!job) {
+            pthread_mutex_unlock(&sched_lock);
+            RETURN(copy_file(cow));
+        }
+        job_enqueue(job);
+    }
+
+    // nobody waits behind a bandwidth cap or an idle I/O class
+    if (job->cow.background) {
+        job->cow.background = false;
+        if (job->tid) set_ioprio(job->tid, false);
+        st_raised++;
+    }
+
+    job->refs++;
+    while (!job->done) pthread_cond_wait(&job->cond, &sched_lock);
+
+    int res = job->res;
+    job_put(job);
+
+    pthread_mutex_unlock(&sched_lock);
+
+    RETURN(res);
+}
+
+/**
+ * Queue a copy of a regular file without waiting for it. done (optional)
+ * is called from the scheduler thread once the copy finished.
+ * Returns -EALREADY if this file is already being copied.
+ */
+int copyup_queue(struct cow *cow, copyup_done_t done, void *arg) {
+    DBG("from %s to %s\n", cow->from_path, cow->to_path);
+
+    if (!started) RETURN(-ENOSYS);
+
+    pthread_mutex_lock(&sched_lock);
+
+    if (hashtable_search(inflight, cow->to_path)) {
+        pthread_mutex_unlock(&sched_lock);
+        RETURN(-EALREADY);
+    }
+
+    struct copyup_job *job = job_new(cow, true);
+    if (!job) {
+        pthread_mutex_unlock(&sched_lock);
+        RETURN(-ENOMEM);
+    }
+    job->done_cb = done;
+    job->arg = arg;
+    job_enqueue(job);
+
+    pthread_mutex_unlock(&sched_lock);
+
+    RETURN(0);
+}
+
+/**
+ * Account bytes copied by a background copy and, if -o copyup_bwlimit
+ * is set, sleep long enough to stay below the bandwidth cap.
+ */
+void copyup_throttle(size_t bytes) {
+    uint64_t now = now_ns();
+    uint64_t start = now;
+
+    pthread_mutex_lock(&bw_lock);
+
+    bytes_total += bytes;
+    rate_bytes += bytes;
+    if (now - rate_start >= NSEC_PER_SEC) {
+        rate_bps = rate_bytes * NSEC_PER_SEC / (now - rate_start);
+        rate_bytes = 0;
+        rate_start = now;
+    }
+
+    if (uopt.copyup_bwlimit) {
+        // no credit for idle time, otherwise we would burst after a pause
+        if (bw_next > now) start = bw_next;
+        bw_next = start + bytes * NSEC_PER_SEC / uopt.copyup_bwlimit;
+    }
+
+    pthread_mutex_unlock(&bw_lock);
+
+    if (start > now) {
+        uint64_t delay = start - now;
+        struct timespec ts = { delay / NSEC_PER_SEC, delay % NSEC_PER_SEC };
+        nanosleep(&ts, NULL);
+    }
+}
+
+/**
+ * Print queue depth and throughput for the stats control file
+ */
+void copyup_stats(FILE *f) {
+    pthread_mutex_lock(&sched_lock);
+    fprintf(f, "copyup_threads %d\n", started ? uopt.copyup_threads : 0);
+    fprintf(f, "copyup_queued %lu\n", st_queued);
+    fprintf(f, "copyup_active %lu\n", st_active);
+    fprintf(f, "copyup_completed %lu\n", st_completed);
+    fprintf(f, "copyup_failed %lu\n", st_failed);
+    fprintf(f, "copyup_coalesced %lu\n", st_coalesced);
+    fprintf(f, "copyup_raised %lu\n", st_raised);
+    pthread_mutex_unlock(&sched_lock);
+
+    uint64_t now = now_ns();
+
+    pthread_mutex_lock(&bw_lock);
+    uint64_t rate = rate_bps;
+    // the rate window is only rolled by copies, so account for idle time here
+    if (now - rate_start >= 2 * NSEC_PER_SEC)
+        rate = rate_bytes * NSEC_PER_SEC / (now - rate_start);
+    fprintf(f, "copyup_bytes %llu\n", (unsigned long long)bytes_total);
+    fprintf(f, "copyup_rate_bps %llu\n", (unsigned long long)rate);
+    fprintf(f, "copyup_bwlimit_bps %llu\n", uopt.copyup_bwlimit);
+    pthread_mutex_unlock(&bw_lock);
+}
@@ -0,0 +1,26 @@
+//
+// Copy-up scheduler, runs copy-on-write copies on background threads
+//
+
+#ifndef ULAKEFS_FUSE_COPYUP_H
+#define ULAKEFS_FUSE_COPYUP_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "general.h"
+
+// -o copyup_ioprio=idle, otherwise the value is the best-effort level 0-7
+#define COPYUP_IOPRIO_IDLE -1
+
+// callback for copyup_queue(), res is the copy_file() result
+typedef void (*copyup_done_t)(const char *to_path, int res, void *arg);
+
+int copyup_init(void);
+bool copyup_enabled(void);
+int copyup_run(struct cow *cow);
+int copyup_queue(struct cow *cow, copyup_done_t done, void *arg);
+void copyup_throttle(size_t bytes);
+void copyup_stats(FILE *f);
+
+#endif //ULAKEFS_FUSE_COPYUP_H
@@ -0,0 +1,266 @@
+//
+// Virtual statistics and control files below CTLDIR
+//
+/*
+ * CTLDIR does not exist on any branch, getattr(), readdir() and open()
+ * answer it from the table below. The content of a file is generated
+ * on open() into an anonymous file, so read() and release() work on
+ * the ufile exactly as for files on a branch.
+ *
+ * Files with a store() handler accept writes instead, every line written
+ * is passed to it as a command (see branches_control()). Only root and
+ * the user running the daemon may open them.
+ */
+#define _GNU_SOURCE
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "general.h"
+#include "copyup.h"
+#include "pagecache.h"
+#include "fdcache.h"
+#include "dirmap.h"
+#include "wostore.h"
+#include "manifest.h"
+#include "closer.h"
+#include "syncgroup.h"
+#include "readahead.h"
+#include "statfs.h"
+#include "policy.h"
+#include "tier.h"
+#include "mirror.h"
+#include "stripe.h"
+#include "health.h"
+#include "session.h"
+#include "branches.h"
+#include "ctl.h"
+
+struct ctl_file {
+    const char *name;
+    mode_t mode;
+    void (*show)(FILE *f);	// writes the file content on open()
+    int (*store)(char *cmd);	// runs a written line, 0 or -errno
+};
+
+static void show_stats(FILE *f) {
+    copyup_stats(f);
+    pagecache_stats(f);
+    fdcache_stats(f);
+    dirmap_stats(f);
+    manifest_stats(f);
+    wostore_stats(f);
+    closer_stats(f);
+    syncgroup_stats(f);
+    readahead_stats(f);
+    statfs_stats(f);
+    policy_stats(f);
+    tier_stats(f);
+    mirror_stats(f);
+    stripe_stats(f);
+    health_stats(f);
+    session_stats(f);
+    branches_stats(f);
+}
+
+static const struct ctl_file ctl_files[] = {
+    { "control", S_IFREG | 0200, NULL, branches_control },
+    { "stats", S_IFREG | 0444, show_stats, NULL },
+};
+
+#define NCTL_FILES (sizeof(ctl_files) / sizeof(ctl_files[0]))
+
+static time_t ctl_time; // reported as mtime, so tools do not see a 1970 file
+
+/**
+ * Check if path is CTLDIR or below
+ */
+bool ctl_path(const char *path) {
+    size_t len = strlen(CTLDIR);
+
+    if (strncmp(path, CTLDIR, len) != 0) return false;
+
+    return path[len] == '\0' || path[len] == '/';
+}
+
+/**
+ * Return the table entry for path, NULL for CTLDIR itself or unknown names
+ */
+static const struct ctl_file *ctl_lookup(const char *path) {
+    const char *name = path + strlen(CTLDIR);
+
+    if (*name != '/') return NULL;
+    name++;
+
+    unsigned int i;
+    for (i = 0; i < NCTL_FILES; i++) {
+        if (strcmp(name, ctl_files[i].name) == 0) return &ctl_files[i];
+    }
+
+    return NULL;
+}
+
+int ctl_getattr(const char *path, struct stat *stbuf) {
+    DBG("%s\n", path);
+
+    if (!ctl_time) ctl_time = time(NULL);
+
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = ctl_time;
+
+    if (strcmp(path, CTLDIR) == 0) {
+        stbuf->st_mode = S_IFDIR | 0555;
+        stbuf->st_nlink = 1; // see ulakefs_getattr() on directory nlink
+        RETURN(0);
+    }
+
+    const struct ctl_file *cf = ctl_lookup(path);
+    if (!cf) RETURN(-ENOENT);
+
+    // size is unknown until the content is generated, files are opened
+    // with direct_io so the kernel does not rely on it
+    stbuf->st_mode = cf->mode;
+    stbuf->st_nlink = 1;
+
+    RETURN(0);
+}
+
+int ctl_readdir(const char *path, void *buf, fuse_fill_dir_t filler) {
+    DBG("%s\n", path);
+
+    if (strcmp(path, CTLDIR) != 0) RETURN(-ENOTDIR);
+
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+
+    unsigned int i;
+    for (i = 0; i < NCTL_FILES; i++) {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_mode = ctl_files[i].mode;
+        if (filler(buf, ctl_files[i].name, &st, 0)) break;
+    }
+
+    RETURN(0);
+}
+
+/**
+ * Anonymous file for the generated content
+ */
+static int ctl_tmpfd(void) {
+#ifdef __linux__
+    return memfd_create("ulakefs-ctl", MFD_CLOEXEC);
+#else
+    FILE *f = tmpfile();
+    if (!f) return -1;
+    int fd = dup(fileno(f));
+    fclose(f);
+    return fd;
+#endif
+}
+
+int ctl_open(const char *path, struct fuse_file_info *fi) {
+    DBG("%s\n", path);
+
+    const struct ctl_file *cf = ctl_lookup(path);
+    if (!cf) RETURN(strcmp(path, CTLDIR) == 0 ? -EISDIR : -ENOENT);
+
+    int acc = fi->flags & O_ACCMODE;
+    if (cf->store) {
+        if (acc != O_WRONLY) RETURN(-EACCES);
+
+        // without default_permissions the mode of the file is not checked
+        uid_t uid = fuse_get_context()->uid;
+        if (uid != 0 && uid != getuid()) RETURN(-EACCES);
+    } else if (acc != O_RDONLY) {
+        RETURN(-EACCES);
+    }
+
+    int fd = ctl_tmpfd();
+    if (fd == -1) RETURN(-errno);
+
+    if (cf->store) goto done; // nothing to show, writes go to ctl_write()
+
+    // fclose() closes the stream fd, fd itself is kept for read()
+    int sfd = dup(fd);
+    FILE *f = sfd == -1 ? NULL : fdopen(sfd, "w");
+    if (!f) {
+        int err = errno;
+        if (sfd != -1) close(sfd);
+        close(fd);
+        RETURN(-err);
+    }
+
+    cf->show(f);
+
+    if (fclose(f)) {
+        int err = errno;
+        close(fd);
+        RETURN(-err);
+    }
+
+done:;
+    ufile_t *uf = ufile_new(fd, -1);
+    if (!uf) {
+        close(fd);
+        RETURN(-ENOMEM);
+    }
+
+    fi->direct_io = 1;
+    fi->fh = (uintptr_t)uf;
+
+    RETURN(0);
+}
+
+/**
+ * Pass the lines of a write() to an open control file to its store()
+ * handler. A write is expected to hold complete lines, as echo does.
+ */
+int ctl_write(const char *path, const char *buf, size_t size) {
+    DBG("%s\n", path);
+
+    const struct ctl_file *cf = path ? ctl_lookup(path) : NULL;
+    if (!cf || !cf->store) RETURN(-EBADF);
+
+    char *cmds = strndup(buf, size);
+    if (!cmds) RETURN(-ENOMEM);
+
+    char *rest = cmds, *line;
+    int res = 0;
+    while (!res && (line = strsep(&rest, "\n")) != NULL) {
+        res = cf->store(line);
+    }
+
+    free(cmds);
+
+    if (res) RETURN(res);
+    RETURN((int)size);
+}
+
+/**
+ * truncate() of a control file, shells open them with O_TRUNC
+ */
+int ctl_truncate(const char *path) {
+    DBG("%s\n", path);
+
+    const struct ctl_file *cf = ctl_lookup(path);
+    if (!cf) RETURN(-ENOENT);
+    if (!cf->store) RETURN(-EACCES);
+
+    RETURN(0);
+}
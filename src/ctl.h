@@ -0,0 +1,18 @@
+//
+// Virtual statistics and control files below CTLDIR
+//
+
+#ifndef ULAKEFS_FUSE_CTL_H
+#define ULAKEFS_FUSE_CTL_H
+
+#include <fuse.h>
+#include <stdbool.h>
+
+bool ctl_path(const char *path);
+int ctl_getattr(const char *path, struct stat *stbuf);
+int ctl_readdir(const char *path, void *buf, fuse_fill_dir_t filler);
+int ctl_open(const char *path, struct fuse_file_info *fi);
+int ctl_write(const char *path, const char *buf, size_t size);
+int ctl_truncate(const char *path);
+
+#endif //ULAKEFS_FUSE_CTL_H
@@ -0,0 +1,216 @@
+//
+// Direct I/O policy for large streaming files
+//
+/*
+ * Files opened with fi->direct_io bypass the page cache of the fuse inode,
+ * so a sequential scan of a huge file is cached once (by the branch
+ * filesystem) instead of twice. With -o direct_io_odirect read-only opens
+ * also set O_DIRECT on the branch fd and the data is not cached at all.
+ *
+ * exec() and shared mmap() do not work on direct_io files, therefore
+ * files with any x-bit set are never opened this way.
+ */
+#define _GNU_SOURCE // O_DIRECT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "directio.h"
+
+// O_DIRECT alignment of offsets, sizes and buffers, suits 512 and 4K devices
+#define DIRECTIO_ALIGN 4096
+#define ALIGN_DOWN(x) ((x) & ~((off_t)DIRECTIO_ALIGN - 1))
+#define ALIGN_UP(x) ALIGN_DOWN((x) + DIRECTIO_ALIGN - 1)
+
+// per thread bounce buffer for unaligned O_DIRECT reads
+struct bounce {
+    char *buf;
+    size_t size;
+};
+
+static pthread_key_t bounce_key;
+static pthread_once_t bounce_once = PTHREAD_ONCE_INIT;
+
+static void bounce_free(void *arg) {
+    struct bounce *b = arg;
+
+    free(b->buf);
+    free(b);
+}
+
+static void bounce_key_create(void) {
+    pthread_key_create(&bounce_key, bounce_free);
+}
+
+/**
+ * Return an aligned buffer of at least size bytes, owned by this thread
+ */
+static char *bounce_get(size_t size) {
+    pthread_once(&bounce_once, bounce_key_create);
+
+    struct bounce *b = pthread_getspecific(bounce_key);
+    if (!b) {
+        b = calloc(1, sizeof(*b));
+        if (!b) return NULL;
+        if (pthread_setspecific(bounce_key, b)) {
+            free(b);
+            return NULL;
+        }
+    }
+
+    if (b->size < size) {
+        void *buf;
+        if (posix_memalign(&buf, DIRECTIO_ALIGN, size)) return NULL;
+        free(b->buf);
+        b->buf = buf;
+        b->size = size;
+    }
+
+    return b->buf;
+}
+
+/**
+ * Parse the colon separated list of -o direct_io_prefix=/a:/b
+ */
+int directio_add_prefixes(const char *arg) {
+    char *buf = strdup(arg);
+    if (!buf) return -1;
+
+    char *ptr = buf;
+    char *prefix;
+    while ((prefix = strsep(&ptr, ROOT_SEP)) != NULL) {
+        size_t len = strlen(prefix);
+        while (len > 1 && prefix[len - 1] == '/') prefix[--len] = '\0';
+
+        if (prefix[0] != '/') {
+            fprintf(stderr, "direct_io_prefix %s is not absolute\n", prefix);
+            free(buf);
+            return -1;
+        }
+
+        char **p = realloc(uopt.direct_io_prefixes,
+                           (uopt.direct_io_nprefixes + 1) * sizeof(char *));
+        if (!p) {
+            free(buf);
+            return -1;
+        }
+        uopt.direct_io_prefixes = p;
+        uopt.direct_io_prefixes[uopt.direct_io_nprefixes++] = strdup(prefix);
+    }
+
+    free(buf);
+    return 0;
+}
+
+/**
+ * Check if path is one of the configured prefixes or below
+ */
+static bool directio_path(const char *path) {
+    if (!uopt.direct_io_nprefixes) return uopt.direct_io_auto;
+
+    int i;
+    for (i = 0; i < uopt.direct_io_nprefixes; i++) {
+        const char *prefix = uopt.direct_io_prefixes[i];
+        size_t len = strlen(prefix);
+
+        if (len == 1) return true; // "/"
+        if (strncmp(path, prefix, len) == 0
+            && (path[len] == '\0' || path[len] == '/'))
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * Decide on direct_io for an opened file, called by open() and create()
+ */
+int directio_open(const char *path, ufile_t *uf, struct fuse_file_info *fi) {
+    if (!directio_path(path)) return 0;
+
+    struct stat st;
+    if (fstat(uf->fd, &st) == -1) return 0;
+
+    if (!S_ISREG(st.st_mode)) return 0;
+    if (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) return 0; // exec() fails
+
+    fi->direct_io = 1;
+    fi->keep_cache = 0;
+
+#ifdef O_DIRECT
+    if (!uopt.direct_io_odirect || (fi->flags & O_ACCMODE) != O_RDONLY) return 1;
+
+    // the fd is shared by other opens
+    if (uf->fdc) return 1;
+
+    // Linux allows to switch O_DIRECT of an open fd
+    int flags = fcntl(uf->fd, F_GETFL);
+    if (flags == -1 || fcntl(uf->fd, F_SETFL, flags | O_DIRECT) == -1) {
+        DBG("%s: O_DIRECT not supported: %s\n", path, strerror(errno));
+        return 1;
+    }
+    uf->odirect = true;
+#endif
+
+    return 1;
+}
+
+/**
+ * The branch filesystem refused an O_DIRECT read, continue buffered
+ */
+static void directio_off(ufile_t *uf) {
+#ifdef O_DIRECT
+    int flags = fcntl(uf->fd, F_GETFL);
+    if (flags != -1) fcntl(uf->fd, F_SETFL, flags & ~O_DIRECT);
+#endif
+    uf->odirect = false;
+}
+
+/**
+ * pread() for files with O_DIRECT, unaligned requests go through an aligned
+ * per thread buffer
+ */
+ssize_t directio_pread(ufile_t *uf, char *buf, size_t size, off_t offset) {
+    off_t start = ALIGN_DOWN(offset);
+    size_t len = ALIGN_UP(offset + (off_t)size) - start;
+
+    if (start == offset && len == size && ((uintptr_t)buf % DIRECTIO_ALIGN) == 0) {
+        ssize_t res = pread(uf->fd, buf, size, offset);
+        if (res != -1 || errno != EINVAL) return res;
+
+        directio_off(uf);
+        return pread(uf->fd, buf, size, offset);
+    }
+
+    char *bounce = bounce_get(len);
+    if (!bounce) {
+        directio_off(uf);
+        return pread(uf->fd, buf, size, offset);
+    }
+
+    ssize_t res = pread(uf->fd, bounce, len, start);
+    if (res == -1) {
+        if (errno != EINVAL) return -1;
+
+        directio_off(uf);
+        return pread(uf->fd, buf, size, offset);
+    }
+
+    size_t skip = offset - start;
+    if ((size_t)res <= skip) return 0; // EOF
+
+    res -= skip;
+    if ((size_t)res > size) res = size;
+    memcpy(buf, bounce + skip, res);
+
+    return res;
+}
@@ -0,0 +1,17 @@
+//
+// Direct I/O policy for large streaming files
+//
+
+#ifndef ULAKEFS_FUSE_DIRECTIO_H
+#define ULAKEFS_FUSE_DIRECTIO_H
+
+#include <fuse.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "Ulakefs.h"
+
+int directio_add_prefixes(const char *arg);
+int directio_open(const char *path, ufile_t *uf, struct fuse_file_info *fi);
+ssize_t directio_pread(ufile_t *uf, char *buf, size_t size, off_t offset);
+
+#endif //ULAKEFS_FUSE_DIRECTIO_H
@@ -0,0 +1,288 @@
+//
+// Per-directory map of the branches a directory exists on
+//
+/*
+ * find_branch() probes every branch for every lookup, although with many
+ * layers a directory usually exists on only a few of them. With -o dirmap
+ * the branches that matter below a directory are kept as a bit mask of
+ * branch indices, built lazily from the mask of the parent directory.
+ * A lookup then only probes the branches of the mask of its parent.
+ *
+ * A branch is in the mask of dir if dir is a directory on it or if its
+ * meta directory has whiteouts below dir. A whiteout of dir itself ends
+ * the mask, lower branches are hidden below dir.
+ *
+ * Extra bits only cost probes, missing bits hide files. So creating a
+ * directory or whiteout adds its branch to the cached masks of the path and
+ * its parents, while removed whiteouts, renamed directories and a changed
+ * branch list drop the whole map. Changes made directly on the branches,
+ * bypassing the mount, are not seen until the map is dropped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "branches.h"
+#include "hashtable.h"
+#include "health.h"
+#include "manifest.h"
+#include "wostore.h"
+#include "dirmap.h"
+
+// entries before the map is dropped and built again
+#define DIRMAP_MAX 65536
+
+#if BRANCHES_MAX > 64
+#error "a dirmap mask holds at most 64 branches"
+#endif
+
+struct dirmap_entry {
+    const branch_set_t *set;	// snapshot the indices of mask refer to
+    unsigned long gen;		// valid while equal to gen
+    uint64_t mask;
+};
+
+static pthread_mutex_t dirmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hashtable *entries;	// directory path -> struct dirmap_entry
+static unsigned long gen = 1;	// bumped by dirmap_forget()
+static unsigned long changes;	// bumped by dirmap_add() and dirmap_forget()
+
+static unsigned long st_hits, st_builds, st_skipped, st_drops;
+
+/**
+ * Allocate the map, called from ulakefs_init()
+ */
+int dirmap_init(void) {
+    if (!uopt.dirmap) RETURN(0);
+
+    entries = create_hashtable(64, string_hash, string_equal);
+    if (!entries) {
+        uopt.dirmap = false;
+        RETURN(-ENOMEM);
+    }
+
+    RETURN(0);
+}
+
+static uint64_t all_branches(void) {
+    int n = NBRANCHES;
+    return n >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+}
+
+/**
+ * Check whether lookups below dir must probe branch i
+ */
+static bool branch_relevant(const char *dir, int i, bool *hidden) {
+    *hidden = false;
+
+    bool manifest = manifest_active(i);
+
+    // degraded branches are kept, find_branch() decides about them
+    if (!manifest && health_check(i)) return true;
+
+    char p[PATHLEN_MAX];
+    if (BUILD_PATH(p, BRANCHES[i].path, dir)) return true;
+
+    // the union path of p, the manifest of the branch takes those
+    const char *up = p + BRANCHES[i].path_len - 1;
+
+    struct stat st;
+    if ((manifest ? manifest_lstat(i, up, &st) : health_lstat(i, p, &st)) == 0) {
+        if (S_ISDIR(st.st_mode)) return true;
+    } else if (errno == ETIMEDOUT) {
+        return true;
+    }
+
+    if (!uopt.cow_enabled) return false;
+
+    if (BUILD_PATH(p, BRANCHES[i].path, METADIR, dir)) return true;
+    size_t len = strlen(p);
+    if (len + strlen(HIDETAG) >= PATHLEN_MAX) return true;
+
+    // whiteouts below dir
+    bool res = (manifest ? manifest_lstat(i, up, &st) : lstat(p, &st)) == 0
+               && S_ISDIR(st.st_mode);
+
+    strcpy(p + len, HIDETAG);
+    if (uopt.whiteout_store ? wostore_hidden(dir, i) == 1
+                            : (manifest ? manifest_lstat(i, up, &st) : lstat(p, &st)) == 0) {
+        *hidden = true;
+        return true;
+    }
+
+    return res;
+}
+
+/**
+ * Mask of dir, dir is modified while walking up and restored
+ */
+static uint64_t dir_mask(char *dir) {
+    if (dir[0] == '\0' || strcmp(dir, "/") == 0) return all_branches();
+
+    const branch_set_t *set = BRANCH_SET();
+
+    pthread_mutex_lock(&dirmap_lock);
+    struct dirmap_entry *e = entries ? hashtable_search(entries, dir) : NULL;
+    if (e && e->set == set && e->gen == gen) {
+        uint64_t mask = e->mask;
+        st_hits++;
+        pthread_mutex_unlock(&dirmap_lock);
+        return mask;
+    }
+    unsigned long started = changes;
+    pthread_mutex_unlock(&dirmap_lock);
+
+    char *slash = strrchr(dir, '/');
+    *slash = '\0';
+    uint64_t parent = dir_mask(dir);
+    *slash = '/';
+
+    uint64_t mask = 0;
+    int i;
+    for (i = 0; i < NBRANCHES; i++) {
+        if (!(parent & ((uint64_t)1 << i))) continue;
+
+        bool hidden;
+        if (branch_relevant(dir, i, &hidden)) mask |= (uint64_t)1 << i;
+        if (hidden) break;
+    }
+
+    pthread_mutex_lock(&dirmap_lock);
+    st_builds++;
+
+    // a directory created meanwhile might be missing in mask
+    if (changes != started || !entries) {
+        pthread_mutex_unlock(&dirmap_lock);
+        return mask;
+    }
+
+    if (hashtable_count(entries) >= DIRMAP_MAX) {
+        hashtable_destroy(entries, 1);
+        entries = create_hashtable(64, string_hash, string_equal);
+        st_drops++;
+        if (!entries) {
+            USYSLOG(LOG_ERR, "%s: out of memory, dirmap disabled\n", __func__);
+            uopt.dirmap = false;
+            pthread_mutex_unlock(&dirmap_lock);
+            return mask;
+        }
+        e = NULL;
+    }
+
+    if (!e) {
+        char *key = strdup(dir);
+        e = malloc(sizeof(struct dirmap_entry));
+        if (!key || !e || !hashtable_insert(entries, key, e)) {
+            free(key);
+            free(e);
+            pthread_mutex_unlock(&dirmap_lock);
+            return mask;
+        }
+    }
+    e->set = set;
+    e->gen = gen;
+    e->mask = mask;
+
+    pthread_mutex_unlock(&dirmap_lock);
+    return mask;
+}
+
+/**
+ * Bit mask of the branch indices find_branch() has to probe for path,
+ * all branches without -o dirmap
+ */
+uint64_t dirmap_lookup(const char *path) {
+    if (!uopt.dirmap) return all_branches();
+
+    char dir[PATHLEN_MAX];
+    if (strlen(path) >= PATHLEN_MAX) return all_branches();
+    strcpy(dir, path);
+
+    // the parent of path, trailing slashes are not part of the name
+    char *end = dir + strlen(dir);
+    while (end > dir + 1 && end[-1] == '/') end--;
+    *end = '\0';
+    char *slash = strrchr(dir, '/');
+    if (!slash) return all_branches();
+    while (slash > dir && slash[-1] == '/') slash--;
+    *slash = '\0';
+
+    return dir_mask(dir);
+}
+
+/**
+ * Count the branches a lookup did not probe thanks to mask
+ */
+void dirmap_skipped(uint64_t mask) {
+    if (!uopt.dirmap) return;
+
+    int skipped = NBRANCHES - __builtin_popcountll(mask & all_branches());
+    if (skipped > 0) __sync_fetch_and_add(&st_skipped, skipped);
+}
+
+/**
+ * A directory or whiteout was created at path on branch, the branch
+ * matters from now on for path and all directories above it
+ */
+void dirmap_add(const char *path, int branch) {
+    if (!uopt.dirmap || branch < 0) return;
+
+    char dir[PATHLEN_MAX];
+    if (strlen(path) >= PATHLEN_MAX) {
+        dirmap_forget();
+        return;
+    }
+    strcpy(dir, path);
+
+    const branch_set_t *set = BRANCH_SET();
+
+    pthread_mutex_lock(&dirmap_lock);
+    changes++;
+
+    char *end = dir + strlen(dir);
+    while (entries && end > dir) {
+        *end = '\0';
+
+        struct dirmap_entry *e = hashtable_search(entries, dir);
+        if (e && e->set == set) {
+            e->mask |= (uint64_t)1 << branch;
+        } else if (e) {
+            e->gen = 0; // built for another snapshot, indices differ
+        }
+
+        end = strrchr(dir, '/');
+        if (!end) break;
+    }
+
+    pthread_mutex_unlock(&dirmap_lock);
+}
+
+/**
+ * Drop all masks, they are built again on the next lookups
+ */
+void dirmap_forget(void) {
+    if (!uopt.dirmap) return;
+
+    pthread_mutex_lock(&dirmap_lock);
+    gen++;
+    changes++;
+    pthread_mutex_unlock(&dirmap_lock);
+}
+
+void dirmap_stats(FILE *f) {
+    if (!uopt.dirmap) return;
+
+    pthread_mutex_lock(&dirmap_lock);
+    fprintf(f, "dirmap_hits %lu\n", st_hits);
+    fprintf(f, "dirmap_builds %lu\n", st_builds);
+    fprintf(f, "dirmap_skipped %lu\n", st_skipped);
+    fprintf(f, "dirmap_drops %lu\n", st_drops);
+    fprintf(f, "dirmap_entries %u\n", entries ? hashtable_count(entries) : 0);
+    pthread_mutex_unlock(&dirmap_lock);
+}
@@ -0,0 +1,18 @@
+//
+// Per-directory map of the branches a directory exists on
+//
+
+#ifndef ULAKEFS_FUSE_DIRMAP_H
+#define ULAKEFS_FUSE_DIRMAP_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+int dirmap_init(void);
+uint64_t dirmap_lookup(const char *path);
+void dirmap_skipped(uint64_t mask);
+void dirmap_add(const char *path, int branch);
+void dirmap_forget(void);
+void dirmap_stats(FILE *f);
+
+#endif //ULAKEFS_FUSE_DIRMAP_H
@@ -0,0 +1,236 @@
+//
+// Cache of open branch fds of read-only branch files
+//
+/*
+ * Build tools open, read and close the same files over and over again.
+ * With -o fd_cache the fd of a read-only open of a file on a read-only
+ * branch is shared by all opens of this path and kept open after the
+ * last release. An entry is only used while dev, ino and mtime still match
+ * the file found by find_rorw_branch_stat(), otherwise a new fd is opened.
+ *
+ * Idle entries (no open file uses them) are kept in LRU order, their number
+ * is bounded by a quarter of RLIMIT_NOFILE (see -o max_files).
+ */
+#define _GNU_SOURCE // O_DIRECT, O_NOATIME
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "branches.h"
+#include "hashtable.h"
+#include "fdcache.h"
+
+// at least this many idle fds are cached, whatever RLIMIT_NOFILE says
+#define FDCACHE_MIN 16
+
+// open flags that change the state of the fd, such opens get their own fd
+#ifdef O_DIRECT
+#define FDCACHE_OWN_FLAGS (O_ACCMODE | O_TRUNC | O_APPEND | O_NONBLOCK | O_SYNC \
+                           | O_DIRECT | O_NOATIME)
+#else
+#define FDCACHE_OWN_FLAGS (O_ACCMODE | O_TRUNC | O_APPEND | O_NONBLOCK | O_SYNC)
+#endif
+
+struct fdcache_entry {
+    struct fdcache_entry *prev, *next; // LRU list, only while refs == 0
+    char *path;		// key, NULL once the entry was replaced
+    int branch;		// id of the branch
+    int fd;
+    int refs;		// open files using fd
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+};
+
+static pthread_mutex_t fdcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hashtable *entries;	// path -> struct fdcache_entry
+static struct fdcache_entry lru;	// list head, most recently used first
+static unsigned int nidle;
+static unsigned int max_idle;
+
+static unsigned long st_hits, st_misses, st_stale, st_evicted;
+
+/**
+ * Size the cache from RLIMIT_NOFILE, called from ulakefs_init()
+ */
+int fdcache_init(void) {
+    if (!uopt.fd_cache) RETURN(0);
+
+    struct rlimit rlim;
+    if (getrlimit(RLIMIT_NOFILE, &rlim)) RETURN(-errno);
+
+    max_idle = rlim.rlim_cur == RLIM_INFINITY ? 65536 : rlim.rlim_cur / 4;
+    if (max_idle < FDCACHE_MIN) max_idle = FDCACHE_MIN;
+
+    lru.prev = lru.next = &lru;
+
+    entries = create_hashtable(16, string_hash, string_equal);
+    if (!entries) {
+        uopt.fd_cache = false;
+        RETURN(-ENOMEM);
+    }
+
+    RETURN(0);
+}
+
+static void lru_del(struct fdcache_entry *e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    e->prev = e->next = NULL;
+    nidle--;
+}
+
+static void lru_add(struct fdcache_entry *e) {
+    e->next = lru.next;
+    e->prev = &lru;
+    lru.next->prev = e;
+    lru.next = e;
+    nidle++;
+}
+
+/**
+ * Remove e from the table, fdcache_lock MUST be held.
+ * An entry still in use is freed by its last fdcache_put().
+ */
+static void fdcache_drop(struct fdcache_entry *e) {
+    if (e->path) {
+        hashtable_remove(entries, e->path); // frees path
+        e->path = NULL;
+    }
+
+    if (e->refs) return;
+
+    if (e->prev) lru_del(e);
+    close(e->fd);
+    free(e);
+}
+
+/**
+ * Check if an open with flags of a file on branch may use the cache
+ */
+bool fdcache_usable(int branch, int flags, const struct stat *st) {
+    if (!uopt.fd_cache) return false;
+    if (BRANCHES[branch].rw || !S_ISREG(st->st_mode)) return false;
+
+    return (flags & FDCACHE_OWN_FLAGS) == O_RDONLY;
+}
+
+/**
+ * Take a reference on the cached fd of path, st is the stat() of the file
+ * on branch. Returns 0 and sets uf->fd on a hit, -1 otherwise.
+ */
+int fdcache_get(const char *path, const struct stat *st, ufile_t *uf) {
+    pthread_mutex_lock(&fdcache_lock);
+
+    struct fdcache_entry *e = hashtable_search(entries, (void *)path);
+    if (!e) {
+        st_misses++;
+        pthread_mutex_unlock(&fdcache_lock);
+        return -1;
+    }
+
+    if (e->branch != BRANCHES[uf->branch].id || e->dev != st->st_dev || e->ino != st->st_ino
+        || e->mtime.tv_sec != st->st_mtim.tv_sec
+        || e->mtime.tv_nsec != st->st_mtim.tv_nsec) {
+        st_stale++;
+        fdcache_drop(e);
+        pthread_mutex_unlock(&fdcache_lock);
+        return -1;
+    }
+
+    if (e->refs++ == 0) lru_del(e);
+    st_hits++;
+
+    uf->fd = e->fd;
+    uf->fdc = e;
+
+    pthread_mutex_unlock(&fdcache_lock);
+    return 0;
+}
+
+/**
+ * Share the freshly opened uf->fd of path with later opens
+ */
+void fdcache_add(const char *path, ufile_t *uf) {
+    struct stat st;
+    if (fstat(uf->fd, &st) == -1) return;
+
+    struct fdcache_entry *e = calloc(1, sizeof(struct fdcache_entry));
+    if (!e) return;
+
+    e->path = strdup(path);
+    if (!e->path) {
+        free(e);
+        return;
+    }
+    e->branch = BRANCHES[uf->branch].id;
+    e->fd = uf->fd;
+    e->refs = 1;
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->mtime = st.st_mtim;
+
+    pthread_mutex_lock(&fdcache_lock);
+
+    // a parallel open of the same path might have been faster
+    struct fdcache_entry *old = hashtable_search(entries, e->path);
+    if (old) fdcache_drop(old);
+
+    if (!hashtable_insert(entries, e->path, e)) {
+        pthread_mutex_unlock(&fdcache_lock);
+        free(e->path);
+        free(e);
+        return;
+    }
+    uf->fdc = e;
+
+    pthread_mutex_unlock(&fdcache_lock);
+}
+
+/**
+ * Release the reference of uf, the fd stays open for the next open
+ */
+void fdcache_put(ufile_t *uf) {
+    struct fdcache_entry *e = uf->fdc;
+
+    pthread_mutex_lock(&fdcache_lock);
+
+    if (--e->refs == 0) {
+        if (!e->path) {
+            // replaced while in use
+            close(e->fd);
+            free(e);
+        } else {
+            lru_add(e);
+            while (nidle > max_idle) {
+                st_evicted++;
+                fdcache_drop(lru.prev);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&fdcache_lock);
+}
+
+void fdcache_stats(FILE *f) {
+    if (!uopt.fd_cache) return;
+
+    pthread_mutex_lock(&fdcache_lock);
+    fprintf(f, "fdcache_hits %lu\n", st_hits);
+    fprintf(f, "fdcache_misses %lu\n", st_misses);
+    fprintf(f, "fdcache_stale %lu\n", st_stale);
+    fprintf(f, "fdcache_evicted %lu\n", st_evicted);
+    fprintf(f, "fdcache_entries %u\n", hashtable_count(entries));
+    fprintf(f, "fdcache_idle %u\n", nidle);
+    pthread_mutex_unlock(&fdcache_lock);
+}
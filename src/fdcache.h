@@ -0,0 +1,20 @@
+//
+// Cache of open branch fds of read-only branch files
+//
+
+#ifndef ULAKEFS_FUSE_FDCACHE_H
+#define ULAKEFS_FUSE_FDCACHE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "Ulakefs.h"
+
+int fdcache_init(void);
+bool fdcache_usable(int branch, int flags, const struct stat *st);
+int fdcache_get(const char *path, const struct stat *st, ufile_t *uf);
+void fdcache_add(const char *path, ufile_t *uf);
+void fdcache_put(ufile_t *uf);
+void fdcache_stats(FILE *f);
+
+#endif //ULAKEFS_FUSE_FDCACHE_H
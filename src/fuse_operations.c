@@ -2,6 +2,8 @@
 // Created by hoangdm on 20/04/2021.
 //
 
+#define _GNU_SOURCE // fallocate()
+
 #include <fuse.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,8 +21,27 @@
 #include "Ulakefs.h"
 #include "options.h"
 #include "debug.h"
+#include "branches.h"
 #include "general.h"
 #include "readrmdir.h"
+#include "copyup.h"
+#include "ctl.h"
+#include "pagecache.h"
+#include "directio.h"
+#include "fdcache.h"
+#include "dirmap.h"
+#include "wostore.h"
+#include "manifest.h"
+#include "closer.h"
+#include "syncgroup.h"
+#include "readahead.h"
+#include "statfs.h"
+#include "policy.h"
+#include "tier.h"
+#include "mirror.h"
+#include "stripe.h"
+#include "bpool.h"
+#include "health.h"
 #include "config.h"
 
 #if defined __linux__
@@ -39,13 +60,15 @@
 #endif
 
 static int ulakefs_chmod(const char *path,mode_t mode){
+    branches_enter(NULL);
+
     DBG("%s\n", path);
 
     int i = find_rw_branch_cow(path);
     if (i == -1) RETURN(-errno);
 
     char p[PATHLEN_MAX];
-    if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+    if (BUILD_PATH(p, BRANCHES[i].path, path)) RETURN(-ENAMETOOLONG);
 
     int res = chmod(p, mode);
     if (res == -1) RETURN(-errno);
@@ -54,13 +77,15 @@ static int ulakefs_chmod(const char *path,mode_t mode){
 }
 
 static int ulakefs_chown(const char *path, uid_t uid, gid_t gid) {
+    branches_enter(NULL);
+
     DBG("%s\n", path);
 
     int i = find_rw_branch_cow(path);
     if (i == -1) RETURN(-errno);
 
     char p[PATHLEN_MAX];
-    if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+    if (BUILD_PATH(p, BRANCHES[i].path, path)) RETURN(-ENAMETOOLONG);
 
     int res = lchown(p, uid, gid);
     if (res == -1) RETURN(-errno);
@@ -73,13 +98,15 @@ static int ulakefs_chown(const char *path, uid_t uid, gid_t gid) {
  * libfuse will call this to create regular file
  */
 static int ulakefs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    branches_enter(NULL);
+
     DBG("%s\n", path);
 
-    int i = find_rw_branch_cutlast(path);
+    int i = find_rw_branch_create(path);
     if (i == -1) RETURN(-errno);
 
     char p[PATHLEN_MAX];
-    if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+    if (BUILD_PATH(p, BRANCHES[i].path, path)) RETURN(-ENAMETOOLONG);
 
     // NOTE: We should do:
     //       Create the file with mode=0 first, otherwise we might create
@@ -93,12 +120,53 @@ static int ulakefs_create(const char *path, mode_t mode, struct fuse_file_info *
     // NOW, that the file has the proper owner we may set the requested mode
     fchmod(res, mode);
 
-    fi->fh = res;
+    ufile_t *uf = ufile_new(res, i);
+    if (!uf) {
+        close(res);
+        RETURN(-ENOMEM);
+    }
+
+    // striped by the write that grows it past the first chunk
+    uf->stripe_pending = stripe_path(path);
+
+    if (!uf->stripe_pending) directio_open(path, uf, fi);
+    fi->fh = (uintptr_t)uf;
     remove_hidden(path, i);
 
-    DBG("fd = %" PRIx64 "\n", fi->fh);
+    DBG("fd = %d\n", uf->fd);
+    RETURN(0);
+}
+
+#if FUSE_VERSION >= 29
+/**
+ * Forward fallocate() to the branch file, so space can be reserved and
+ * holes can be punched without writing through the daemon
+ */
+static int ulakefs_fallocate(const char *path, int mode, off_t offset, off_t len,
+                             struct fuse_file_info *fi) {
+    branches_enter(UFILE(fi)->set);
+
+    (void)path;
+
+    int fd = UFILE(fi)->fd;
+    DBG("fd = %d\n", fd);
+
+    // the chunks of a striped file are spread over several files
+    if (UFILE(fi)->stripe) RETURN(-EOPNOTSUPP);
+
+#ifdef __linux__
+    int res = fallocate(fd, mode, offset, len);
+    if (res == -1) RETURN(-errno);
+#else
+    if (mode) RETURN(-EOPNOTSUPP);
+
+    int res = posix_fallocate(fd, offset, len);
+    if (res) RETURN(-res);
+#endif
+
     RETURN(0);
 }
+#endif
 
 /**
  * flush may be called multiple times for an open file, this must not really
@@ -106,13 +174,15 @@ static int ulakefs_create(const char *path, mode_t mode, struct fuse_file_info *
  * which flush the data/metadata on close()
  */
 static int ulakefs_flush(const char *path, struct fuse_file_info *fi) {
-    DBG("fd = %"PRIx64"\n", fi->fh);
+    ufile_t *uf = UFILE(fi);
+    branches_enter(uf->set);
+    DBG("fd = %d\n", uf->fd);
 
-    int fd = dup(fi->fh);
+    int fd = dup(uf->fd);
 
     if (fd == -1) {
         // What to do now?
-        if (fsync(fi->fh) == -1) RETURN(-EIO);
+        if (fsync(uf->fd) == -1) RETURN(-EIO);
 
         RETURN(-errno);
     }
@@ -127,35 +197,31 @@ static int ulakefs_flush(const char *path, struct fuse_file_info *fi) {
  *  Fsync is very basic, can be left unimplemented
  */
 static int ulakefs_fsync(const char *path, int isdatasync, struct fuse_file_info *fi) {
-    DBG("fd = %"PRIx64"\n", fi->fh);
+    ufile_t *uf = UFILE(fi);
+    branches_enter(uf->set);
+    DBG("fd = %d\n", uf->fd);
 
-    int res;
-    if (isdatasync) {
-#if _POSIX_SYNCHRONIZED_IO + 0 > 0
-        res = fdatasync(fi->fh);
-#else
-        res = fsync(fi->fh);
-#endif
-    } else {
-        res = fsync(fi->fh);
-    }
+    if (uf->stripe) RETURN(stripe_fsync(uf, isdatasync));
 
+    int res = syncgroup_fsync(uf->branch, uf->fd, isdatasync);
     if (res == -1) RETURN(-errno);
 
     RETURN(0);
 }
 
 static int ulakefs_getattr(const char *path, struct stat *stbuf) {
+    branches_enter(NULL);
+
     DBG("%s\n", path);
 
-    int i = find_rorw_branch(path);
+    if (ctl_path(path)) RETURN(ctl_getattr(path, stbuf));
+
+    // the lookup already did the lstat(), or the manifest answered
+    int i = find_rorw_branch_stat(path, stbuf);
     if (i == -1) RETURN(-errno);
 
-    char p[PATHLEN_MAX];
-    if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-    int res = lstat(p, stbuf);
-    if (res == -1) RETURN(-errno);
+    int res = stripe_getattr(path, i, stbuf);
+    if (res) RETURN(res);
 
     /* This is a workaround for broken gnu find implementations. Actually,
      * n_links is not defined at all for directories by posix. However, it
@@ -169,7 +235,31 @@ static int ulakefs_getattr(const char *path, struct stat *stbuf) {
     RETURN(0);
 }
 
+/**
+ * getattr of an open file, fstat() the branch fd instead of searching
+ * all branches for path again
+ */
+static int ulakefs_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+    ufile_t *uf = UFILE(fi);
+    branches_enter(uf->set);
+    DBG("fd = %d\n", uf->fd);
+
+    if (uf->branch == -1 && path) RETURN(ctl_getattr(path, stbuf));
+
+    if (uf->stripe) RETURN(stripe_fgetattr(uf, stbuf));
+
+    int res = fstat(uf->fd, stbuf);
+    if (res == -1) RETURN(-errno);
+
+    // same gnu find workaround as in ulakefs_getattr()
+    if (S_ISDIR(stbuf->st_mode)) stbuf->st_nlink = 1;
+
+    RETURN(0);
+}
+
 static int ulakefs_access(const char *path, int mask) {
+    branches_enter(NULL);
+
     struct stat s;
 
     if (ulakefs_getattr(path, &s) != 0)
@@ -211,10 +301,54 @@ static void * ulakefs_init(struct fuse_conn_info *conn) {
         conn->want |= FUSE_CAP_IOCTL_DIR;
 #endif
 
+#ifdef FUSE_CAP_SPLICE_WRITE
+    // zero-copy data path of read_buf() and write_buf()
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE
+                                   | FUSE_CAP_SPLICE_READ);
+#endif
+
+#ifdef FUSE_CAP_AUTO_INVAL_DATA
+    // let the kernel drop cached pages if it sees mtime or size change
+    if (uopt.rw_auto_cache && (conn->capable & FUSE_CAP_AUTO_INVAL_DATA))
+        conn->want |= FUSE_CAP_AUTO_INVAL_DATA;
+#endif
+
+    // background threads, started only now as fuse_main() may have forked
+    if (copyup_init())
+        USYSLOG(LOG_WARNING, "Copy-up scheduler disabled, copying inline\n");
+    if (bpool_init())
+        USYSLOG(LOG_WARNING, "Branch worker threads disabled\n");
+    if (health_init())
+        USYSLOG(LOG_WARNING, "Branch health tracking disabled\n");
+    if (mirror_init())
+        USYSLOG(LOG_WARNING, "Mirror load balancing disabled\n");
+    if (tier_init())
+        USYSLOG(LOG_WARNING, "Tiering disabled\n");
+    if (pagecache_init())
+        USYSLOG(LOG_WARNING, "Page cache watches disabled\n");
+    if (fdcache_init())
+        USYSLOG(LOG_WARNING, "fd cache disabled\n");
+    if (dirmap_init())
+        USYSLOG(LOG_WARNING, "Directory branch map disabled\n");
+    if (manifest_init())
+        USYSLOG(LOG_WARNING, "Branch manifests disabled\n");
+    if (wostore_init())
+        USYSLOG(LOG_WARNING, "Whiteout store cache or compaction disabled\n");
+    if (policy_init())
+        USYSLOG(LOG_WARNING, "lus create policy disabled\n");
+    if (statfs_init())
+        USYSLOG(LOG_WARNING, "statfs snapshots disabled\n");
+    if (syncgroup_init())
+        USYSLOG(LOG_WARNING, "fsync group commit disabled\n");
+    if (closer_init())
+        USYSLOG(LOG_WARNING, "Closer threads disabled, closing inline\n");
+
     return NULL;
 }
 
 static int ulakefs_link(const char *from, const char *to) {
+    branches_enter(NULL);
+
     DBG("from %s to %s\n", from, to);
 
     // hardlinks do not work across different filesystems so we need a copy of from first
@@ -226,9 +360,12 @@ static int ulakefs_link(const char *from, const char *to) {
 
     DBG("from branch: %d to branch: %d\n", i, j);
 
+    // the members of a striped file cannot have a second name
+    if (stripe_striped(from, i)) RETURN(-EXDEV);
+
     char f[PATHLEN_MAX], t[PATHLEN_MAX];
-    if (BUILD_PATH(f, uopt.branches[i].path, from)) RETURN(-ENAMETOOLONG);
-    if (BUILD_PATH(t, uopt.branches[j].path, to)) RETURN(-ENAMETOOLONG);
+    if (BUILD_PATH(f, BRANCHES[i].path, from)) RETURN(-ENAMETOOLONG);
+    if (BUILD_PATH(t, BRANCHES[j].path, to)) RETURN(-ENAMETOOLONG);
 
     int res = link(f, t);
     if (res == -1) RETURN(-errno);
@@ -248,17 +385,24 @@ static int ulakefs_link(const char *from, const char *to) {
  *   DON'T DELETE WHITEOUTS DIRECTORY HERE, it will make already hidden branches/subbranches visible again.
  */
 static int ulakefs_mkdir(const char *path, mode_t mode) {
+    branches_enter(NULL);
+
     DBG("%s\n", path);
 
-    int i = find_rw_branch_cutlast(path);
+    int i = find_rw_branch_create(path);
     if (i == -1) RETURN(-errno);
 
     char p[PATHLEN_MAX];
-    if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+    if (BUILD_PATH(p, BRANCHES[i].path, path)) RETURN(-ENAMETOOLONG);
 
     int res = mkdir(p, 0);
     if (res == -1) RETURN(-errno);
 
+    dirmap_add(path, i);
+
+    // created over a whited-out directory of a lower branch
+    make_opaque(path, i);
+
     set_owner(p); // no error check, since creating the file succeeded
     // NOW, that the file has the proper owner we may set the requested mode
     chmod(p, mode);
@@ -267,13 +411,15 @@ static int ulakefs_mkdir(const char *path, mode_t mode) {
 }
 
 static int ulakefs_mknod(const char *path, mode_t mode, dev_t rdev) {
+    branches_enter(NULL);
+
     DBG("%s\n", path);
 
-    int i = find_rw_branch_cutlast(path);
+    int i = find_rw_branch_create(path);
     if (i == -1) RETURN(-errno);
 
     char p[PATHLEN_MAX];
-    if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+    if (BUILD_PATH(p, BRANCHES[i].path, path)) RETURN(-ENAMETOOLONG);
 
     int file_type = mode & S_IFMT;
     int file_perm = mode & (S_PROT_MASK);
@@ -304,22 +450,59 @@ static int ulakefs_mknod(const char *path, mode_t mode, dev_t rdev) {
 }
 
 static int ulakefs_open(const char *path, struct fuse_file_info *fi) {
+    branches_enter(NULL);
+
     DBG("%s\n", path);
 
+    if (ctl_path(path)) RETURN(ctl_open(path, fi));
+
     int i;
+    struct stat st;
+    bool cache = false;
+    bool tier = false;
     if (fi->flags & (O_WRONLY | O_RDWR)) {
         i = find_rw_branch_cutlast(path);
+    } else if (uopt.fd_cache || tier_enabled()) {
+        i = find_rorw_branch_stat(path, &st);
+        cache = i != -1 && fdcache_usable(i, fi->flags, &st);
+        tier = i != -1 && tier_enabled();
     } else {
         i = find_rorw_branch(path);
     }
 
     if (i == -1) RETURN(-errno);
 
-    char p[PATHLEN_MAX];
-    if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+    // read-only opens are spread over the members of a mirror group
+    if (!(fi->flags & (O_WRONLY | O_RDWR))) i = mirror_pick(path, i, cache || tier ? &st : NULL);
+
+    ufile_t *uf = ufile_new(-1, i);
+    if (!uf) RETURN(-ENOMEM);
+
+    if (tier && tier_open(path, &st, uf) == 0) {
+        DBG("%s: promoted copy\n", path);
+    } else if (!cache || fdcache_get(path, &st, uf)) {
+        // on EIO another mirror might be opened instead
+        if (mirror_open(path, fi->flags, uf)) {
+            int err = errno;
+            free(uf);
+            RETURN(-err);
+        }
+        i = uf->branch;
+
+        if (cache) fdcache_add(path, uf);
+    }
 
-    int fd = open(p, fi->flags);
-    if (fd == -1) RETURN(-errno);
+    // striped files only exist on rw-branches
+    if (BRANCHES[i].rw) {
+        int res = stripe_open(path, fi->flags, uf);
+        if (res < 0) {
+            close(uf->fd);
+            free(uf);
+            RETURN(res);
+        }
+        uf->stripe_pending = !uf->stripe && stripe_path(path);
+    }
+    mirror_opened(uf);
 
     if (fi->flags & (O_WRONLY | O_RDWR)) {
         // There might have been a hide file, but since we successfully
@@ -327,34 +510,108 @@ static int ulakefs_open(const char *path, struct fuse_file_info *fi) {
         remove_hidden(path, i);
     }
 
-    // This makes exec() fail
-    //fi->direct_io = 1;
-    fi->fh = (unsigned long)fd;
+    // direct_io makes exec() fail, directio_open() skips executables
+    if (uf->stripe || uf->stripe_pending || !directio_open(path, uf, fi))
+        pagecache_open(path, i, uf->fd, fi);
+    fi->fh = (uintptr_t)uf;
 
-    DBG("fd = %"PRIx64"\n", fi->fh);
+    DBG("fd = %d\n", uf->fd);
     RETURN(0);
 }
 
 static int ulakefs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    DBG("fd = %"PRIx64"\n", fi->fh);
+    ufile_t *uf = UFILE(fi);
+    branches_enter(uf->set);
+    DBG("fd = %d\n", uf->fd);
 
-    int res = pread(fi->fh, buf, size, offset);
+    tier_read(path, uf);
+    readahead_read(uf, offset, size);
 
+    int res = stripe_grow(path, uf, offset + size, false);
+    if (res) RETURN(res);
+
+    if (uf->stripe)
+        res = stripe_pread(uf, buf, size, offset);
+    else
+        res = mirror_pread(path, uf, buf, size, offset);
     if (res == -1) RETURN(-errno);
 
     RETURN(res);
 }
 
+#if FUSE_VERSION >= 29
+/**
+ * Hand the branch fd to libfuse instead of reading into its buffer, the
+ * data is then spliced from the branch file into /dev/fuse without being
+ * copied through user space
+ */
+static int ulakefs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                            off_t offset, struct fuse_file_info *fi) {
+    ufile_t *uf = UFILE(fi);
+    branches_enter(uf->set);
+    DBG("fd = %d\n", uf->fd);
+
+    tier_read(path, uf);
+    readahead_read(uf, offset, size);
+
+    int err = stripe_grow(path, uf, offset + size, false);
+    if (err) RETURN(err);
+
+    struct fuse_bufvec *src = malloc(sizeof(struct fuse_bufvec));
+    if (!src) RETURN(-ENOMEM);
+
+    *src = FUSE_BUFVEC_INIT(size);
+
+    if (uf->odirect || mirror_file(uf) || uf->stripe || bpool_enabled()) {
+        // splice() cannot honour the O_DIRECT alignment, mirrors need
+        // to see EIO to fail over, striped files are several fds and
+        // branch workers must do the read, read into memory
+        char *mem = malloc(size);
+        if (!mem) {
+            free(src);
+            RETURN(-ENOMEM);
+        }
+
+        ssize_t res;
+        if (uf->stripe)
+            res = stripe_pread(uf, mem, size, offset);
+        else
+            res = mirror_pread(path, uf, mem, size, offset);
+        if (res == -1) {
+            int err = errno;
+            free(mem);
+            free(src);
+            RETURN(-err);
+        }
+
+        src->buf[0].mem = mem;
+        src->buf[0].size = res;
+    } else {
+        src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        src->buf[0].fd = uf->fd;
+        src->buf[0].pos = offset;
+    }
+
+    // libfuse frees src and mem after the reply
+    *bufp = src;
+
+    RETURN(0);
+}
+#endif
+
 static int ulakefs_readlink(const char *path, char *buf, size_t size) {
+    branches_enter(NULL);
+
     DBG("%s\n", path);
 
     int i = find_rorw_branch(path);
     if (i == -1) RETURN(-errno);
 
     char p[PATHLEN_MAX];
-    if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+    if (BUILD_PATH(p, BRANCHES[i].path, path)) RETURN(-ENAMETOOLONG);
 
-    int res = readlink(p, buf, size - 1);
+    int res = manifest_readlink(i, path, buf, size - 1);
+    if (res == -2) res = readlink(p, buf, size - 1);
 
     if (res == -1) RETURN(-errno);
 
@@ -364,9 +621,23 @@ static int ulakefs_readlink(const char *path, char *buf, size_t size) {
 }
 
 static int ulakefs_release(const char *path, struct fuse_file_info *fi) {
-    DBG("fd = %"PRIx64"\n", fi->fh);
+    ufile_t *uf = UFILE(fi);
+    branches_enter(uf->set);
+    DBG("fd = %d\n", uf->fd);
+
+    if (uf->branch != -1 && !fi->direct_io) pagecache_release(path, uf->fd, fi);
+    readahead_release(uf);
+    mirror_release(uf);
+    stripe_release(uf);
+
+    if (uf->fdc) {
+        fdcache_put(uf);
+        free(uf);
+        RETURN(0);
+    }
 
-    int res = close(fi->fh);
+    int res = closer_close(uf->fd);
+    free(uf);
     if (res == -1) RETURN(-errno);
 
     RETURN(0);
@@ -378,6 +649,8 @@ static int ulakefs_release(const char *path, struct fuse_file_info *fi) {
  *  renamed directory on the read-write branch.
  */
 static int ulakefs_rename(const char *from, const char *to) {
+    branches_enter(NULL);
+
     DBG("from %s to %s\n", from, to);
 
     bool is_dir = false; // is 'from' a file or directory
@@ -388,7 +661,7 @@ static int ulakefs_rename(const char *from, const char *to) {
     int i = find_rorw_branch(from);
     if (i == -1) RETURN(-errno);
 
-    if (!uopt.branches[i].rw) {
+    if (!BRANCHES[i].rw) {
         i = find_rw_branch_cow_common(from, true);
         if (i == -1) RETURN(-errno);
     }
@@ -400,8 +673,8 @@ static int ulakefs_rename(const char *from, const char *to) {
     }
 
     char f[PATHLEN_MAX], t[PATHLEN_MAX];
-    if (BUILD_PATH(f, uopt.branches[i].path, from)) RETURN(-ENAMETOOLONG);
-    if (BUILD_PATH(t, uopt.branches[i].path, to)) RETURN(-ENAMETOOLONG);
+    if (BUILD_PATH(f, BRANCHES[i].path, from)) RETURN(-ENAMETOOLONG);
+    if (BUILD_PATH(t, BRANCHES[i].path, to)) RETURN(-ENAMETOOLONG);
 
     filetype_t ftype = path_is_dir(f);
     if (ftype == NOT_EXISTING)
@@ -409,8 +682,14 @@ static int ulakefs_rename(const char *from, const char *to) {
     else if (ftype == IS_DIR)
         is_dir = true;
 
+    // members of striped files are named after their path, let mv copy
+    // directories below a stripe prefix and files leaving it
+    if (is_dir && (stripe_path(from) || stripe_path(to))) RETURN(-EXDEV);
+    bool striped = !is_dir && stripe_striped(from, i);
+    if (striped && !stripe_path(to)) RETURN(-EXDEV);
+
     int res;
-    if (!uopt.branches[i].rw) {
+    if (!BRANCHES[i].rw) {
         // since original file is on a read-only branch, we copied the from file to a writable branch,
         // but since we will rename from, we also need to hide the from file on the read-only branch
         if (is_dir)
@@ -425,7 +704,7 @@ static int ulakefs_rename(const char *from, const char *to) {
     if (res == -1) {
         int err = errno; // unlink() might overwrite errno
         // if from was on a read-only branch we copied it, but now rename failed so we need to delete it
-        if (!uopt.branches[i].rw) {
+        if (!BRANCHES[i].rw) {
             if (unlink(f))
                 USYSLOG(LOG_ERR, "%s: cow of %s succeeded, but rename() failed and now "
                                  "also unlink()  failed\n", __func__, from);
@@ -437,7 +716,7 @@ static int ulakefs_rename(const char *from, const char *to) {
         RETURN(-err);
     }
 
-    if (uopt.branches[i].rw) {
+    if (BRANCHES[i].rw) {
         // A lower branch still *might* have a file called 'from', we need to delete this.
         // We only need to do this if we have been on a rw-branch, since we created
         // a whiteout for read-only branches anyway.
@@ -447,140 +726,48 @@ static int ulakefs_rename(const char *from, const char *to) {
             maybe_whiteout(from, i, WHITEOUT_FILE);
     }
 
-    remove_hidden(to, i); // remove hide file (if any)
-    RETURN(0);
-}
+    // to may have had cached masks for another directory
+    if (is_dir) dirmap_forget();
 
-/**
- * Wrapper function to convert the result of statfs() to statvfs()
- * libfuse uses statvfs, since it conforms to POSIX. Unfortunately,
- * glibc's statvfs parses /proc/mounts, which then results in reading
- * the filesystem itself again - which would result in a deadlock.
- */
-static int statvfs_local(const char *path, struct statvfs *stbuf) {
-#ifdef linux
-    /* glibc's statvfs walks /proc/mounts and stats entries found there
-     * in order to extract their mount flags, which may deadlock if they
-     * are mounted under the ulakefs. As a result, we have to do this
-     * ourselves.
-     */
-    struct statfs stfs;
-    int res = statfs(path, &stfs);
-    if (res == -1) RETURN(res);
-
-    memset(stbuf, 0, sizeof(*stbuf));
-    stbuf->f_bsize = stfs.f_bsize;
-    if (stfs.f_frsize) {
-        stbuf->f_frsize = stfs.f_frsize;
-    } else {
-        stbuf->f_frsize = stfs.f_bsize;
+    if (!is_dir && strcmp(from, to) != 0) {
+        stripe_unlink(to, i); // members of a replaced striped file
+        if (striped && stripe_rename(from, to, i))
+            USYSLOG(LOG_ERR, "%s: moving the stripes of %s to %s failed\n", __func__, from, to);
     }
-    stbuf->f_blocks = stfs.f_blocks;
-    stbuf->f_bfree = stfs.f_bfree;
-    stbuf->f_bavail = stfs.f_bavail;
-    stbuf->f_files = stfs.f_files;
-    stbuf->f_ffree = stfs.f_ffree;
-    stbuf->f_favail = stfs.f_ffree; /* nobody knows */
-
-    /* We don't worry about flags, exactly because this would
-     * require reading /proc/mounts, and avoiding that and the
-     * resulting deadlocks is exactly what we're trying to avoid
-     * by doing this rather than using statvfs.
-     */
-    stbuf->f_flag = 0;
-    stbuf->f_namemax = stfs.f_namelen;
 
+    if (is_dir) {
+        // lower directories called to must not show up in the renamed one
+        if (i > 0) remove_hidden(to, i - 1);
+        make_opaque(to, i);
+    } else {
+        remove_hidden(to, i); // remove hide file (if any)
+    }
     RETURN(0);
-#else
-    RETURN(statvfs(path, stbuf));
-#endif
 }
 
-
 /**
  * statvs implementation
- *
- * Note: We do not set the fsid, as fuse ignores it anyway.
  */
 static int ulakefs_statfs(const char *path, struct statvfs *stbuf) {
+    branches_enter(NULL);
+
     (void)path;
 
     DBG("%s\n", path);
 
-    int first = 1;
-
-    dev_t devno[uopt.nbranches];
-
-    int retVal = 0;
-
-    int i = 0;
-    for (i = 0; i < uopt.nbranches; i++) {
-        struct statvfs stb;
-        int res = statvfs_local(uopt.branches[i].path, &stb);
-        if (res == -1) {
-            retVal = -errno;
-            break;
-        }
-
-        struct stat st;
-        res = stat(uopt.branches[i].path, &st);
-        if (res == -1) {
-            retVal = -errno;
-            break;
-        }
-        devno[i] = st.st_dev;
-
-        if (first) {
-            memcpy(stbuf, &stb, sizeof(*stbuf));
-            first = 0;
-            stbuf->f_fsid = stb.f_fsid << 8;
-            continue;
-        }
-
-        // Eliminate same devices
-        int j = 0;
-        for (j = 0; j < i; j ++) {
-            if (st.st_dev == devno[j]) break;
-        }
-
-        if (j == i) {
-            // Filesystem can have different block sizes -> normalize to first's block size
-            double ratio = (double)stb.f_bsize / (double)stbuf->f_bsize;
-
-            if (uopt.branches[i].rw) {
-                stbuf->f_blocks += stb.f_blocks * ratio;
-                stbuf->f_bfree += stb.f_bfree * ratio;
-                stbuf->f_bavail += stb.f_bavail * ratio;
-
-                stbuf->f_files += stb.f_files;
-                stbuf->f_ffree += stb.f_ffree;
-                stbuf->f_favail += stb.f_favail;
-            } else if (!uopt.statfs_omit_ro) {
-                // omitting the RO branches is not correct regarding
-                // the block counts but it actually fixes the
-                // percentage of free space. so, let the user decide.
-                stbuf->f_blocks += stb.f_blocks * ratio;
-                stbuf->f_files  += stb.f_files;
-            }
-
-            if (!(stb.f_flag & ST_RDONLY)) stbuf->f_flag &= ~ST_RDONLY;
-            if (!(stb.f_flag & ST_NOSUID)) stbuf->f_flag &= ~ST_NOSUID;
-
-            if (stb.f_namemax < stbuf->f_namemax) stbuf->f_namemax = stb.f_namemax;
-        }
-    }
-
-    RETURN(retVal);
+    RETURN(statfs_get(stbuf));
 }
 
 static int ulakefs_symlink(const char *from, const char *to) {
+    branches_enter(NULL);
+
     DBG("from %s to %s\n", from, to);
 
-    int i = find_rw_branch_cutlast(to);
+    int i = find_rw_branch_create(to);
     if (i == -1) RETURN(-errno);
 
     char t[PATHLEN_MAX];
-    if (BUILD_PATH(t, uopt.branches[i].path, to)) RETURN(-ENAMETOOLONG);
+    if (BUILD_PATH(t, BRANCHES[i].path, to)) RETURN(-ENAMETOOLONG);
 
     int res = symlink(from, t);
     if (res == -1) RETURN(-errno);
@@ -592,29 +779,60 @@ static int ulakefs_symlink(const char *from, const char *to) {
 }
 
 static int ulakefs_truncate(const char *path, off_t size) {
+    branches_enter(NULL);
+
     DBG("%s\n", path);
 
+    if (ctl_path(path)) RETURN(ctl_truncate(path));
+
     int i = find_rw_branch_cow(path);
     if (i == -1) RETURN(-errno);
 
     char p[PATHLEN_MAX];
-    if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+    if (BUILD_PATH(p, BRANCHES[i].path, path)) RETURN(-ENAMETOOLONG);
+
+    int res = stripe_truncate(path, i, size);
+    if (res != 1) RETURN(res);
+
+    res = truncate(p, size);
+
+    if (res == -1) RETURN(-errno);
+
+    RETURN(0);
+}
 
-    int res = truncate(p, size);
+/**
+ * truncate of an open file. The file was opened for writing, so it already
+ * is on a writable branch and no copy-on-write is required.
+ */
+static int ulakefs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    branches_enter(UFILE(fi)->set);
+
+    int fd = UFILE(fi)->fd;
+    DBG("fd = %d\n", fd);
+
+    if (UFILE(fi)->branch == -1) RETURN(ctl_truncate(path));
+
+    int res = stripe_grow(path, UFILE(fi), size, true);
+    if (res) RETURN(res);
+    if (UFILE(fi)->stripe) RETURN(stripe_ftruncate(UFILE(fi), size));
 
+    res = ftruncate(fd, size);
     if (res == -1) RETURN(-errno);
 
     RETURN(0);
 }
 
 static int ulakefs_utimens(const char *path, const struct timespec ts[2]) {
+    branches_enter(NULL);
+
     DBG("%s\n", path);
 
     int i = find_rw_branch_cow(path);
     if (i == -1) RETURN(-errno);
 
     char p[PATHLEN_MAX];
-    if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+    if (BUILD_PATH(p, BRANCHES[i].path, path)) RETURN(-ENAMETOOLONG);
 
 #ifdef ULAKEFS_HAVE_AT
     int res = utimensat(0, p, ts, AT_SYMLINK_NOFOLLOW);
@@ -633,16 +851,82 @@ static int ulakefs_utimens(const char *path, const struct timespec ts[2]) {
 }
 
 static int ulakefs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    (void)path;
+    branches_enter(UFILE(fi)->set);
+
+    int fd = UFILE(fi)->fd;
+    DBG("fd = %d\n", fd);
 
-    DBG("fd = %"PRIx64"\n", fi->fh);
+    if (UFILE(fi)->branch == -1) RETURN(ctl_write(path, buf, size));
 
-    int res = pwrite(fi->fh, buf, size, offset);
+    int err = stripe_grow(path, UFILE(fi), offset + size, true);
+    if (err) RETURN(err);
+
+    // stripe_pwrite() accounts the members itself
+    if (UFILE(fi)->stripe) {
+        int res = stripe_pwrite(UFILE(fi), buf, size, offset);
+        if (res == -1) RETURN(-errno);
+        RETURN(res);
+    }
+
+    int res = pwrite(fd, buf, size, offset);
     if (res == -1) RETURN(-errno);
 
+    policy_written(UFILE(fi)->branch, res);
+
     RETURN(res);
 }
 
+#if FUSE_VERSION >= 29
+/**
+ * Counterpart of ulakefs_read_buf(), libfuse splices the request data
+ * from /dev/fuse into the branch fd where possible
+ */
+static int ulakefs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                             struct fuse_file_info *fi) {
+    branches_enter(UFILE(fi)->set);
+
+    int fd = UFILE(fi)->fd;
+    DBG("fd = %d\n", fd);
+
+    if (UFILE(fi)->branch != -1) {
+        int err = stripe_grow(path, UFILE(fi), offset + fuse_buf_size(buf), true);
+        if (err) RETURN(err);
+    }
+
+    if (UFILE(fi)->stripe || UFILE(fi)->branch == -1) {
+        // gather the request into memory, it may span several members
+        size_t size = fuse_buf_size(buf);
+        char *mem = malloc(size);
+        if (!mem) RETURN(-ENOMEM);
+
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        dst.buf[0].mem = mem;
+
+        int res = fuse_buf_copy(&dst, buf, 0);
+        if (res >= 0 && UFILE(fi)->branch == -1) {
+            res = ctl_write(path, mem, res);
+        } else if (res >= 0) {
+            res = stripe_pwrite(UFILE(fi), mem, res, offset);
+            if (res == -1) res = -errno;
+        }
+        free(mem);
+        RETURN(res);
+    }
+
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst.buf[0].fd = fd;
+    dst.buf[0].pos = offset;
+
+    int res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+    if (res < 0) RETURN(res);
+
+    policy_written(UFILE(fi)->branch, res);
+
+    RETURN(res);
+}
+#endif
+
 /**
  * XATTR will be implemented later since I'm too tired
  * https://man7.org/linux/man-pages/man7/xattr.7.html
@@ -654,7 +938,9 @@ struct fuse_operations ulakefs_oper = {
         .chown = ulakefs_chown,
         .create = ulakefs_create,
         .flush = ulakefs_flush,
+        .fgetattr = ulakefs_fgetattr,
         .fsync = ulakefs_fsync,
+        .ftruncate = ulakefs_ftruncate,
         .getattr = ulakefs_getattr,
         .access = ulakefs_access,
         .init = ulakefs_init,
@@ -674,6 +960,11 @@ struct fuse_operations ulakefs_oper = {
         .unlink = ulakefs_unlink,
         .utimens = ulakefs_utimens,
         .write = ulakefs_write,
+#if FUSE_VERSION >= 29
+        .fallocate = ulakefs_fallocate,
+        .read_buf = ulakefs_read_buf,
+        .write_buf = ulakefs_write_buf,
+#endif
 #ifdef HAVE_XATTR
         .getxattr = ulakefs_getxattr,
 	.listxattr = ulakefs_listxattr,
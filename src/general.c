@@ -4,6 +4,8 @@
 /*
  * https://www.cs.hmc.edu/~geoff/classes/hmc.cs135.201001/homework/fuse/fuse_doc.html based on this
  */
+#define _GNU_SOURCE // copy_file_range(), fallocate()
+
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
@@ -17,20 +19,86 @@
 #include <pthread.h>
 #include <syslog.h>
 #include <dirent.h>
-#include <locale.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/ioctl.h>
 #include "Ulakefs.h"
 #include "options.h"
 #include "debug.h"
+#include "branches.h"
 #include "general.h"
+#include "policy.h"
+#include "copyup.h"
+#include "health.h"
+#include "bpool.h"
+#include "dirmap.h"
+#include "manifest.h"
+#include "wostore.h"
 
 #ifndef S_ISTXT
 #define S_ISTXT S_ISVTX
 #endif
 
+#if defined __linux__ && !defined FICLONE
+#define FICLONE _IOW(0x94, 9, int) // from linux/fs.h
+#endif
+
+// serialize copy-ups of the same path, the lock is picked by the path hash
+// and only guards the list of paths being copied, not the copy itself
+#define COW_LOCKS 64
+static pthread_mutex_t cow_locks[COW_LOCKS] = {
+    [0 ... COW_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+static pthread_cond_t cow_done[COW_LOCKS] = {
+    [0 ... COW_LOCKS - 1] = PTHREAD_COND_INITIALIZER
+};
+
+// a path being copied up, on the stack of the copying thread
+struct cow_busy {
+    const char *path;
+    struct cow_busy *next;
+};
+static struct cow_busy *cow_busy[COW_LOCKS];
+
+/**
+ * Wait while another thread copies path up, then mark it busy. Returns
+ * the lock index to pass to cow_end().
+ */
+static int cow_begin(const char *path, struct cow_busy *busy) {
+    int s = string_hash((void *)path) % COW_LOCKS;
+
+    pthread_mutex_lock(&cow_locks[s]);
+    while (1) {
+        struct cow_busy *b;
+        for (b = cow_busy[s]; b && strcmp(b->path, path) != 0; b = b->next);
+        if (!b) break;
+        pthread_cond_wait(&cow_done[s], &cow_locks[s]);
+    }
+
+    busy->path = path;
+    busy->next = cow_busy[s];
+    cow_busy[s] = busy;
+    pthread_mutex_unlock(&cow_locks[s]);
+
+    return s;
+}
+
+static void cow_end(int s, struct cow_busy *busy) {
+    pthread_mutex_lock(&cow_locks[s]);
+
+    struct cow_busy **prev = &cow_busy[s];
+    while (*prev != busy) prev = &(*prev)->next;
+    *prev = busy->next;
+
+    pthread_cond_broadcast(&cow_done[s]);
+    pthread_mutex_unlock(&cow_locks[s]);
+}
+
 /**
  * Check if a file or directory with the hidden flag exists.
+ * path is below branch, the manifest of the branch answers if it has one.
  */
-static int filedir_hidden(const char *path) {
+static int filedir_hidden(const char *path, int branch) {
     // cow mode disabled, no need for hidden files
     if (!uopt.cow_enabled) RETURN(false);
 
@@ -40,7 +108,8 @@ static int filedir_hidden(const char *path) {
     DBG("%s\n", p);
 
     struct stat stbuf;
-    int res = lstat(p, &stbuf);
+    int res = manifest_lstat(branch, p + BRANCHES[branch].path_len - 1, &stbuf);
+    if (res == 1) res = lstat(p, &stbuf);
     if (res == 0) RETURN(1);
 
     RETURN(0);
@@ -54,11 +123,13 @@ int path_hidden(const char *path, int branch) {
 
     if (!uopt.cow_enabled) RETURN(false);
 
+    if (uopt.whiteout_store) RETURN(wostore_path_hidden(path, branch));
+
     char whiteoutpath[PATHLEN_MAX];
-    if (BUILD_PATH(whiteoutpath, uopt.branches[branch].path, METADIR, path)) RETURN(false);
+    if (BUILD_PATH(whiteoutpath, BRANCHES[branch].path, METADIR, path)) RETURN(false);
 
     // -1 as we MUST not end on the next path element
-    char *walk = whiteoutpath + uopt.branches[branch].path_len + strlen(METADIR) - 1;
+    char *walk = whiteoutpath + BRANCHES[branch].path_len + strlen(METADIR) - 1;
 
     // first slashes, e.g. we have path = /dir1/dir2/, will set walk = dir1/dir2/
     while (*walk == '/') walk++;
@@ -71,7 +142,7 @@ int path_hidden(const char *path, int branch) {
         char p[PATHLEN_MAX];
         // walk - path = strlen(/dir1)
         snprintf(p, (walk - whiteoutpath) + 1, "%s", whiteoutpath);
-        int res = filedir_hidden(p);
+        int res = filedir_hidden(p, branch);
         if (res) RETURN(res); // path is hidden or error
 
         // as above the do loop, walk over the next slashes, walk = dir2/
@@ -90,12 +161,17 @@ int remove_hidden(const char *path, int maxbranch) {
 
     if (!uopt.cow_enabled) RETURN(0);
 
-    if (maxbranch == -1) maxbranch = uopt.nbranches;
+    if (maxbranch == -1) maxbranch = NBRANCHES;
 
     int i;
     for (i = 0; i <= maxbranch; i++) {
+        if (uopt.whiteout_store) {
+            if (wostore_remove(path, i) > 0) dirmap_forget();
+            continue;
+        }
+
         char p[PATHLEN_MAX];
-        if (BUILD_PATH(p, uopt.branches[i].path, METADIR, path)) RETURN(-ENAMETOOLONG);
+        if (BUILD_PATH(p, BRANCHES[i].path, METADIR, path)) RETURN(-ENAMETOOLONG);
         if (strlen(p) + strlen(HIDETAG) > PATHLEN_MAX) RETURN(-ENAMETOOLONG);
         strcat(p, HIDETAG); // TODO check length
 
@@ -104,6 +180,9 @@ int remove_hidden(const char *path, int maxbranch) {
             case IS_DIR: rmdir(p); break;
             case NOT_EXISTING: continue;
         }
+
+        // lower branches may be visible again below path
+        dirmap_forget();
     }
 
     RETURN(0);
@@ -140,11 +219,27 @@ static int do_create_whiteout(const char *path, int branch_rw, enum whiteout mod
     // this creates e.g. branch/.ulakefs/some_directory
     path_create_cutlast(metapath, branch_rw, branch_rw);
 
+    int res;
+    if (uopt.whiteout_store) {
+        // a record in the whiteout file of the parent instead of a marker
+        res = wostore_add(path, branch_rw);
+        if (res) {
+            errno = -res;
+            RETURN(-1);
+        }
+
+        dirmap_add(path, branch_rw);
+        RETURN(0);
+    }
+
     char p[PATHLEN_MAX];
-    if (BUILD_PATH(p, uopt.branches[branch_rw].path, metapath)) RETURN(-1);
+    if (BUILD_PATH(p, BRANCHES[branch_rw].path, metapath)) RETURN(-1);
     strcat(p, HIDETAG); // TODO check length
 
-    int res;
+    // already hidden, e.g. by the whiteout of an opaque directory
+    struct stat st;
+    if (lstat(p, &st) == 0) RETURN(0);
+
     if (mode == WHITEOUT_FILE) {
         res = open(p, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
         if (res == -1) RETURN(-1);
@@ -155,6 +250,8 @@ static int do_create_whiteout(const char *path, int branch_rw, enum whiteout mod
             USYSLOG(LOG_ERR, "Creating %s failed: %s\n", p, strerror(errno));
     }
 
+    if (res == 0) dirmap_add(path, branch_rw);
+
     RETURN(res);
 }
 
@@ -192,6 +289,70 @@ int maybe_whiteout(const char *path, int branch_rw, enum whiteout mode) {
     RETURN(0);
 }
 
+static int purge_whiteout(const char *fpath, const struct stat *sb, int type, struct FTW *ftw) {
+    (void)sb;
+
+    const char *name = fpath + ftw->base;
+    if (whiteout_tag(name) || strcmp(name, WHITEOUTS_NAME) == 0
+        || strcmp(name, WHITEOUTS_NAME "~") == 0) {
+        if (type == FTW_DP) rmdir(fpath); else unlink(fpath);
+    } else if (type == FTW_DP) {
+        rmdir(fpath); // fails as long as other meta files are left
+    }
+
+    return 0;
+}
+
+/**
+ * Called after the directory path was created on branch_rw. If a whiteout
+ * there hides lower directories of the same name, path becomes an opaque
+ * directory: the whiteout stays, and the whiteouts below path, left from
+ * earlier incarnations of the directory, are removed. Lower branches are
+ * never read below path, so lookups and readdir() stop at branch_rw
+ * without collecting stale whiteouts.
+ */
+int make_opaque(const char *path, int branch_rw) {
+    DBG("%s\n", path);
+
+    if (!uopt.cow_enabled) RETURN(0);
+
+    char p[PATHLEN_MAX];
+    if (BUILD_PATH(p, BRANCHES[branch_rw].path, METADIR, path)) RETURN(-ENAMETOOLONG);
+    size_t len = strlen(p);
+    if (len + strlen(HIDETAG) + 1 >= PATHLEN_MAX) RETURN(-ENAMETOOLONG);
+    strcpy(p + len, HIDETAG);
+
+    struct stat st;
+    if (uopt.whiteout_store) {
+        // the record of path in its parent marks it opaque
+        if (wostore_hidden(path, branch_rw) != 1) RETURN(0);
+    } else if (lstat(p, &st) == -1) {
+        RETURN(0); // nothing hidden below path
+    }
+
+    p[len] = '\0';
+    nftw(p, purge_whiteout, 16, FTW_DEPTH | FTW_PHYS);
+    if (uopt.whiteout_store) wostore_purge(path, branch_rw);
+
+    RETURN(0);
+}
+
+/**
+ * Create the directories of p, a file below the meta directory of branch b
+ */
+int meta_mkdirs(char *p, const branch_entry_t *b) {
+    char *walk = p + b->path_len;
+
+    while ((walk = strchr(walk + 1, '/')) != NULL) {
+        *walk = '\0';
+        int res = mkdir(p, S_IRWXU);
+        *walk = '/';
+        if (res == -1 && errno != EEXIST) return -1;
+    }
+
+    return 0;
+}
+
 /**
  * Set file owner of after an operation, which created a file.
  */
@@ -209,33 +370,75 @@ int set_owner(const char *path) {
     RETURN(0);
 }
 
+/**
+ * Allocate the state of an open file, stored in fi->fh
+ */
+ufile_t *ufile_new(int fd, int branch) {
+    ufile_t *uf = calloc(1, sizeof(ufile_t));
+    if (!uf) return NULL;
+
+    uf->fd = fd;
+    uf->branch = branch;
+    uf->mirror_fd = -1;
+    uf->set = BRANCH_SET();
+
+    return uf;
+}
+
 /** Branches
  *  Find a branch that has "path". Return the branch number.
  */
-static int find_branch(const char *path, searchflag_t flag) {
+static int find_branch(const char *path, searchflag_t flag, struct stat *st) {
     DBG("%s\n", path);
 
+    // only the branches of the parent directory can have path
+    uint64_t mask = dirmap_lookup(path);
+    dirmap_skipped(mask);
+
     int i = 0;
-    for (i = 0; i < uopt.nbranches; i++) {
+    for (i = 0; i < NBRANCHES; i++) {
+        if (!(mask & ((uint64_t)1 << i))) continue;
+
         char p[PATHLEN_MAX];
-        if (BUILD_PATH(p, uopt.branches[i].path, path)) {
+        if (BUILD_PATH(p, BRANCHES[i].path, path)) {
             errno = ENAMETOOLONG;
             RETURN(-1);
         }
 
+        // immutable branches with a manifest need no syscall
         struct stat stbuf;
-        int res = lstat(p, &stbuf);
+        int res = manifest_lstat(i, path, &stbuf);
+
+        if (res == 1) {
+            // a degraded branch is skipped or fails fast with EIO
+            int skip = health_check(i);
+            if (skip < 0) RETURN(-1);
+            if (skip) continue;
+
+            res = health_lstat(i, p, &stbuf);
+        }
 
         DBG("%s: res = %d\n", p, res);
 
+        if (res == -1 && errno == ETIMEDOUT) {
+            // the branch hangs, treat it as degraded for this lookup
+            if (!uopt.branch_skip) {
+                errno = EIO;
+                RETURN(-1);
+            }
+            continue;
+        }
+
         if (res == 0) { // path was found
+            if (st) *st = stbuf;
+
             switch (flag) {
                 case RWRO:
                     // any path we found is fine
                     RETURN(i);
                 case RWONLY:
                     // we need a rw-branch
-                    if (uopt.branches[i].rw) RETURN(i);
+                    if (BRANCHES[i].rw) RETURN(i);
                     break;
                 default:
                     USYSLOG(LOG_ERR, "%s: Unknown flag %d\n", __func__, flag);
@@ -263,7 +466,16 @@ static int find_branch(const char *path, searchflag_t flag) {
  */
 int find_rorw_branch(const char *path) {
     DBG("%s\n", path);
-    int res = find_branch(path, RWRO);
+    int res = find_branch(path, RWRO, NULL);
+    RETURN(res);
+}
+
+/**
+ * Find a ro or rw branch and return the lstat() of path on it in st.
+ */
+int find_rorw_branch_stat(const char *path, struct stat *st) {
+    DBG("%s\n", path);
+    int res = find_branch(path, RWRO, st);
     RETURN(res);
 }
 
@@ -297,7 +509,7 @@ int __find_rw_branch_cutlast(const char *path, int rw_hint) {
     if (branch < 0) goto out;
 
     // Reminder rw_hint == -1 -> autodetect, we do not care which branch it is
-    if (uopt.branches[branch].rw
+    if (BRANCHES[branch].rw
         && (rw_hint == -1 || branch == rw_hint)) goto out;
 
     if (!uopt.cow_enabled) {
@@ -310,7 +522,7 @@ int __find_rw_branch_cutlast(const char *path, int rw_hint) {
     int branch_rw;
     // since it is a directory, any rw-branch is fine
     if (rw_hint == -1)
-        branch_rw = find_lowest_rw_branch(uopt.nbranches);
+        branch_rw = find_lowest_rw_branch(NBRANCHES);
     else
         branch_rw = rw_hint;
 
@@ -340,6 +552,39 @@ int find_rw_branch_cutlast(const char *path) {
     RETURN(res);
 }
 
+/**
+ * Find the writable branch for a new file, directory or symlink. An existing
+ * path stays where it is, otherwise the create policy picks the branch and
+ * the parent directory is created there if required.
+ */
+int find_rw_branch_create(const char *path) {
+    int branch_rw = policy_create_branch(path);
+    if (branch_rw < 0) RETURN(find_rw_branch_cutlast(path));
+
+    int branch = find_rw_branch_cow(path);
+    if (branch >= 0 || errno != ENOENT) RETURN(branch);
+
+    char *dname = u_dirname(path);
+    if (dname == NULL) {
+        errno = ENOMEM;
+        RETURN(-1);
+    }
+
+    branch = find_rorw_branch(dname);
+    if (branch >= 0) {
+        // without cow policy_create_branch() only picks branches with the parent
+        if (path_create(dname, branch, branch_rw) == 0) {
+            branch = branch_rw;
+        } else {
+            branch = -1;
+            errno = EACCES;
+        }
+    }
+    free(dname);
+
+    RETURN(branch);
+}
+
 int find_rw_branch_cow(const char *path) {
     return find_rw_branch_cow_common(path, false);
 }
@@ -361,7 +606,7 @@ int find_rw_branch_cow_common(const char *path, bool copy_dir) {
     if (branch_rorw < 0) RETURN(-1);
 
     // the found branch is writable, good!
-    if (uopt.branches[branch_rorw].rw) RETURN(branch_rorw);
+    if (BRANCHES[branch_rorw].rw) RETURN(branch_rorw);
 
     // cow is disabled and branch is not writable, so deny write permission
     if (!uopt.cow_enabled) {
@@ -369,18 +614,34 @@ int find_rw_branch_cow_common(const char *path, bool copy_dir) {
         RETURN(-1);
     }
 
+    struct cow_busy busy;
+    int s = cow_begin(path, &busy);
+
+    // another thread might have copied path while we were waiting
+    branch_rorw = find_rorw_branch(path);
+    if (branch_rorw < 0 || BRANCHES[branch_rorw].rw) {
+        cow_end(s, &busy);
+        RETURN(branch_rorw);
+    }
+
     int branch_rw = find_lowest_rw_branch(branch_rorw);
     if (branch_rw < 0) {
+        cow_end(s, &busy);
         // no writable branch found
         errno = EACCES;
         RETURN(-1);
     }
 
-    if (cow_cp(path, branch_rorw, branch_rw, copy_dir)) RETURN(-1);
+    if (cow_cp(path, branch_rorw, branch_rw, copy_dir)) {
+        cow_end(s, &busy);
+        RETURN(-1);
+    }
 
     // remove a file that might hide the copied file
     remove_hidden(path, branch_rw);
 
+    cow_end(s, &busy);
+
     RETURN(branch_rw);
 }
 
@@ -392,7 +653,7 @@ int find_lowest_rw_branch(int branch_ro) {
 
     int i = 0;
     for (i = 0; i < branch_ro; i++) {
-        if (uopt.branches[i].rw) RETURN(i); // found it it.
+        if (BRANCHES[i].rw) RETURN(i); // found it it.
     }
 
     RETURN(-1);
@@ -405,7 +666,7 @@ static int do_create(const char *path, int nbranch_ro, int nbranch_rw) {
     DBG("%s\n", path);
 
     char dirp[PATHLEN_MAX]; // dir path to create
-    sprintf(dirp, "%s%s", uopt.branches[nbranch_rw].path, path);
+    sprintf(dirp, "%s%s", BRANCHES[nbranch_rw].path, path);
 
     struct stat buf;
     int res = stat(dirp, &buf);
@@ -418,7 +679,7 @@ static int do_create(const char *path, int nbranch_ro, int nbranch_rw) {
     } else {
         // data from the ro-branch
         char o_dirp[PATHLEN_MAX]; // the pathname we want to copy
-        sprintf(o_dirp, "%s%s", uopt.branches[nbranch_ro].path, path);
+        sprintf(o_dirp, "%s%s", BRANCHES[nbranch_ro].path, path);
         res = stat(o_dirp, &buf);
         if (res == -1) RETURN(1); // lower level branch removed in the mean time?
     }
@@ -431,6 +692,8 @@ static int do_create(const char *path, int nbranch_ro, int nbranch_rw) {
 
     if (nbranch_ro == nbranch_rw) RETURN(0); // the special case again
 
+    dirmap_add(path, nbranch_rw);
+
     if (setfile(dirp, &buf)) RETURN(1); // directory already removed by another process?
 
     // TODO: time, but its values are modified by the next dir/file creation steps?
@@ -448,7 +711,7 @@ int path_create(const char *path, int nbranch_ro, int nbranch_rw) {
     if (!uopt.cow_enabled) RETURN(0);
 
     char p[PATHLEN_MAX];
-    if (BUILD_PATH(p, uopt.branches[nbranch_rw].path, path)) RETURN(-ENAMETOOLONG);
+    if (BUILD_PATH(p, BRANCHES[nbranch_rw].path, path)) RETURN(-ENAMETOOLONG);
 
     struct stat st;
     if (!stat(p, &st)) {
@@ -493,6 +756,10 @@ int path_create_cutlast(const char *path, int nbranch_ro, int nbranch_rw) {
     RETURN(ret);
 }
 
+static int copy_file_fn(void *arg) {
+    return copy_file(*(struct cow **)arg);
+}
+
 /**
  * initiate the cow-copy action
  */
@@ -503,20 +770,18 @@ int cow_cp(const char *path, int branch_ro, int branch_rw, bool copy_dir) {
     path_create_cutlast(path, branch_ro, branch_rw);
 
     char from[PATHLEN_MAX], to[PATHLEN_MAX];
-    if (BUILD_PATH(from, uopt.branches[branch_ro].path, path))
+    if (BUILD_PATH(from, BRANCHES[branch_ro].path, path))
         RETURN(-ENAMETOOLONG);
-    if (BUILD_PATH(to, uopt.branches[branch_rw].path, path))
+    if (BUILD_PATH(to, BRANCHES[branch_rw].path, path))
         RETURN(-ENAMETOOLONG);
 
-    setlocale(LC_ALL, "");
-
     struct cow cow;
 
     cow.uid = getuid();
+    cow.background = false;
 
-    // Copy the umask for explicit mode setting.
-    cow.umask = umask(0);
-    umask(cow.umask);
+    // umask() is process wide and 0 while mounted, use the one from startup
+    cow.umask = uopt.umask;
 
     cow.from_path = from;
     cow.to_path = to;
@@ -548,7 +813,13 @@ int cow_cp(const char *path, int branch_ro, int branch_rw, bool copy_dir) {
             USYSLOG(LOG_WARNING, "COW of sockets not supported: %s\n", cow.from_path);
             RETURN(1);
         default:
-            res = copy_file(&cow);
+            if (copyup_enabled()) {
+                res = copyup_run(&cow);
+            } else {
+                // on the copy workers of the branch the copy reads from
+                struct cow *c = &cow;
+                res = bpool_copy(branch_ro, copy_file_fn, &c, sizeof(c));
+            }
     }
 
     RETURN(res);
@@ -568,7 +839,7 @@ int copy_directory(const char *path, int branch_ro, int branch_rw) {
 
     /* determine path to source directory on read-only branch */
     char from[PATHLEN_MAX];
-    if (BUILD_PATH(from, uopt.branches[branch_ro].path, path)) RETURN(1);
+    if (BUILD_PATH(from, BRANCHES[branch_ro].path, path)) RETURN(1);
 
     DIR *dp = opendir(from);
     if (dp == NULL) RETURN(1);
@@ -664,6 +935,152 @@ static int setlink(const char *path, struct stat *fs)
 }
 
 
+/**
+ * state shared by the threads of a chunked copy
+ */
+struct copy_chunks {
+    int from_fd;
+    int to_fd;
+    off_t size;		// bytes to copy
+    off_t next;		// offset of the next chunk to hand out
+    int err;		// first error, stops all threads
+    const volatile bool *background;	// of the cow, throttle while set
+    pthread_mutex_t lock;
+};
+
+// fallback copy size and throttle granularity
+#define COPY_STEP (1024 * 1024)
+
+/**
+ * Copy [off, off + len) with explicit offsets, so any number of threads
+ * may copy different ranges of the same file. The kernel copies the data
+ * with copy_file_range() if it can, otherwise pread()/pwrite() are used.
+ */
+static int copy_range(struct copy_chunks *cc, off_t off, off_t len) {
+    char *buf = NULL;
+    int res = 0;
+
+    while (len > 0) {
+        size_t step = len;
+        if (*cc->background && step > COPY_STEP) step = COPY_STEP;
+
+        ssize_t done = -1;
+#ifdef __linux__
+        if (!buf) {
+            loff_t in = off, out = off;
+            done = copy_file_range(cc->from_fd, &in, cc->to_fd, &out, step, 0);
+            if (done == -1 && errno != EXDEV && errno != ENOSYS
+                && errno != EINVAL && errno != EOPNOTSUPP) {
+                res = errno;
+                break;
+            }
+        }
+#endif
+        if (done == -1) {
+            // not supported between these files, copy through userspace
+            if (!buf && !(buf = malloc(COPY_STEP))) {
+                res = ENOMEM;
+                break;
+            }
+            if (step > COPY_STEP) step = COPY_STEP;
+
+            done = pread(cc->from_fd, buf, step, off);
+            if (done == -1) {
+                res = errno;
+                break;
+            }
+            ssize_t written = pwrite(cc->to_fd, buf, done, off);
+            if (written != done) {
+                res = written == -1 ? errno : EIO;
+                break;
+            }
+        }
+
+        if (done == 0) break; // source got shorter in the mean time
+
+        if (*cc->background) copyup_throttle(done);
+
+        off += done;
+        len -= done;
+    }
+
+    free(buf);
+    return res;
+}
+
+static void *copy_chunks_thread(void *arg) {
+    struct copy_chunks *cc = arg;
+
+    while (1) {
+        pthread_mutex_lock(&cc->lock);
+        off_t off = cc->next;
+        off_t len = uopt.copy_chunk_size;
+        if (cc->err || off >= cc->size) {
+            pthread_mutex_unlock(&cc->lock);
+            break;
+        }
+        if (len > cc->size - off) len = cc->size - off;
+        cc->next += len;
+        pthread_mutex_unlock(&cc->lock);
+
+        int res = copy_range(cc, off, len);
+        if (res) {
+            pthread_mutex_lock(&cc->lock);
+            if (!cc->err) cc->err = res;
+            pthread_mutex_unlock(&cc->lock);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Copy a large file in chunks of -o copy_chunk_size on -o copy_threads
+ * threads. The destination is preallocated first, so parallel writes
+ * at different offsets do not fragment it. Its size is only set by the
+ * writes, a source that got shorter meanwhile leaves no zeroed tail.
+ */
+static int copy_file_chunked(struct cow *cow, int from_fd, int to_fd) {
+    DBG("from %s to %s\n", cow->from_path, cow->to_path);
+
+    struct copy_chunks cc;
+    cc.from_fd = from_fd;
+    cc.to_fd = to_fd;
+    cc.size = cow->stat->st_size;
+    cc.next = 0;
+    cc.err = 0;
+    cc.background = &cow->background;
+    pthread_mutex_init(&cc.lock, NULL);
+
+#ifdef __linux__
+    if (fallocate(to_fd, FALLOC_FL_KEEP_SIZE, 0, cc.size) == -1 && errno != EOPNOTSUPP)
+        USYSLOG(LOG_INFO, "fallocate of %s failed: %s\n", cow->to_path, strerror(errno));
+#endif
+
+    int nthreads = uopt.copy_threads;
+    pthread_t threads[nthreads];
+
+    // the calling thread is one of the copy threads
+    int i, started = 0;
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, copy_chunks_thread, &cc)) break;
+        started = i;
+    }
+
+    copy_chunks_thread(&cc);
+
+    for (i = 1; i <= started; i++) pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&cc.lock);
+
+    if (cc.err) {
+        USYSLOG(LOG_WARNING, "copy failed: %s: %s", cow->from_path, strerror(cc.err));
+        RETURN(1);
+    }
+
+    RETURN(0);
+}
+
 /**
  * copy an ordinary file with all of its stat() data
  **/
@@ -671,7 +1088,7 @@ int copy_file(struct cow *cow)
 {
     DBG("from %s to %s\n", cow->from_path, cow->to_path);
 
-    static char buf[4096];
+    char buf[4096]; // on the stack, copies run in parallel
     struct stat to_stat, *fs;
     int from_fd, rcount, to_fd, wcount;
     int rval = 0;
@@ -720,7 +1137,15 @@ int copy_file(struct cow *cow)
 		}
 	} else
 #endif
-    {
+#ifdef FICLONE
+    // branches on the same btrfs/xfs: share the extents, no data is copied
+    if (fs->st_size > 0 && ioctl(to_fd, FICLONE, from_fd) == 0) {
+        DBG("reflinked %s\n", cow->to_path);
+    } else
+#endif
+    if (uopt.copy_threads > 1 && fs->st_size >= 2 * uopt.copy_chunk_size) {
+        rval = copy_file_chunked(cow, from_fd, to_fd);
+    } else {
         while ((rcount = read(from_fd, buf, 4096)) > 0) {
             wcount = write(to_fd, buf, rcount);
             if (rcount != wcount || wcount == -1) {
@@ -728,6 +1153,7 @@ int copy_file(struct cow *cow)
                 rval = 1;
                 break;
             }
+            if (cow->background) copyup_throttle(wcount);
         }
         if (rcount < 0) {
             USYSLOG(LOG_WARNING, "copy failed: %s", cow->from_path);
@@ -9,6 +9,7 @@
 
 #include <stdbool.h>
 #include <sys/stat.h>
+#include "Ulakefs.h"
 
 enum  whiteout {
     WHITEOUT_FILE,
@@ -27,7 +28,10 @@ int hide_file(const char *path, int branch_rw);
 int hide_dir(const char *path, int branch_rw);
 filetype_t path_is_dir (const char *path);
 int maybe_whiteout(const char *path, int branch_rw, enum whiteout mode);
+int make_opaque(const char *path, int branch_rw);
 int set_owner(const char *path);
+int meta_mkdirs(char *p, const branch_entry_t *b);
+ufile_t *ufile_new(int fd, int branch);
 
 /*
  * Copy on write and utils
@@ -47,6 +51,8 @@ struct cow {
 
     // destination file
     char *to_path;
+
+    volatile bool background;	// throttled, cleared when somebody waits for the copy
 };
 
 int setfile(const char *path, struct stat *fs);
@@ -64,8 +70,10 @@ typedef enum searchflag {
 } searchflag_t;
 
 int find_rorw_branch(const char *path);
+int find_rorw_branch_stat(const char *path, struct stat *st);
 int find_lowest_rw_branch(int branch_ro);
 int find_rw_branch_cutlast(const char *path);
+int find_rw_branch_create(const char *path);
 int __find_rw_branch_cutlast(const char *path, int rw_hint);
 int find_rw_branch_cow(const char *path);
 int find_rw_branch_cow_common(const char *path, bool copy_dir);
@@ -0,0 +1,214 @@
+//
+// Latency and error based health of the branches
+//
+/*
+ * With -o branch_timeout=ms the lstat() calls of the branch lookup, which
+ * run on the worker threads of the branch (bpool.c), are given up after
+ * the timeout. Every lookup and every probe is a sample of the branch: an
+ * error like EIO or ESTALE, a latency above -o branch_slow, or a timeout
+ * while a call on the branch is stuck for longer than the timeout is a
+ * strike, anything else but a timeout resets the strikes. A timeout of a
+ * call that only waited behind busy workers is counted, but no strike.
+ * HEALTH_STRIKES strikes in a row mark the branch degraded.
+ *
+ * Lookups do not touch a degraded branch. They fail with EIO, or with
+ * -o branch_degraded=skip continue on the next branch as if the path did
+ * not exist there. The probe thread lstat()s the root of every branch once
+ * a second, HEALTH_RECOVER good probes in a row bring a degraded branch
+ * back. Probes also find a hanging branch before lookups pile up on it.
+ * They are not queued while a call on the branch is stuck, that is a
+ * strike right away.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "branches.h"
+#include "bpool.h"
+#include "health.h"
+
+#define HEALTH_STRIKES 3	// bad samples in a row that degrade a branch
+#define HEALTH_RECOVER 3	// good probes in a row that bring it back
+#define HEALTH_EWMA_SHIFT 3	// new latency samples weigh 1/8
+
+struct branch_health {
+    int degraded;		// bool, read without the lock
+    unsigned int strikes;	// bad samples in a row
+    unsigned int good;	// good probes in a row while degraded
+    unsigned long long latency_us;	// moving average
+    unsigned long timeouts, errors, skipped;
+};
+
+static pthread_mutex_t health_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct branch_health *health;	// per branch id, NULL if disabled
+
+/**
+ * Errors which tell about the branch and not about the path
+ */
+static bool branch_error(int err) {
+    return err == EIO || err == ETIMEDOUT || err == ESTALE || err == ENOTCONN;
+}
+
+/**
+ * Account a sample of branch i. probe samples may bring it back.
+ */
+static void health_sample(int i, unsigned long long lat, int res, int err, bool probe) {
+    struct branch_health *h = &health[BRANCHES[i].id];
+
+    bool timeout = res == -1 && err == ETIMEDOUT;
+    bool bad = (res == -1 && branch_error(err)) || lat > uopt.branch_slow * 1000ULL;
+    bool busy = timeout && !bpool_stuck(i, uopt.branch_timeout);
+
+    pthread_mutex_lock(&health_lock);
+
+    if (busy) {
+        h->timeouts++;
+        pthread_mutex_unlock(&health_lock);
+        return;
+    }
+
+    if (timeout)
+        h->timeouts++;
+    else if (res == -1 && branch_error(err))
+        h->errors++;
+    else
+        h->latency_us += ((long long)lat - (long long)h->latency_us) >> HEALTH_EWMA_SHIFT;
+
+    if (bad) {
+        h->good = 0;
+        if (++h->strikes >= HEALTH_STRIKES && !h->degraded) {
+            h->degraded = true;
+            USYSLOG(LOG_WARNING, "branch %s degraded: %s\n", BRANCHES[i].path,
+                    res == -1 ? strerror(err) : "too slow");
+        }
+    } else {
+        h->strikes = 0;
+        if (h->degraded && probe && ++h->good >= HEALTH_RECOVER) {
+            h->degraded = false;
+            h->good = 0;
+            USYSLOG(LOG_INFO, "branch %s is healthy again\n", BRANCHES[i].path);
+        }
+    }
+
+    pthread_mutex_unlock(&health_lock);
+}
+
+static int timed_lstat(int i, const char *path, struct stat *st, bool probe) {
+    // the latency of the branch, the wait for a worker is not its fault
+    unsigned long long lat;
+    int res = bpool_lstat(i, path, st, uopt.branch_timeout, &lat);
+    int err = errno;
+
+    health_sample(i, lat, res, err, probe);
+
+    errno = err;
+    return res;
+}
+
+static void *probe_thread(void *arg) {
+    (void)arg;
+
+    while (1) {
+        branches_enter(NULL);
+
+        int i;
+        for (i = 0; i < NBRANCHES; i++) {
+            // do not pile up probes behind a hanging call, it is a strike
+            if (bpool_stuck(i, uopt.branch_timeout)) {
+                health_sample(i, 0, -1, ETIMEDOUT, true);
+                continue;
+            }
+
+            struct stat st;
+            timed_lstat(i, BRANCHES[i].path, &st, true);
+        }
+
+        sleep(1);
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the probe thread, called from ulakefs_init() after bpool_init()
+ */
+int health_init(void) {
+    if (!uopt.branch_timeout) RETURN(0);
+    if (!bpool_enabled()) RETURN(-ENOTSUP);
+
+    if (!uopt.branch_slow) uopt.branch_slow = uopt.branch_timeout / 2;
+
+    struct branch_health *h = calloc(BRANCHES_MAX, sizeof(struct branch_health));
+    if (!h) RETURN(-ENOMEM);
+
+    health = h;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thread;
+    int res = pthread_create(&thread, &attr, probe_thread, NULL);
+    pthread_attr_destroy(&attr);
+
+    // without probes a degraded branch would never come back
+    if (res) {
+        health = NULL;
+        free(h);
+        RETURN(-res);
+    }
+
+    RETURN(0);
+}
+
+/**
+ * May a lookup use branch i? Returns 0 if yes, 1 if the lookup shall skip
+ * the branch and -1 with errno EIO if it shall fail.
+ */
+int health_check(int i) {
+    struct branch_health *h = health ? &health[BRANCHES[i].id] : NULL;
+    if (!h || !__sync_fetch_and_add(&h->degraded, 0)) return 0;
+
+    __sync_fetch_and_add(&h->skipped, 1);
+
+    if (uopt.branch_skip) return 1;
+
+    errno = EIO;
+    return -1;
+}
+
+/**
+ * lstat() of p on branch i, given up after -o branch_timeout with
+ * ETIMEDOUT
+ */
+int health_lstat(int i, const char *p, struct stat *st) {
+    if (!health) return bpool_lstat(i, p, st, 0, NULL);
+
+    return timed_lstat(i, p, st, false);
+}
+
+void health_stats(FILE *f) {
+    if (!health) return;
+
+    pthread_mutex_lock(&health_lock);
+
+    int i;
+    for (i = 0; i < NBRANCHES; i++) {
+        struct branch_health *h = &health[BRANCHES[i].id];
+        fprintf(f, "health %s %s latency_us %llu strikes %u timeouts %lu errors %lu skipped %lu\n",
+                BRANCHES[i].path, h->degraded ? "degraded" : "ok", h->latency_us,
+                h->strikes, h->timeouts, h->errors, h->skipped);
+    }
+
+    pthread_mutex_unlock(&health_lock);
+
+    bpool_stats(f);
+}
@@ -0,0 +1,16 @@
+//
+// Latency and error based health of the branches
+//
+
+#ifndef ULAKEFS_FUSE_HEALTH_H
+#define ULAKEFS_FUSE_HEALTH_H
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+int health_init(void);
+int health_check(int i);
+int health_lstat(int i, const char *p, struct stat *st);
+void health_stats(FILE *f);
+
+#endif //ULAKEFS_FUSE_HEALTH_H
@@ -0,0 +1,336 @@
+//
+// Prebuilt metadata index of immutable branches
+//
+/*
+ * A branch given as /path=IMMUTABLE is read-only and never changes. If its
+ * root holds a manifest written by ulakefs-manifest, the manifest is mapped
+ * at mount time and lookups, getattr(), readlink() and readdir() on the
+ * branch are answered from it without a single syscall. Only open() still
+ * goes to the branch.
+ *
+ * The manifest is used if its checksum is correct and the mtime of the
+ * branch root still is the one recorded by ulakefs-manifest. Otherwise, or
+ * without a manifest, the branch is accessed like any ro-branch.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "branches.h"
+#include "manifest.h"
+
+struct manifest {
+    const struct manifest_header *hdr;
+    const struct manifest_entry *entries;
+    const char *strings;
+    size_t size;		// of the mapping
+    dev_t dev;		// of the branch root, not part of the manifest
+    unsigned long lookups;
+};
+
+static struct manifest *manifests[BRANCHES_MAX]; // per branch id
+
+/**
+ * Check the structure of a mapped manifest and set up m, 0 if it can be used
+ */
+static int manifest_check(struct manifest *m, const struct stat *root) {
+    const struct manifest_header *h = m->hdr;
+
+    if (memcmp(h->magic, MANIFEST_MAGIC, sizeof(h->magic)) != 0) return -EINVAL;
+
+    if (h->nentries > (m->size - sizeof(*h)) / sizeof(struct manifest_entry)
+        || h->strings != sizeof(*h) + h->nentries * sizeof(struct manifest_entry)
+        || h->strings_size == 0 || h->strings_size > m->size - h->strings) {
+        return -EINVAL;
+    }
+
+    m->entries = (const struct manifest_entry *)(h + 1);
+    m->strings = (const char *)h + h->strings;
+    if (m->strings[h->strings_size - 1] != '\0') return -EINVAL;
+
+    // the branch was changed after the manifest was built
+    if (h->root_mtime_sec != root->st_mtim.tv_sec || h->root_mtime_nsec != root->st_mtim.tv_nsec)
+        return -ESTALE;
+
+    const unsigned char *body = (const unsigned char *)h + sizeof(*h);
+    if (manifest_checksum(body, m->size - sizeof(*h)) != h->checksum) return -EBADMSG;
+
+    uint64_t i;
+    for (i = 0; i < h->nentries; i++) {
+        const struct manifest_entry *e = &m->entries[i];
+        if (e->path >= h->strings_size || e->link >= h->strings_size
+            || e->dirlen >= strlen(m->strings + e->path)) {
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Map the manifest of the immutable branch b, a missing or invalid manifest
+ * leaves the branch to plain syscalls
+ */
+int manifest_load(const branch_entry_t *b) {
+    if (!b->immutable || manifests[b->id]) RETURN(0);
+
+    char p[PATHLEN_MAX];
+    if (BUILD_PATH(p, b->path, MANIFEST_NAME)) RETURN(-ENAMETOOLONG);
+
+    struct stat root, st;
+    if (fstat(b->fd, &root) == -1) RETURN(-errno);
+
+    int fd = open(p, O_RDONLY);
+    if (fd == -1) {
+        int err = errno;
+        USYSLOG(LOG_INFO, "%s: no %s on immutable branch %s\n", __func__, MANIFEST_NAME, b->path);
+        RETURN(-err);
+    }
+
+    if (fstat(fd, &st) == -1) {
+        int err = errno;
+        close(fd);
+        RETURN(-err);
+    }
+    if ((size_t)st.st_size < sizeof(struct manifest_header)) {
+        close(fd);
+        RETURN(-EINVAL);
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) RETURN(-errno);
+
+    struct manifest *m = calloc(1, sizeof(struct manifest));
+    if (!m) {
+        munmap(map, st.st_size);
+        RETURN(-ENOMEM);
+    }
+    m->hdr = map;
+    m->size = st.st_size;
+    m->dev = root.st_dev;
+
+    int res = manifest_check(m, &root);
+    if (res) {
+        USYSLOG(LOG_WARNING, "%s: ignoring the manifest of %s: %s\n", __func__, b->path,
+                res == -ESTALE ? "the branch root changed" : strerror(-res));
+        munmap(map, m->size);
+        free(m);
+        RETURN(res);
+    }
+
+    manifests[b->id] = m;
+    USYSLOG(LOG_INFO, "%s: %llu entries of %s served from its manifest\n", __func__,
+            (unsigned long long)m->hdr->nentries, b->path);
+
+    RETURN(0);
+}
+
+/**
+ * Map the manifests of the immutable mount-time branches, called from
+ * ulakefs_init() once in the chroot
+ */
+int manifest_init(void) {
+    int i;
+    for (i = 0; i < NBRANCHES; i++) manifest_load(&BRANCHES[i]);
+
+    RETURN(0);
+}
+
+static struct manifest *branch_manifest(int branch) {
+    if (branch < 0 || !BRANCHES[branch].immutable) return NULL;
+    return manifests[BRANCHES[branch].id];
+}
+
+/**
+ * Is branch answered from its manifest?
+ */
+bool manifest_active(int branch) {
+    return branch_manifest(branch) != NULL;
+}
+
+/**
+ * Binary search for the first entry not below (dir, name)
+ */
+static uint64_t lower_bound(const struct manifest *m, const char *dir, size_t dirlen,
+                            const char *name) {
+    uint64_t lo = 0, hi = m->hdr->nentries;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        const struct manifest_entry *e = &m->entries[mid];
+        const char *path = m->strings + e->path;
+
+        if (manifest_cmp(path, e->dirlen, path + e->dirlen + 1, dir, dirlen, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/**
+ * Entry of path, NULL if the branch does not have it
+ */
+static const struct manifest_entry *manifest_find(struct manifest *m, const char *path) {
+    // paths are built with BUILD_PATH(), remove doubled and trailing slashes
+    char norm[PATHLEN_MAX];
+    size_t len = 0;
+    const char *s;
+    for (s = path; *s && len < PATHLEN_MAX - 1; s++) {
+        if (*s == '/' && len && norm[len - 1] == '/') continue;
+        norm[len++] = *s;
+    }
+    if (*s) return NULL;
+    if (len == 0 || norm[0] != '/') norm[len++] = '/';
+    while (len > 1 && norm[len - 1] == '/') len--;
+    norm[len] = '\0';
+
+    __sync_fetch_and_add(&m->lookups, 1);
+
+    size_t dirlen = strrchr(norm, '/') - norm;
+    const char *name = norm + dirlen + 1;
+
+    uint64_t i = lower_bound(m, norm, dirlen, name);
+    if (i == m->hdr->nentries) return NULL;
+
+    const struct manifest_entry *e = &m->entries[i];
+    if (strcmp(m->strings + e->path, norm) != 0) return NULL;
+
+    return e;
+}
+
+static void entry_stat(const struct manifest *m, const struct manifest_entry *e, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = m->dev;
+    st->st_ino = e->ino;
+    st->st_mode = e->mode;
+    st->st_nlink = e->nlink;
+    st->st_uid = e->uid;
+    st->st_gid = e->gid;
+    st->st_rdev = e->rdev;
+    st->st_size = e->size;
+    st->st_blksize = e->blksize;
+    st->st_blocks = e->blocks;
+    st->st_atim.tv_sec = e->atime_sec;
+    st->st_atim.tv_nsec = e->atime_nsec;
+    st->st_mtim.tv_sec = e->mtime_sec;
+    st->st_mtim.tv_nsec = e->mtime_nsec;
+    st->st_ctim.tv_sec = e->ctime_sec;
+    st->st_ctim.tv_nsec = e->ctime_nsec;
+}
+
+/**
+ * lstat() of path below branch from its manifest. Returns 1 if the branch
+ * has no manifest, otherwise like lstat().
+ */
+int manifest_lstat(int branch, const char *path, struct stat *st) {
+    struct manifest *m = branch_manifest(branch);
+    if (!m) return 1;
+
+    const struct manifest_entry *e = manifest_find(m, path);
+    if (!e) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    entry_stat(m, e, st);
+    return 0;
+}
+
+/**
+ * readlink() of path below branch from its manifest, returns the length
+ * of the target, -1 with errno or -2 if the branch has no manifest
+ */
+int manifest_readlink(int branch, const char *path, char *buf, size_t size) {
+    struct manifest *m = branch_manifest(branch);
+    if (!m) return -2;
+
+    const struct manifest_entry *e = manifest_find(m, path);
+    if (!e || !S_ISLNK(e->mode)) {
+        errno = e ? EINVAL : ENOENT;
+        return -1;
+    }
+
+    const char *target = m->strings + e->link;
+    size_t len = strlen(target);
+    if (len > size) len = size; // truncated as readlink() does
+    memcpy(buf, target, len);
+
+    return len;
+}
+
+/**
+ * Start listing the directory path of branch. Returns 1 if the branch has
+ * no manifest, 0 or -1 with errno like opendir().
+ */
+int manifest_opendir(int branch, const char *path, manifest_dir_t *d) {
+    struct manifest *m = branch_manifest(branch);
+    if (!m) return 1;
+
+    const struct manifest_entry *e = manifest_find(m, path);
+    if (!e || !S_ISDIR(e->mode)) {
+        errno = e ? ENOTDIR : ENOENT;
+        return -1;
+    }
+
+    // the children have the path of the directory as their dir part
+    const char *dir = m->strings + e->path;
+    size_t dirlen = strcmp(dir, "/") == 0 ? 0 : strlen(dir);
+
+    d->m = m;
+    d->pos = lower_bound(m, dir, dirlen, "");
+    d->end = d->pos;
+    while (d->end < m->hdr->nentries) {
+        const struct manifest_entry *c = &m->entries[d->end];
+        if (c->dirlen != dirlen || memcmp(m->strings + c->path, dir, dirlen) != 0) break;
+        d->end++;
+    }
+    d->dots = 2;
+
+    return 0;
+}
+
+/**
+ * Next name of a directory opened by manifest_opendir(), NULL at the end.
+ * st gets the inode number and type as readdir() returns them.
+ */
+const char *manifest_readdir(manifest_dir_t *d, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFDIR;
+
+    if (d->dots) return d->dots-- == 2 ? "." : "..";
+
+    while (d->pos < d->end) {
+        const struct manifest_entry *e = &d->m->entries[d->pos++];
+        const char *name = d->m->strings + e->path + e->dirlen + 1;
+        if (!*name) continue; // the root is its own child in the ordering
+
+        st->st_ino = e->ino;
+        st->st_mode = e->mode & S_IFMT;
+        return name;
+    }
+
+    return NULL;
+}
+
+void manifest_stats(FILE *f) {
+    int i;
+    for (i = 0; i < NBRANCHES; i++) {
+        const struct manifest *m = branch_manifest(i);
+        if (!m) continue;
+
+        fprintf(f, "manifest %s entries %llu lookups %lu\n", BRANCHES[i].path,
+                (unsigned long long)m->hdr->nentries, m->lookups);
+    }
+}
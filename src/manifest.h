@@ -0,0 +1,99 @@
+//
+// Prebuilt metadata index of immutable branches
+//
+
+#ifndef ULAKEFS_FUSE_MANIFEST_H
+#define ULAKEFS_FUSE_MANIFEST_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "Ulakefs.h"
+
+#define MANIFEST_NAME ".ulakefs.manifest"	// in the root of the branch
+#define MANIFEST_MAGIC "ULKMAN1"	// 8 bytes with the terminating \0
+
+/*
+ * File format, shared with ulakefs-manifest. The header is followed by
+ * nentries entries sorted with manifest_cmp() and the string area, which
+ * starts with a \0 so offset 0 is the empty string.
+ */
+struct manifest_header {
+    char magic[8];
+    uint64_t nentries;
+    uint64_t strings;	// file offset of the string area
+    uint64_t strings_size;
+    int64_t root_mtime_sec;	// of the branch root after the manifest was written
+    int64_t root_mtime_nsec;
+    uint64_t checksum;	// manifest_checksum() of everything after the header
+};
+
+struct manifest_entry {
+    uint64_t path;	// offset of the path below the branch, "/" for the root
+    uint64_t link;	// offset of the symlink target, 0 otherwise
+    uint32_t dirlen;	// length of the parent directory part of path
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t nlink;
+    uint64_t ino;
+    uint64_t rdev;
+    int64_t size;
+    int64_t blocks;
+    int64_t blksize;
+    int64_t atime_sec, atime_nsec;
+    int64_t mtime_sec, mtime_nsec;
+    int64_t ctime_sec, ctime_nsec;
+};
+
+/**
+ * Order of the entries: by parent directory, then by name. So the children
+ * of a directory are adjacent. For "/a/b" the directory is "/a" and the
+ * name "b", for "/a" and the root "/" the directory is "".
+ */
+static inline int manifest_cmp(const char *dir1, size_t len1, const char *name1,
+                               const char *dir2, size_t len2, const char *name2) {
+    int res = memcmp(dir1, dir2, len1 < len2 ? len1 : len2);
+    if (res) return res;
+    if (len1 != len2) return len1 < len2 ? -1 : 1;
+
+    return strcmp(name1, name2);
+}
+
+/**
+ * FNV-1a 64
+ */
+static inline uint64_t manifest_checksum(const unsigned char *data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    size_t i;
+    for (i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+#ifndef MANIFEST_TOOL
+
+// cursor of manifest_readdir()
+typedef struct {
+    const struct manifest *m;
+    uint64_t pos, end;
+    int dots;		// "." and ".." still to return
+} manifest_dir_t;
+
+int manifest_init(void);
+int manifest_load(const branch_entry_t *b);
+bool manifest_active(int branch);
+int manifest_lstat(int branch, const char *path, struct stat *st);
+int manifest_readlink(int branch, const char *path, char *buf, size_t size);
+int manifest_opendir(int branch, const char *path, manifest_dir_t *d);
+const char *manifest_readdir(manifest_dir_t *d, struct stat *st);
+void manifest_stats(FILE *f);
+
+#endif
+
+#endif //ULAKEFS_FUSE_MANIFEST_H
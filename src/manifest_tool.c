@@ -0,0 +1,215 @@
+//
+// ulakefs-manifest, writes the manifest of an immutable branch
+//
+/*
+ * Usage: ulakefs-manifest /path/to/branch
+ *
+ * Walks the branch without following symlinks and writes MANIFEST_NAME
+ * into its root, see manifest.h for the format. Run it again whenever the
+ * branch was changed, ulakefs ignores a manifest once the mtime of the
+ * branch root differs from the recorded one.
+ */
+#define _GNU_SOURCE // nftw()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#define MANIFEST_TOOL
+#include "manifest.h"
+
+struct item {
+    char *path;		// below the branch, "/" for the root
+    char *link;		// symlink target or NULL
+    size_t dirlen;
+    struct stat st;
+};
+
+static struct item *items;
+static size_t nitems, maxitems;
+static size_t rootlen;
+
+static int collect(const char *fpath, const struct stat *sb, int type, struct FTW *ftw) {
+    (void)type;
+    (void)ftw;
+
+    const char *rel = fpath + rootlen;
+    if (strcmp(rel, "/" MANIFEST_NAME) == 0 || strcmp(rel, "/" MANIFEST_NAME "~") == 0) return 0;
+
+    if (nitems == maxitems) {
+        maxitems = maxitems ? maxitems * 2 : 1024;
+        items = realloc(items, maxitems * sizeof(struct item));
+        if (!items) {
+            perror("realloc");
+            return -1;
+        }
+    }
+
+    struct item *it = &items[nitems];
+    it->path = strdup(*rel ? rel : "/");
+    if (!it->path) {
+        perror("strdup");
+        return -1;
+    }
+    it->dirlen = strrchr(it->path, '/') - it->path;
+    it->st = *sb;
+    it->link = NULL;
+
+    if (S_ISLNK(sb->st_mode)) {
+        it->link = calloc(1, sb->st_size + 1);
+        if (!it->link || readlink(fpath, it->link, sb->st_size) == -1) {
+            fprintf(stderr, "Reading the symlink %s failed: %s\n", fpath, strerror(errno));
+            return -1;
+        }
+    }
+
+    nitems++;
+    return 0;
+}
+
+static int item_cmp(const void *a, const void *b) {
+    const struct item *x = a, *y = b;
+
+    return manifest_cmp(x->path, x->dirlen, x->path + x->dirlen + 1,
+                        y->path, y->dirlen, y->path + y->dirlen + 1);
+}
+
+static void set_stat(struct manifest_entry *e, const struct stat *st) {
+    e->mode = st->st_mode;
+    e->uid = st->st_uid;
+    e->gid = st->st_gid;
+    e->nlink = st->st_nlink;
+    e->ino = st->st_ino;
+    e->rdev = st->st_rdev;
+    e->size = st->st_size;
+    e->blocks = st->st_blocks;
+    e->blksize = st->st_blksize;
+    e->atime_sec = st->st_atim.tv_sec;
+    e->atime_nsec = st->st_atim.tv_nsec;
+    e->mtime_sec = st->st_mtim.tv_sec;
+    e->mtime_nsec = st->st_mtim.tv_nsec;
+    e->ctime_sec = st->st_ctim.tv_sec;
+    e->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+/**
+ * pwrite() all of buf at offset, 0 or -1 with errno
+ */
+static int write_all(int fd, const char *buf, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t res = pwrite(fd, buf + done, size - done, offset + done);
+        if (res == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += res;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s /path/to/branch\n", argv[0]);
+        return 1;
+    }
+
+    char *root = argv[1];
+    rootlen = strlen(root);
+    while (rootlen > 1 && root[rootlen - 1] == '/') root[--rootlen] = '\0';
+    if (strcmp(root, "/") == 0) rootlen = 0;
+
+    if (nftw(root, collect, 64, FTW_PHYS) != 0) {
+        fprintf(stderr, "Walking %s failed: %s\n", root, strerror(errno));
+        return 1;
+    }
+    qsort(items, nitems, sizeof(struct item), item_cmp); // the root sorts first
+
+    // the string area starts with \0, offset 0 is the empty string
+    size_t strings_size = 1, i;
+    for (i = 0; i < nitems; i++) {
+        strings_size += strlen(items[i].path) + 1;
+        if (items[i].link) strings_size += strlen(items[i].link) + 1;
+    }
+
+    struct manifest_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic));
+    hdr.nentries = nitems;
+    hdr.strings = sizeof(hdr) + nitems * sizeof(struct manifest_entry);
+    hdr.strings_size = strings_size;
+
+    size_t size = hdr.strings + strings_size;
+    char *buf = calloc(1, size);
+    if (!buf) {
+        perror("calloc");
+        return 1;
+    }
+
+    struct manifest_entry *entries = (struct manifest_entry *)(buf + sizeof(hdr));
+    char *strings = buf + hdr.strings;
+    size_t off = 1;
+    for (i = 0; i < nitems; i++) {
+        struct manifest_entry *e = &entries[i];
+        e->path = off;
+        off += sprintf(strings + off, "%s", items[i].path) + 1;
+        if (items[i].link) {
+            e->link = off;
+            off += sprintf(strings + off, "%s", items[i].link) + 1;
+        }
+        e->dirlen = items[i].dirlen;
+        set_stat(e, &items[i].st);
+    }
+
+    char tmp[4096], path[4096];
+    snprintf(tmp, sizeof(tmp), "%s/%s~", rootlen ? root : "", MANIFEST_NAME);
+    snprintf(path, sizeof(path), "%s/%s", rootlen ? root : "", MANIFEST_NAME);
+
+    // complete on disk before it gets its name, the header without the
+    // root mtime and the checksum is rejected until it is rewritten below
+    memcpy(buf, &hdr, sizeof(hdr));
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || write_all(fd, buf, size, 0) || fsync(fd) == -1) {
+        fprintf(stderr, "Writing %s failed: %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        return 1;
+    }
+
+    if (rename(tmp, path) == -1) {
+        fprintf(stderr, "Creating %s failed: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return 1;
+    }
+
+    // creating the manifest changed the root, record it as it is now
+    struct stat st;
+    if (lstat(rootlen ? root : "/", &st) == -1) {
+        fprintf(stderr, "lstat of %s failed: %s\n", root, strerror(errno));
+        unlink(path);
+        return 1;
+    }
+    hdr.root_mtime_sec = st.st_mtim.tv_sec;
+    hdr.root_mtime_nsec = st.st_mtim.tv_nsec;
+    if (nitems && strcmp(items[0].path, "/") == 0) set_stat(&entries[0], &st);
+
+    hdr.checksum = manifest_checksum((unsigned char *)buf + sizeof(hdr), size - sizeof(hdr));
+    memcpy(buf, &hdr, sizeof(hdr));
+
+    // the root entry directly follows the header, writing the file leaves
+    // the mtime of the root alone
+    size_t head = nitems ? sizeof(hdr) + sizeof(struct manifest_entry) : sizeof(hdr);
+    if (write_all(fd, buf, head, 0) || fsync(fd) == -1 || close(fd) == -1) {
+        fprintf(stderr, "Writing %s failed: %s\n", path, strerror(errno));
+        unlink(path);
+        return 1;
+    }
+
+    printf("%s: %zu entries\n", path, nitems);
+    return 0;
+}
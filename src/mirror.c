@@ -0,0 +1,313 @@
+//
+// Read load balancing across mirrored ro-branches
+//
+/*
+ * Branches given as dirs=/a=RO@name:/b=RO@name hold identical data. The
+ * union treats them as one layer, but every read-only open of a file found
+ * on a member goes to the member with the smallest expected wait, that is
+ * (reads in progress + 1) * average read latency, ties go to the member
+ * with fewer open files.
+ *
+ * A read or open failing with EIO marks the member down for MIRROR_DOWN
+ * seconds and is retried on another member. An open file keeps the fd of
+ * the other member for all further reads, it fails over only once.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/stat.h>
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "branches.h"
+#include "directio.h"
+#include "bpool.h"
+#include "mirror.h"
+
+#define MIRROR_DOWN 30		// s a member is avoided after EIO
+#define MIRROR_EWMA_SHIFT 3	// new latency samples weigh 1/8
+
+struct mirror_member {
+    unsigned int inflight;	// reads in progress
+    unsigned int opens;		// open files
+    unsigned long long latency_us; // moving average of reads
+    time_t down_until;		// CLOCK_MONOTONIC seconds
+    unsigned long reads, errors;
+};
+
+static char **group_names;	// index is the group id - 1
+static int ngroups;
+static struct mirror_member *members; // per branch id, NULL without groups
+
+static time_t now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static unsigned long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Id of the mirror group called name, used while parsing the branches
+ */
+int mirror_group(const char *name) {
+    int i;
+    for (i = 0; i < ngroups; i++) {
+        if (strcmp(group_names[i], name) == 0) return i + 1;
+    }
+
+    char **names = realloc(group_names, (ngroups + 1) * sizeof(char *));
+    if (!names) {
+        fprintf(stderr, "%s: realloc failed\n", __func__);
+        exit(1); // still at early stage, we can abort
+    }
+    group_names = names;
+    group_names[ngroups++] = strdup(name);
+
+    return ngroups;
+}
+
+/**
+ * Allocate the member statistics, called from ulakefs_init()
+ */
+int mirror_init(void) {
+    if (!ngroups) RETURN(0);
+
+    members = calloc(BRANCHES_MAX, sizeof(struct mirror_member));
+    if (!members) RETURN(-ENOMEM);
+
+    RETURN(0);
+}
+
+static bool member_down(int i, time_t now) {
+    return __sync_fetch_and_add(&members[BRANCHES[i].id].down_until, 0) > now;
+}
+
+static void member_failed(int i) {
+    struct mirror_member *m = &members[BRANCHES[i].id];
+    __sync_fetch_and_add(&m->errors, 1);
+    __sync_lock_test_and_set(&m->down_until, now_sec() + MIRROR_DOWN);
+
+    USYSLOG(LOG_WARNING, "mirror %s: I/O error, avoiding it for %d s\n",
+            BRANCHES[i].path, MIRROR_DOWN);
+}
+
+/**
+ * Is member a better choice than best?
+ */
+static bool member_better(int i, int best) {
+    struct mirror_member *m = &members[BRANCHES[i].id], *b = &members[BRANCHES[best].id];
+
+    unsigned long long wi = (m->inflight + 1ULL) * (m->latency_us + 1);
+    unsigned long long wb = (b->inflight + 1ULL) * (b->latency_us + 1);
+
+    if (wi != wb) return wi < wb;
+    return m->opens < b->opens;
+}
+
+/**
+ * Best member of the group of branch that has path, except branch skip.
+ * st is set to its lstat() of path, if given. Returns -1 if there is none.
+ */
+static int member_pick(const char *path, int branch, int skip, struct stat *st) {
+    int group = BRANCHES[branch].mirror;
+    time_t now = now_sec();
+
+    int cand[NBRANCHES];
+    int ncand = 0;
+
+    // members which are down only if there is no other
+    int pass;
+    for (pass = 0; pass < 2 && !ncand; pass++) {
+        int i;
+        for (i = 0; i < NBRANCHES; i++) {
+            if (BRANCHES[i].mirror != group || i == skip) continue;
+            if (pass == 0 && member_down(i, now)) continue;
+            cand[ncand++] = i;
+        }
+    }
+
+    while (ncand) {
+        int best = 0, k;
+        for (k = 1; k < ncand; k++) {
+            if (member_better(cand[k], cand[best])) best = k;
+        }
+
+        int i = cand[best];
+        char p[PATHLEN_MAX];
+        struct stat stbuf;
+        if (!BUILD_PATH(p, BRANCHES[i].path, path) && lstat(p, &stbuf) == 0) {
+            if (st) *st = stbuf;
+            return i;
+        }
+
+        // the mirror is incomplete or not reachable
+        cand[best] = cand[--ncand];
+    }
+
+    return -1;
+}
+
+/**
+ * Pick the member of the mirror group of branch for a read-only open of path.
+ * st is updated to the lstat() of the picked member, if given.
+ */
+int mirror_pick(const char *path, int branch, struct stat *st) {
+    if (!members || !BRANCHES[branch].mirror) return branch;
+
+    int i = member_pick(path, branch, -1, st);
+    if (i < 0) return branch;
+
+    DBG("%s: mirror %d instead of %d\n", path, i, branch);
+
+    return i;
+}
+
+/**
+ * open() path on uf->branch, on EIO on another member of its group
+ */
+int mirror_open(const char *path, int flags, ufile_t *uf) {
+    int tries = NBRANCHES;
+
+    while (1) {
+        char p[PATHLEN_MAX];
+        if (BUILD_PATH(p, BRANCHES[uf->branch].path, path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        uf->fd = bpool_open(uf->branch, p, flags);
+        if (uf->fd != -1) break;
+        if (errno != EIO || !members || !BRANCHES[uf->branch].mirror) return -1;
+
+        member_failed(uf->branch);
+
+        int i = member_pick(path, uf->branch, uf->branch, NULL);
+        if (i < 0 || --tries == 0) {
+            errno = EIO;
+            return -1;
+        }
+        uf->branch = i;
+    }
+
+    return 0;
+}
+
+/**
+ * Count an open file of a member, called for every successful open
+ */
+void mirror_opened(ufile_t *uf) {
+    if (!mirror_file(uf)) return;
+
+    __sync_fetch_and_add(&members[BRANCHES[uf->branch].id].opens, 1);
+}
+
+/**
+ * Is uf a file on a member of a mirror group?
+ */
+bool mirror_file(const ufile_t *uf) {
+    return members && uf->branch >= 0 && BRANCHES[uf->branch].mirror;
+}
+
+/**
+ * pread() with latency accounting, EIO fails over to another member
+ */
+ssize_t mirror_pread(const char *path, ufile_t *uf, char *buf, size_t size, off_t offset) {
+    if (!mirror_file(uf)) {
+        if (uf->odirect) return directio_pread(uf, buf, size, offset);
+        return bpool_pread(uf->branch, uf->fd, buf, size, offset);
+    }
+
+    while (1) {
+        // -2 while another reader is failing over
+        int fd;
+        while ((fd = __sync_fetch_and_add(&uf->mirror_fd, 0)) == -2) sched_yield();
+        int branch = fd == -1 ? uf->branch : uf->mirror_branch;
+        struct mirror_member *m = &members[BRANCHES[branch].id];
+
+        __sync_fetch_and_add(&m->inflight, 1);
+        unsigned long long start = now_us();
+
+        ssize_t res;
+        if (fd == -1 && uf->odirect)
+            res = directio_pread(uf, buf, size, offset);
+        else
+            res = bpool_pread(branch, fd == -1 ? uf->fd : fd, buf, size, offset);
+        int err = errno;
+
+        unsigned long long lat = now_us() - start;
+        __sync_fetch_and_sub(&m->inflight, 1);
+        __sync_fetch_and_add(&m->reads, 1);
+
+        // racy update of the average, a lost sample does not matter
+        m->latency_us += ((long long)lat - (long long)m->latency_us) >> MIRROR_EWMA_SHIFT;
+
+        if (res != -1 || err != EIO || !path) {
+            errno = err;
+            return res;
+        }
+
+        member_failed(branch);
+        if (fd != -1) {
+            // the second member failed too
+            errno = EIO;
+            return -1;
+        }
+
+        int i = member_pick(path, branch, branch, NULL);
+        char p[PATHLEN_MAX];
+        if (i < 0 || BUILD_PATH(p, BRANCHES[i].path, path)) {
+            errno = EIO;
+            return -1;
+        }
+
+        int newfd = open(p, O_RDONLY);
+        if (newfd == -1) {
+            errno = EIO;
+            return -1;
+        }
+
+        // parallel readers of this file might fail over at the same time,
+        // the first one wins. uf->fd stays open until release.
+        if (__sync_bool_compare_and_swap(&uf->mirror_fd, -1, -2)) {
+            uf->mirror_branch = i;
+            __sync_synchronize();
+            __sync_lock_test_and_set(&uf->mirror_fd, newfd);
+        } else {
+            close(newfd);
+        }
+    }
+}
+
+void mirror_release(ufile_t *uf) {
+    if (!mirror_file(uf)) return;
+
+    __sync_fetch_and_sub(&members[BRANCHES[uf->branch].id].opens, 1);
+    if (uf->mirror_fd >= 0) close(uf->mirror_fd);
+}
+
+void mirror_stats(FILE *f) {
+    if (!members) return;
+
+    int i;
+    for (i = 0; i < NBRANCHES; i++) {
+        struct mirror_member *m = &members[BRANCHES[i].id];
+        if (!BRANCHES[i].mirror) continue;
+
+        fprintf(f, "mirror %s %s inflight %u opens %u latency_us %llu reads %lu errors %lu%s\n",
+                group_names[BRANCHES[i].mirror - 1], BRANCHES[i].path,
+                m->inflight, m->opens, m->latency_us, m->reads, m->errors,
+                member_down(i, now_sec()) ? " down" : "");
+    }
+}
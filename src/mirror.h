@@ -0,0 +1,24 @@
+//
+// Read load balancing across mirrored ro-branches
+//
+
+#ifndef ULAKEFS_FUSE_MIRROR_H
+#define ULAKEFS_FUSE_MIRROR_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "Ulakefs.h"
+
+int mirror_group(const char *name);
+int mirror_init(void);
+int mirror_pick(const char *path, int branch, struct stat *st);
+int mirror_open(const char *path, int flags, ufile_t *uf);
+ssize_t mirror_pread(const char *path, ufile_t *uf, char *buf, size_t size, off_t offset);
+bool mirror_file(const ufile_t *uf);
+void mirror_opened(ufile_t *uf);
+void mirror_release(ufile_t *uf);
+void mirror_stats(FILE *f);
+
+#endif //ULAKEFS_FUSE_MIRROR_H
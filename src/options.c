@@ -16,6 +16,13 @@
 #include "Ulakefs.h"
 #include "options.h"
 #include "debug.h"
+#include "copyup.h"
+#include "directio.h"
+#include "policy.h"
+#include "mirror.h"
+#include "stripe.h"
+#include "closer.h"
+#include "syncgroup.h"
 #include "authen.h"
 #include <openssl/md5.h>
 #include <uuid/uuid.h>
@@ -137,6 +144,14 @@ uoptions_t uopt;
 void uopt_init() {
     memset(&uopt, 0, sizeof(uopt)); // initialize options with zeros first
 
+    uopt.copyup_ioprio = 7; // lowest best-effort priority
+    uopt.copy_chunk_size = 64 * 1024 * 1024;
+    uopt.session_max_idle = 10; // as fuse_loop_mt()
+    uopt.readahead_max = 16 * 1024 * 1024;
+    uopt.tier_branch = -1;
+    uopt.tier_hits = 4;
+    uopt.stripe_chunk = 1024 * 1024;
+
     pthread_rwlock_init(&uopt.dbgpath_lock, NULL);
 }
 
@@ -221,17 +236,32 @@ void add_branch(char *branch) {
     // make_absolute() and add_trailing_slash() will corrupt our input (parse string)
     uopt.branches[uopt.nbranches].path = strdup(res);
     uopt.branches[uopt.nbranches].rw = 0;
+    uopt.branches[uopt.nbranches].immutable = 0;
+
+    uopt.branches[uopt.nbranches].mirror = 0;
 
     res = strsep(ptr, "=");
     if (res) {
+        // RO@group makes the branch a member of a mirror group
+        char *group = res;
+        res = strsep(&group, "@");
+
         if (strcasecmp(res, "rw") == 0) {
             uopt.branches[uopt.nbranches].rw = 1;
         } else if (strcasecmp(res, "ro") == 0) {
             // no action needed here
+        } else if (strcasecmp(res, "immutable") == 0) {
+            uopt.branches[uopt.nbranches].immutable = 1;
         } else {
             fprintf(stderr, "Failed to parse RO/RW flag, setting RO.\n");
             // no action needed here either
         }
+
+        if (group && uopt.branches[uopt.nbranches].rw) {
+            fprintf(stderr, "Only RO branches can be mirrors, ignoring @%s.\n", group);
+        } else if (group && *group) {
+            uopt.branches[uopt.nbranches].mirror = mirror_group(group);
+        }
     }
 
     uopt.nbranches++;
@@ -300,6 +330,40 @@ static char * get_opt_str(const char *arg, char *opt_name)
     return str;
 }
 
+/**
+ * Parse a numeric option, e.g. "copyup_bwlimit=20M"
+ * The number may have a K, M or G suffix (binary units).
+ */
+static unsigned long long get_opt_num(const char *arg, char *opt_name)
+{
+    char *str = index(arg, '=');
+
+    if (!str || *(str + 1) == '\0') {
+        fprintf(stderr, "-o %s parameter not properly specified, aborting!\n",
+                opt_name);
+        exit(1); // still early phase, we can abort
+    }
+    str++; // just jump over the '='
+
+    char *end;
+    errno = 0;
+    unsigned long long val = strtoull(str, &end, 10);
+
+    switch (*end) {
+        case 'k': case 'K': val <<= 10; end++; break;
+        case 'm': case 'M': val <<= 20; end++; break;
+        case 'g': case 'G': val <<= 30; end++; break;
+    }
+
+    if (errno || end == str || *end != '\0') {
+        fprintf(stderr, "%s: Converting %s to number failed, aborting!\n",
+                opt_name, str);
+        exit(1);
+    }
+
+    return val;
+}
+
 static void print_help(const char *progname) {
     printf(
             "Usage: %s [options] branch[=RO/RW][:branch...] mountpoint\n"
@@ -313,20 +377,106 @@ static void print_help(const char *progname) {
                "    -V   --version         print version\n"
                "\n"
                "UlakeFuse options:\n"
+               "    -o async_close[=number]\n"
+               "                           close files on background threads,\n"
+               "                           queue up to number fds (1024)\n"
+               "    -o branch_degraded=eio|skip\n"
+               "                           lookups on a degraded branch fail with\n"
+               "                           EIO or skip the branch (eio)\n"
+               "    -o branch_queue=number calls queued per branch before further\n"
+               "                           callers wait (64)\n"
+               "    -o branch_slow=ms      lookups slower than this count against\n"
+               "                           a branch (branch_timeout / 2)\n"
+               "    -o branch_threads=number\n"
+               "                           run lstat, open, pread and copies of\n"
+               "                           each branch on its own worker threads\n"
+               "    -o branch_timeout=ms   give up branch lookups after this time\n"
+               "                           and track the health of the branches\n"
+               "    -o cache_watch         drop the page cache of ro-branch files\n"
+               "                           modified out-of-band (inotify)\n"
                "    -o chroot=path         chroot into this path. Use this if you \n"
                "                           want to have a union of \"/\" \n"
+               "    -o clone_fd            read requests with a /dev/fuse fd per\n"
+               "                           worker thread\n"
+               "    -o copy_chunk_size=bytes\n"
+               "                           chunk size of multi-threaded copies (64M)\n"
+               "    -o copy_threads=number\n"
+               "                           copy files of at least two chunks with\n"
+               "                           this many threads\n"
+               "    -o copyup_bwlimit=bytes\n"
+               "                           bandwidth cap for background copy-ups,\n"
+               "                           K, M and G suffixes are accepted\n"
+               "    -o copyup_ioprio=idle|0-7\n"
+               "                           I/O priority of the copy-up threads,\n"
+               "                           idle class or best-effort level (7)\n"
+               "    -o copyup_threads=number\n"
+               "                           copy files up on background threads\n"
                "    -o cow                 enable copy-on-write\n"
+               "    -o create_policy=ff|ep|mfs|lus|rr\n"
+               "                           rw-branch of new files: first found,\n"
+               "                           existing path, most free space, least\n"
+               "                           bytes written or round-robin (ff)\n"
+               "    -o create_policy_path=path=policy[:path=policy...]\n"
+               "                           create policy below these paths\n"
                "                           mountpoint\n"
                "    -o debug_file          file to write debug information into\n"
+               "    -o direct_io_auto      bypass the page cache for all files\n"
+               "                           except executables\n"
+               "    -o direct_io_odirect   also open read-only direct_io files\n"
+               "                           with O_DIRECT on the branch\n"
+               "    -o direct_io_prefix=path[:path...]\n"
+               "                           bypass the page cache only below these\n"
+               "                           paths, executables excluded\n"
+               "    -o dirmap              remember the branches of each directory,\n"
+               "                           lookups only probe those\n"
                "    -o dirs=branch[=RO/RW][:branch...]\n"
                "                           alternate way to specify directories to merge\n"
+               "                           RO@name makes ro-branches with the same\n"
+               "                           name mirrors of each other\n"
+               "                           IMMUTABLE is a ro-branch that never changes,\n"
+               "                           served from its ulakefs-manifest index\n"
+               "    -o fd_cache            keep the fds of read-only opens of\n"
+               "                           ro-branch files for reuse\n"
+               "    -o fsync_group[=usecs]\n"
+               "                           batch concurrent fsyncs of a branch\n"
+               "                           within this window into one syncfs\n"
+               "                           (2000)\n"
                "    -o hide_meta_files     \".ulakefs\" is a secret directory not\n"
                "                           visible by readdir(), and so are\n"
                "                           .fuse_hidden* files\n"
                "    -o max_files=number    Increase the maximum number of open files\n"
+               "    -o max_idle_threads=number\n"
+               "                           idle worker threads to keep (10)\n"
+               "    -o no_ro_cache         drop the page cache of ro-branch files\n"
+               "                           on every open\n"
+               "    -o pin_threads         pin worker threads to CPUs\n"
+               "    -o readahead           detect sequential and random reads and\n"
+               "                           give the branch readahead hints\n"
+               "    -o readahead_max=bytes largest readahead window (16M)\n"
                "    -o relaxed_permissions Disable permissions checks, but only if\n"
                "                           running neither as UID=0 or GID=0\n"
+               "    -o rw_auto_cache       keep the page cache of rw-branch files\n"
+               "                           if mtime and size did not change\n"
+               "    -o statfs_interval=secs\n"
+               "                           answer statfs from a snapshot that is\n"
+               "                           refreshed in this interval\n"
                "    -o statfs_omit_ro      do not count blocks of ro-branches\n"
+               "    -o statfs_timeout=secs leave out branches whose statfs did not\n"
+               "                           answer for this long (3 intervals)\n"
+               "    -o stripe_chunk=bytes  chunk size of striped files (1M)\n"
+               "    -o stripe_prefix=/a:/b stripe files below these paths across\n"
+               "                           all rw-branches once they grow past\n"
+               "                           one chunk\n"
+               "    -o threads=number      maximum number of worker threads\n"
+               "    -o tier_branch=number  promote hot files of ro-branches to this\n"
+               "                           rw-branch (0 is the first branch),\n"
+               "                           requires copyup_threads\n"
+               "    -o tier_hits=number    opens within 5 minutes that make a file\n"
+               "                           hot (4)\n"
+               "    -o tier_size=bytes     space for promoted files, K, M and G\n"
+               "                           suffixes are accepted (free space)\n"
+               "    -o whiteout_store      keep the whiteouts of a directory in one\n"
+               "                           record file instead of a marker per name\n"
                "\n",
                progname);
 }
@@ -395,16 +545,142 @@ int ulakefs_opt_proc(void *data, const char *arg, int key, struct fuse_args *out
             if (res > 0) return 0;
             uopt.retval = 1;
             return 1;
+        case KEY_ASYNC_CLOSE:
+            if (index(arg, '=')) {
+                uopt.async_close = get_opt_num(arg, "async_close");
+                if (uopt.async_close == 0) {
+                    fprintf(stderr, "async_close queue must not be empty, aborting!\n");
+                    exit(1);
+                }
+            } else {
+                uopt.async_close = CLOSER_QUEUE;
+            }
+            return 0;
+        case KEY_BRANCH_DEGRADED:
+        {
+            char *mode = get_opt_str(arg, "branch_degraded");
+            if (strcmp(mode, "skip") == 0) {
+                uopt.branch_skip = true;
+            } else if (strcmp(mode, "eio") == 0) {
+                uopt.branch_skip = false;
+            } else {
+                fprintf(stderr, "Unknown branch_degraded mode %s, aborting!\n", mode);
+                exit(1);
+            }
+            free(mode);
+            return 0;
+        }
+        case KEY_BRANCH_QUEUE:
+            uopt.branch_queue = get_opt_num(arg, "branch_queue");
+            return 0;
+        case KEY_BRANCH_SLOW:
+            uopt.branch_slow = get_opt_num(arg, "branch_slow");
+            return 0;
+        case KEY_BRANCH_THREADS:
+            uopt.branch_threads = get_opt_num(arg, "branch_threads");
+            return 0;
+        case KEY_BRANCH_TIMEOUT:
+            uopt.branch_timeout = get_opt_num(arg, "branch_timeout");
+            return 0;
+        case KEY_CACHE_WATCH:
+            uopt.cache_watch = true;
+            return 0;
         case KEY_CHROOT:
             uopt.chroot = get_opt_str(arg, "chroot");
             return 0;
+        case KEY_CLONE_FD:
+            uopt.clone_fd = true;
+            uopt.session_loop = true;
+            return 0;
+        case KEY_COPY_CHUNK_SIZE:
+            uopt.copy_chunk_size = get_opt_num(arg, "copy_chunk_size");
+            if (uopt.copy_chunk_size < 4096) {
+                fprintf(stderr, "copy_chunk_size must be at least 4K, aborting!\n");
+                exit(1);
+            }
+            return 0;
+        case KEY_COPY_THREADS:
+            uopt.copy_threads = get_opt_num(arg, "copy_threads");
+            if (uopt.copy_threads > 64) {
+                fprintf(stderr, "copy_threads must not exceed 64, aborting!\n");
+                exit(1);
+            }
+            return 0;
+        case KEY_COPYUP_BWLIMIT:
+            uopt.copyup_bwlimit = get_opt_num(arg, "copyup_bwlimit");
+            return 0;
+        case KEY_COPYUP_IOPRIO:
+            if (strcasecmp(arg, "copyup_ioprio=idle") == 0) {
+                uopt.copyup_ioprio = COPYUP_IOPRIO_IDLE;
+            } else {
+                unsigned long long level = get_opt_num(arg, "copyup_ioprio");
+                if (level > 7) {
+                    fprintf(stderr, "copyup_ioprio must be idle or 0-7, aborting!\n");
+                    exit(1);
+                }
+                uopt.copyup_ioprio = level;
+            }
+            return 0;
+        case KEY_COPYUP_THREADS:
+            uopt.copyup_threads = get_opt_num(arg, "copyup_threads");
+            return 0;
         case KEY_COW:
             uopt.cow_enabled = true;
             return 0;
+        case KEY_CREATE_POLICY:
+        {
+            char *name = get_opt_str(arg, "create_policy");
+            uopt.create_policy = policy_parse(name);
+            if (uopt.create_policy < 0) {
+                fprintf(stderr, "Unknown create policy %s, aborting!\n", name);
+                exit(1);
+            }
+            free(name);
+            return 0;
+        }
+        case KEY_CREATE_POLICY_PATH:
+        {
+            char *paths = get_opt_str(arg, "create_policy_path");
+            if (policy_add_paths(paths)) {
+                fprintf(stderr, "Parsing create_policy_path failed, aborting!\n");
+                exit(1);
+            }
+            free(paths);
+            return 0;
+        }
         case KEY_DEBUG_FILE:
             uopt.dbgpath = get_opt_str(arg, "debug_file");
             uopt.debug = true;
             return 0;
+        case KEY_DIRECT_IO_AUTO:
+            uopt.direct_io_auto = true;
+            return 0;
+        case KEY_DIRECT_IO_ODIRECT:
+            uopt.direct_io_odirect = true;
+            return 0;
+        case KEY_DIRECT_IO_PREFIX:
+        {
+            char *prefixes = get_opt_str(arg, "direct_io_prefix");
+            if (directio_add_prefixes(prefixes)) {
+                fprintf(stderr, "Parsing direct_io_prefix failed, aborting!\n");
+                exit(1);
+            }
+            free(prefixes);
+            return 0;
+        }
+        case KEY_DIRMAP:
+            uopt.dirmap = true;
+            return 0;
+        case KEY_FD_CACHE:
+            uopt.fd_cache = true;
+            return 0;
+        case KEY_FSYNC_GROUP:
+            if (index(arg, '=')) {
+                uopt.fsync_group = get_opt_num(arg, "fsync_group");
+            } else {
+                uopt.fsync_group = SYNCGROUP_WINDOW;
+            }
+            return 0;
         case KEY_HELP:
             print_help(outargs->argv[0]);
             fuse_opt_add_arg(outargs, "-ho");
@@ -417,14 +693,79 @@ int ulakefs_opt_proc(void *data, const char *arg, int key, struct fuse_args *out
         case KEY_MAX_FILES:
             set_max_open_files(arg);
             return 0;
+        case KEY_MAX_IDLE_THREADS:
+            uopt.session_max_idle = get_opt_num(arg, "max_idle_threads");
+            uopt.session_loop = true;
+            return 0;
+        case KEY_NO_RO_CACHE:
+            uopt.no_ro_cache = true;
+            return 0;
         case KEY_NOINITGROUPS:
             return 0;
+        case KEY_PIN_THREADS:
+            uopt.pin_threads = true;
+            uopt.session_loop = true;
+            return 0;
+        case KEY_READAHEAD:
+            uopt.readahead = true;
+            return 0;
+        case KEY_READAHEAD_MAX:
+            uopt.readahead_max = get_opt_num(arg, "readahead_max");
+            if (uopt.readahead_max < 128 * 1024) {
+                fprintf(stderr, "readahead_max must be at least 128K, aborting!\n");
+                exit(1);
+            }
+            uopt.readahead = true;
+            return 0;
+        case KEY_STATFS_INTERVAL:
+            uopt.statfs_interval = get_opt_num(arg, "statfs_interval");
+            return 0;
+        case KEY_STATFS_TIMEOUT:
+            uopt.statfs_timeout = get_opt_num(arg, "statfs_timeout");
+            return 0;
+        case KEY_STRIPE_CHUNK:
+            uopt.stripe_chunk = get_opt_num(arg, "stripe_chunk");
+            if (uopt.stripe_chunk < 4096) {
+                fprintf(stderr, "stripe_chunk must be at least 4096, aborting!\n");
+                exit(1);
+            }
+            return 0;
+        case KEY_STRIPE_PREFIX:
+        {
+            char *prefixes = get_opt_str(arg, "stripe_prefix");
+            if (stripe_add_prefixes(prefixes)) {
+                fprintf(stderr, "Parsing stripe_prefix failed, aborting!\n");
+                exit(1);
+            }
+            free(prefixes);
+            return 0;
+        }
         case KEY_STATFS_OMIT_RO:
             uopt.statfs_omit_ro = true;
             return 0;
         case KEY_RELAXED_PERMISSIONS:
             uopt.relaxed_permissions = true;
             return 0;
+        case KEY_RW_AUTO_CACHE:
+            uopt.rw_auto_cache = true;
+            return 0;
+        case KEY_THREADS:
+            uopt.session_threads = get_opt_num(arg, "threads");
+            uopt.session_loop = true;
+            return 0;
+        case KEY_TIER_BRANCH:
+            uopt.tier_branch = get_opt_num(arg, "tier_branch");
+            return 0;
+        case KEY_TIER_HITS:
+            uopt.tier_hits = get_opt_num(arg, "tier_hits");
+            if (!uopt.tier_hits) uopt.tier_hits = 1;
+            return 0;
+        case KEY_TIER_SIZE:
+            uopt.tier_size = get_opt_num(arg, "tier_size");
+            return 0;
+        case KEY_WHITEOUT_STORE:
+            uopt.whiteout_store = true;
+            return 0;
         case KEY_VERSION:
             printf("ulake-fuse version: "VERSION"\n");
             uopt.doexit = 1;
@@ -24,21 +24,99 @@ typedef struct {
     pthread_rwlock_t dbgpath_lock; // locks dbgpath
     bool hide_meta_files;
     bool relaxed_permissions;
+    mode_t umask;		// umask at startup, applied to copied modes
+    int create_policy;	// placement of new files, see policy.h
+
+    int copyup_threads;	// copy-up scheduler threads, 0 copies inline
+    int copyup_ioprio;	// best-effort level or COPYUP_IOPRIO_IDLE
+    unsigned long long copyup_bwlimit; // bytes/s for background copies, 0 = unlimited
+    int copy_threads;	// threads per large file copy, <= 1 copies sequentially
+    off_t copy_chunk_size;	// bytes per chunk of a multi-threaded copy
+
+    bool no_ro_cache;	// do not keep the page cache of ro-branch files
+    bool rw_auto_cache;	// keep the page cache of unchanged rw-branch files
+    bool cache_watch;	// inotify to catch out-of-band changes of ro-branches
+    bool fd_cache;		// share and keep fds of ro-branch files
+    bool dirmap;		// cache the branches of each directory for lookups
+    bool whiteout_store;	// whiteouts as per-directory record files, see wostore.c
+    unsigned int async_close;	// queue length of the closer threads, 0 = off
+    unsigned int fsync_group;	// group commit window of fsync() in us, 0 = off
+    bool readahead;		// access pattern detection and fadvise() hints
+    size_t readahead_max;	// largest readahead window
+    unsigned int statfs_interval;	// refresh of the statfs snapshot in s, 0 = live
+    unsigned int statfs_timeout;	// branches older than this are stale
+    unsigned int branch_timeout;	// ms until a branch lookup is given up, 0 = off
+    unsigned int branch_slow;	// ms above which a lookup counts against a branch
+    bool branch_skip;	// lookups skip degraded branches instead of EIO
+    int branch_threads;	// workers per branch, 0 = calls run on the fuse thread
+    unsigned int branch_queue;	// calls queued per branch before callers wait
+    off_t stripe_chunk;	// bytes per chunk of a striped file
+
+    int tier_branch;	// fast branch for hot ro-branch files, -1 = off
+    unsigned int tier_hits;	// reading opens that make a file hot
+    unsigned long long tier_size;	// bytes of promoted copies, 0 = free space only
+
+    bool direct_io_auto;	// direct_io for all non-executable files
+    char **direct_io_prefixes;	// direct_io only below these paths
+    int direct_io_nprefixes;
+    bool direct_io_odirect;	// also O_DIRECT for read-only opens
+
+    bool session_loop;	// run our own session loop instead of fuse_main()
+    int session_threads;	// maximum number of workers, 0 = unlimited
+    int session_max_idle;	// idle workers beyond this number exit
+    bool clone_fd;		// a /dev/fuse fd per worker
+    bool pin_threads;	// pin workers to CPUs
 
 } uoptions_t;
 
 enum {
+    KEY_ASYNC_CLOSE,
+    KEY_BRANCH_DEGRADED,
+    KEY_BRANCH_QUEUE,
+    KEY_BRANCH_SLOW,
+    KEY_BRANCH_THREADS,
+    KEY_BRANCH_TIMEOUT,
+    KEY_CACHE_WATCH,
     KEY_CHROOT,
+    KEY_CLONE_FD,
+    KEY_COPY_CHUNK_SIZE,
+    KEY_COPY_THREADS,
+    KEY_COPYUP_BWLIMIT,
+    KEY_COPYUP_IOPRIO,
+    KEY_COPYUP_THREADS,
     KEY_COW,
+    KEY_CREATE_POLICY,
+    KEY_CREATE_POLICY_PATH,
     KEY_DEBUG_FILE,
+    KEY_DIRECT_IO_AUTO,
+    KEY_DIRECT_IO_ODIRECT,
+    KEY_DIRECT_IO_PREFIX,
+    KEY_DIRMAP,
     KEY_DIRS,
+    KEY_FD_CACHE,
+    KEY_FSYNC_GROUP,
     KEY_HELP,
     KEY_HIDE_META_FILES,
     KEY_HIDE_METADIR,
     KEY_MAX_FILES,
+    KEY_MAX_IDLE_THREADS,
+    KEY_NO_RO_CACHE,
     KEY_NOINITGROUPS,
+    KEY_PIN_THREADS,
+    KEY_READAHEAD,
+    KEY_READAHEAD_MAX,
     KEY_RELAXED_PERMISSIONS,
+    KEY_RW_AUTO_CACHE,
+    KEY_STATFS_INTERVAL,
     KEY_STATFS_OMIT_RO,
+    KEY_STATFS_TIMEOUT,
+    KEY_STRIPE_CHUNK,
+    KEY_STRIPE_PREFIX,
+    KEY_THREADS,
+    KEY_TIER_BRANCH,
+    KEY_TIER_HITS,
+    KEY_TIER_SIZE,
+    KEY_WHITEOUT_STORE,
     KEY_VERSION
 };
 
@@ -0,0 +1,331 @@
+//
+// Kernel page cache policy for opened files
+//
+/*
+ * Without fi->keep_cache the kernel drops the cached pages of a file on
+ * every open. Files on read-only branches cannot change through ulakefs,
+ * so their cache is kept (unless -o no_ro_cache). With -o cache_watch the
+ * parent directories of such files are watched with inotify and a file
+ * modified out-of-band loses its cache on the next open.
+ *
+ * Files on writable branches keep their cache with -o rw_auto_cache,
+ * as long as mtime and size are unchanged since we last saw the file,
+ * similar to the auto_cache option of libfuse.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "branches.h"
+#include "general.h"
+#include "hashtable.h"
+#include "pagecache.h"
+
+// upper bound for the rw_auto_cache table, it is simply cleared when full
+#define PAGECACHE_MAX_ENTRIES 65536
+
+// what we know about a file on a writable branch
+struct rw_entry {
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hashtable *rw_files;	// path -> struct rw_entry
+
+// a watched directory
+struct watch {
+    char *dir;		// union path
+    char *bdir;		// path on the branch, key of watched
+};
+
+// cache_watch state, protected by cache_lock
+static int inotify_fd = -1;
+static struct hashtable *watched;	// branch directory, keys only
+static struct watch *watches;		// indexed by watch descriptor
+static int nwatches;
+static struct hashtable *stale;		// union path -> stale marker
+
+static unsigned long st_ro_kept, st_rw_kept, st_rw_dropped, st_stale;
+
+#ifdef __linux__
+#define WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE \
+                    | IN_MOVED_FROM | IN_MOVED_TO)
+
+/**
+ * Mark files changed out-of-band, so the next open drops their cache
+ */
+static void *inotify_thread(void *arg) {
+    (void)arg;
+
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t len = read(inotify_fd, buf, sizeof(buf));
+        if (len == -1) {
+            if (errno == EINTR) continue;
+            USYSLOG(LOG_ERR, "%s: reading inotify events failed: %s\n",
+                    __func__, strerror(errno));
+            break;
+        }
+
+        pthread_mutex_lock(&cache_lock);
+
+        char *ptr;
+        for (ptr = buf; ptr < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->wd < 0 || ev->wd >= nwatches || !watches[ev->wd].dir) continue;
+            struct watch *w = &watches[ev->wd];
+
+            if (ev->mask & IN_IGNORED) {
+                // directory removed, the next open adds a new watch
+                hashtable_remove(watched, w->bdir); // frees bdir
+                free(w->dir);
+                w->dir = w->bdir = NULL;
+                continue;
+            }
+            if (!ev->len) continue;
+
+            char p[PATHLEN_MAX];
+            if (BUILD_PATH(p, w->dir, "/", ev->name)) continue;
+
+            if (!hashtable_search(stale, p)) {
+                char *key = strdup(p);
+                if (key) hashtable_insert(stale, key, key);
+            }
+        }
+
+        pthread_mutex_unlock(&cache_lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * Make sure the parent directory of path on branch is watched,
+ * cache_lock MUST be held.
+ * Returns 1 if the watch was just added, 0 if it existed and -1 on error.
+ */
+static int watch_parent(const char *path, int branch) {
+    char *dname = u_dirname(path);
+    if (!dname) return -1;
+
+    char p[PATHLEN_MAX];
+    if (BUILD_PATH(p, BRANCHES[branch].path, dname)) {
+        free(dname);
+        return -1;
+    }
+
+    if (hashtable_search(watched, p)) {
+        free(dname);
+        return 0;
+    }
+
+    int wd = inotify_add_watch(inotify_fd, p, WATCH_MASK | IN_ONLYDIR);
+    if (wd == -1) {
+        if (errno == ENOSPC)
+            USYSLOG(LOG_WARNING, "%s: out of inotify watches, raise "
+                                 "fs.inotify.max_user_watches\n", __func__);
+        free(dname);
+        return -1;
+    }
+
+    if (wd >= nwatches) {
+        int n = wd + 64;
+        struct watch *w = realloc(watches, n * sizeof(struct watch));
+        if (!w) {
+            inotify_rm_watch(inotify_fd, wd);
+            free(dname);
+            return -1;
+        }
+        memset(w + nwatches, 0, (n - nwatches) * sizeof(struct watch));
+        watches = w;
+        nwatches = n;
+    }
+
+    char *key = strdup(p);
+    if (!key) {
+        free(dname);
+        return -1;
+    }
+
+    // the same inode reached through another path (bind mount) reuses wd
+    struct watch *w = &watches[wd];
+    if (w->bdir) hashtable_remove(watched, w->bdir);
+    free(w->dir);
+
+    w->dir = dname;
+    w->bdir = key;
+    hashtable_insert(watched, key, key);
+
+    return 1;
+}
+#endif
+
+/**
+ * Start the inotify thread for -o cache_watch, called from ulakefs_init()
+ */
+int pagecache_init(void) {
+    rw_files = create_hashtable(16, string_hash, string_equal);
+    if (!rw_files) RETURN(-ENOMEM);
+
+    if (!uopt.cache_watch) RETURN(0);
+
+#ifdef __linux__
+    watched = create_hashtable(16, string_hash, string_equal);
+    stale = create_hashtable(16, string_hash, string_equal);
+    if (!watched || !stale) RETURN(-ENOMEM);
+
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd == -1) RETURN(-errno);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int res = pthread_create(&thread, &attr, inotify_thread, NULL);
+    pthread_attr_destroy(&attr);
+    if (res) {
+        close(inotify_fd);
+        inotify_fd = -1;
+        RETURN(-res);
+    }
+#endif
+
+    RETURN(0);
+}
+
+/**
+ * Keep the cache of a read-only branch file, unless the file was modified
+ * out-of-band
+ */
+static void open_ro(const char *path, int branch, struct fuse_file_info *fi) {
+    if (uopt.no_ro_cache) return;
+
+#ifdef __linux__
+    if (inotify_fd != -1) {
+        pthread_mutex_lock(&cache_lock);
+
+        // pages cached before the watch existed might be stale already
+        bool keep = watch_parent(path, branch) == 0;
+
+        // key and value are the same string, freed by hashtable_remove()
+        if (hashtable_remove(stale, (void *)path)) {
+            st_stale++;
+            keep = false;
+        }
+
+        if (keep) st_ro_kept++;
+        pthread_mutex_unlock(&cache_lock);
+
+        fi->keep_cache = keep;
+        return;
+    }
+#else
+    (void)path;
+    (void)branch;
+#endif
+
+    __sync_fetch_and_add(&st_ro_kept, 1);
+    fi->keep_cache = 1;
+}
+
+/**
+ * Record mtime and size of a writable branch file, cache_lock MUST be held.
+ * Returns true if they did not change since the last record.
+ */
+static bool rw_record(const char *path, const struct stat *st) {
+    struct rw_entry *e = hashtable_search(rw_files, (void *)path);
+
+    bool same = e && e->ino == st->st_ino && e->size == st->st_size
+                && e->mtime.tv_sec == st->st_mtim.tv_sec
+                && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+
+    if (!e) {
+        if (hashtable_count(rw_files) >= PAGECACHE_MAX_ENTRIES) {
+            hashtable_destroy(rw_files, 1);
+            rw_files = create_hashtable(16, string_hash, string_equal);
+        }
+
+        char *key = strdup(path);
+        e = malloc(sizeof(*e));
+        if (!key || !e || !hashtable_insert(rw_files, key, e)) {
+            free(key);
+            free(e);
+            return same;
+        }
+    }
+
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+
+    return same;
+}
+
+/**
+ * Decide whether the kernel may keep the cached pages of a file opened
+ * from branch
+ */
+void pagecache_open(const char *path, int branch, int fd, struct fuse_file_info *fi) {
+    if (!BRANCHES[branch].rw) {
+        open_ro(path, branch, fi);
+        return;
+    }
+
+    if (!uopt.rw_auto_cache) return;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) return;
+
+    pthread_mutex_lock(&cache_lock);
+    bool keep = rw_record(path, &st);
+    if (keep)
+        st_rw_kept++;
+    else
+        st_rw_dropped++;
+    pthread_mutex_unlock(&cache_lock);
+
+    fi->keep_cache = keep;
+}
+
+/**
+ * Our own writes change mtime and size, remember them on release so that
+ * the next open keeps the cache
+ */
+void pagecache_release(const char *path, int fd, struct fuse_file_info *fi) {
+    if (!uopt.rw_auto_cache || !path) return;
+    if ((fi->flags & O_ACCMODE) == O_RDONLY) return;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) return;
+
+    pthread_mutex_lock(&cache_lock);
+    rw_record(path, &st);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void pagecache_stats(FILE *f) {
+    pthread_mutex_lock(&cache_lock);
+    fprintf(f, "pagecache_ro_kept %lu\n", st_ro_kept);
+    fprintf(f, "pagecache_rw_kept %lu\n", st_rw_kept);
+    fprintf(f, "pagecache_rw_dropped %lu\n", st_rw_dropped);
+    fprintf(f, "pagecache_stale %lu\n", st_stale);
+    fprintf(f, "pagecache_watches %u\n", watched ? hashtable_count(watched) : 0);
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,16 @@
+//
+// Kernel page cache policy for opened files
+//
+
+#ifndef ULAKEFS_FUSE_PAGECACHE_H
+#define ULAKEFS_FUSE_PAGECACHE_H
+
+#include <fuse.h>
+#include <stdio.h>
+
+int pagecache_init(void);
+void pagecache_open(const char *path, int branch, int fd, struct fuse_file_info *fi);
+void pagecache_release(const char *path, int fd, struct fuse_file_info *fi);
+void pagecache_stats(FILE *f);
+
+#endif //ULAKEFS_FUSE_PAGECACHE_H
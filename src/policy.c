@@ -0,0 +1,238 @@
+//
+// Placement of new files across several rw-branches
+//
+/*
+ * Without a policy new files, directories and symlinks go to the topmost
+ * writable branch (ff), so with several rw-branches all writes land on the
+ * first disk. -o create_policy=ep|mfs|lus|rr spreads them:
+ *
+ *   ep   the first rw-branch that already has the parent directory
+ *   mfs  the rw-branch with the most free space (statfs snapshot if
+ *        -o statfs_interval is given)
+ *   lus  the rw-branch that got the fewest bytes written since mount
+ *   rr   the rw-branches in turn
+ *
+ * -o create_policy_path=/prefix=policy[:/prefix=policy...] overrides the
+ * mount policy below a prefix, the longest prefix wins.
+ *
+ * Only branches above the first whiteout of the path are candidates, a new
+ * file below a whiteout would be hidden. Without cow the parent directory
+ * cannot be created on another branch, so then only branches that have the
+ * parent are candidates for any policy.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "branches.h"
+#include "general.h"
+#include "statfs.h"
+#include "policy.h"
+
+struct policy_prefix {
+    char *prefix;
+    size_t len;
+    int policy;
+};
+
+static struct policy_prefix *prefixes;
+static int nprefixes;
+
+static unsigned long long *written;	// per branch id, bytes written since mount
+static unsigned int rr_next;
+
+static const char *policy_names[] = {
+    [POLICY_FF] = "ff",
+    [POLICY_EP] = "ep",
+    [POLICY_MFS] = "mfs",
+    [POLICY_LUS] = "lus",
+    [POLICY_RR] = "rr",
+};
+
+/**
+ * Return the create policy called name, -1 if there is none
+ */
+int policy_parse(const char *name) {
+    int i;
+    for (i = 0; i < (int)(sizeof(policy_names) / sizeof(policy_names[0])); i++) {
+        if (strcmp(name, policy_names[i]) == 0) return i;
+    }
+
+    return -1;
+}
+
+/**
+ * Parse the colon separated list of -o create_policy_path=/a=rr:/b=mfs
+ */
+int policy_add_paths(const char *arg) {
+    char *buf = strdup(arg);
+    if (!buf) return -1;
+
+    char *ptr = buf;
+    char *entry;
+    while ((entry = strsep(&ptr, ROOT_SEP)) != NULL) {
+        char *name = strrchr(entry, '=');
+        if (!name || entry[0] != '/') {
+            fprintf(stderr, "create_policy_path %s is not /path=policy\n", entry);
+            free(buf);
+            return -1;
+        }
+        *name++ = '\0';
+
+        int policy = policy_parse(name);
+        if (policy < 0) {
+            fprintf(stderr, "Unknown create policy %s\n", name);
+            free(buf);
+            return -1;
+        }
+
+        size_t len = strlen(entry);
+        while (len > 1 && entry[len - 1] == '/') entry[--len] = '\0';
+
+        struct policy_prefix *p = realloc(prefixes, (nprefixes + 1) * sizeof(*p));
+        if (!p) {
+            free(buf);
+            return -1;
+        }
+        prefixes = p;
+        prefixes[nprefixes].prefix = strdup(entry);
+        prefixes[nprefixes].len = len;
+        prefixes[nprefixes].policy = policy;
+        nprefixes++;
+    }
+
+    free(buf);
+    return 0;
+}
+
+/**
+ * Allocate the written bytes counters if any policy is set, called from ulakefs_init()
+ */
+int policy_init(void) {
+    if (uopt.create_policy == POLICY_FF && !nprefixes) RETURN(0);
+
+    written = calloc(BRANCHES_MAX, sizeof(*written));
+    if (!written) RETURN(-ENOMEM);
+
+    RETURN(0);
+}
+
+/**
+ * Policy of the longest matching prefix or the mount policy
+ */
+static int policy_for(const char *path) {
+    int policy = uopt.create_policy;
+    size_t best = 0;
+
+    int i;
+    for (i = 0; i < nprefixes; i++) {
+        struct policy_prefix *p = &prefixes[i];
+
+        if (p->len <= best) continue;
+        if (p->len == 1 // "/"
+            || (strncmp(path, p->prefix, p->len) == 0
+                && (path[p->len] == '\0' || path[p->len] == '/'))) {
+            policy = p->policy;
+            best = p->len;
+        }
+    }
+
+    return policy;
+}
+
+static bool parent_exists(const char *dname, int branch) {
+    char p[PATHLEN_MAX];
+    if (BUILD_PATH(p, BRANCHES[branch].path, dname)) return false;
+
+    struct stat st;
+    return stat(p, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * Pick the rw-branch for the new path, -1 to keep the default placement
+ */
+int policy_create_branch(const char *path) {
+    int policy = policy_for(path);
+    if (policy == POLICY_FF) return -1;
+
+    char *dname = u_dirname(path);
+    if (!dname) return -1;
+
+    bool need_parent = policy == POLICY_EP || !uopt.cow_enabled;
+
+    int cand[NBRANCHES];
+    int ncand = 0;
+
+    int i;
+    for (i = 0; i < NBRANCHES; i++) {
+        if (BRANCHES[i].rw && (!need_parent || parent_exists(dname, i)))
+            cand[ncand++] = i;
+
+        // whiteouts hide the path in all lower branches
+        if (path_hidden(path, i)) break;
+    }
+    free(dname);
+
+    if (!ncand) return -1;
+
+    int best = cand[0];
+    switch (policy) {
+        case POLICY_EP:
+            break;
+        case POLICY_MFS:
+        {
+            unsigned long long best_free = 0;
+            for (i = 0; i < ncand; i++) {
+                struct statvfs st;
+                if (statfs_branch(cand[i], &st)) continue;
+
+                unsigned long long avail = (unsigned long long)st.f_bavail * st.f_frsize;
+                if (avail > best_free) {
+                    best_free = avail;
+                    best = cand[i];
+                }
+            }
+            break;
+        }
+        case POLICY_LUS:
+            if (!written) break;
+            for (i = 1; i < ncand; i++) {
+                if (written[BRANCHES[cand[i]].id] < written[BRANCHES[best].id]) best = cand[i];
+            }
+            break;
+        case POLICY_RR:
+            best = cand[__sync_fetch_and_add(&rr_next, 1) % ncand];
+            break;
+    }
+
+    DBG("%s: policy %s, branch %d\n", path, policy_names[policy], best);
+
+    return best;
+}
+
+/**
+ * Account a write to branch for the lus policy
+ */
+void policy_written(int branch, ssize_t bytes) {
+    if (!written || bytes <= 0 || branch < 0) return;
+
+    __sync_fetch_and_add(&written[BRANCHES[branch].id], (unsigned long long)bytes);
+}
+
+void policy_stats(FILE *f) {
+    if (!written) return;
+
+    int i;
+    for (i = 0; i < NBRANCHES; i++) {
+        if (!BRANCHES[i].rw) continue;
+        fprintf(f, "policy_written %s %llu\n", BRANCHES[i].path,
+                __sync_fetch_and_add(&written[BRANCHES[i].id], 0));
+    }
+}
@@ -0,0 +1,26 @@
+//
+// Placement of new files across several rw-branches
+//
+
+#ifndef ULAKEFS_FUSE_POLICY_H
+#define ULAKEFS_FUSE_POLICY_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+enum create_policy {
+    POLICY_FF,	// first found, the topmost writable branch (default)
+    POLICY_EP,	// existing path, first rw-branch that has the parent
+    POLICY_MFS,	// most free space
+    POLICY_LUS,	// least used space, by bytes written since mount
+    POLICY_RR,	// round-robin
+};
+
+int policy_parse(const char *name);
+int policy_add_paths(const char *arg);
+int policy_init(void);
+int policy_create_branch(const char *path);
+void policy_written(int branch, ssize_t bytes);
+void policy_stats(FILE *f);
+
+#endif //ULAKEFS_FUSE_POLICY_H
@@ -0,0 +1,176 @@
+//
+// Access pattern detection and readahead hints for branch files
+//
+/*
+ * Sequential reads through fuse arrive as small and slightly reordered
+ * requests, which the readahead of the branch filesystem does not always
+ * recognize. With -o readahead every open file tracks where its reads go:
+ *
+ * - reads close to the end of the previous one are sequential, the pages
+ *   of the next window are requested with POSIX_FADV_WILLNEED before the
+ *   reader needs them
+ * - a run of reads far apart switches the fd to POSIX_FADV_RANDOM, so the
+ *   kernel stops reading ahead for nothing
+ *
+ * The window follows the throughput of the reader: it is sized to cover
+ * RA_HORIZON_MS of reading, and doubled whenever the reader caught up with
+ * the previous window. It stays between RA_MIN and -o readahead_max.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "readahead.h"
+
+#define RA_MIN (128 * 1024)
+#define RA_HORIZON_MS 250	// window covers this much reading time
+#define RA_SEQ_RUN 2		// sequential reads before the first window
+#define RA_RANDOM_RUN 4		// random reads before FADV_RANDOM
+
+struct readahead {
+    pthread_mutex_t lock;
+    off_t next;		// end of the previous read
+    off_t ra_end;	// end of the last advised window
+    off_t ra_start;	// offset the reader had when the window was advised
+    size_t window;
+    struct timespec ra_time; // when the window was advised
+    int seq;		// length of the current sequential run
+    int random;		// length of the current random run
+    bool fadv_random;	// fd is in POSIX_FADV_RANDOM mode
+};
+
+static unsigned long st_windows, st_grown, st_random;
+
+static long elapsed_ms(const struct timespec *since, const struct timespec *now) {
+    return (now->tv_sec - since->tv_sec) * 1000
+           + (now->tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/**
+ * Size of the next window from the throughput since the last window
+ */
+static size_t next_window(struct readahead *ra, off_t offset, bool caught_up) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    size_t window = ra->window;
+    long ms = elapsed_ms(&ra->ra_time, &now);
+    off_t consumed = offset - ra->ra_start;
+
+    if (ms > 0 && consumed > 0)
+        window = (size_t)((double)consumed * RA_HORIZON_MS / ms);
+
+    if (caught_up && window < ra->window * 2) {
+        window = ra->window * 2;
+        __sync_fetch_and_add(&st_grown, 1);
+    }
+
+    if (window < RA_MIN) window = RA_MIN;
+    if (window > uopt.readahead_max) window = uopt.readahead_max;
+
+    ra->ra_time = now;
+    ra->ra_start = offset;
+
+    return window;
+}
+
+static void sequential(ufile_t *uf, struct readahead *ra, off_t offset, size_t size) {
+    if (ra->fadv_random) {
+        posix_fadvise(uf->fd, 0, 0, POSIX_FADV_NORMAL);
+        ra->fadv_random = false;
+    }
+
+    if (++ra->seq < RA_SEQ_RUN) return;
+
+    off_t end = offset + size;
+
+    // the window is advised once the reader is in its second half
+    if (ra->ra_end - end > (off_t)ra->window / 2) return;
+
+    bool caught_up = ra->ra_end && end > ra->ra_end;
+    ra->window = next_window(ra, offset, caught_up);
+
+    off_t start = ra->ra_end > end ? ra->ra_end : end;
+    ra->ra_end = end + ra->window;
+
+    posix_fadvise(uf->fd, start, ra->ra_end - start, POSIX_FADV_WILLNEED);
+    __sync_fetch_and_add(&st_windows, 1);
+}
+
+static void random_read(ufile_t *uf, struct readahead *ra) {
+    ra->seq = 0;
+    ra->ra_end = 0;
+    ra->window = RA_MIN;
+
+    // the fd of the fd cache is shared, do not take readahead from others
+    if (ra->fadv_random || uf->fdc || ++ra->random < RA_RANDOM_RUN) return;
+
+    posix_fadvise(uf->fd, 0, 0, POSIX_FADV_RANDOM);
+    ra->fadv_random = true;
+    __sync_fetch_and_add(&st_random, 1);
+}
+
+/**
+ * Account a read of size bytes at offset, called before reading
+ */
+void readahead_read(ufile_t *uf, off_t offset, size_t size) {
+    if (!uopt.readahead || uf->branch == -1 || uf->odirect) return;
+
+    struct readahead *ra = uf->ra;
+    if (!ra) {
+        ra = calloc(1, sizeof(struct readahead));
+        if (!ra) return;
+
+        pthread_mutex_init(&ra->lock, NULL);
+        ra->window = RA_MIN;
+        clock_gettime(CLOCK_MONOTONIC, &ra->ra_time);
+
+        // first read, concurrent reads of the same file may race here
+        if (!__sync_bool_compare_and_swap(&uf->ra, NULL, ra)) {
+            pthread_mutex_destroy(&ra->lock);
+            free(ra);
+            ra = uf->ra;
+        }
+    }
+
+    pthread_mutex_lock(&ra->lock);
+
+    // requests of parallel fuse workers are slightly out of order
+    off_t slack = size * 4 > RA_MIN ? (off_t)size * 4 : RA_MIN;
+    off_t dist = offset - ra->next;
+
+    if (dist > -slack && dist < slack) {
+        ra->random = 0;
+        sequential(uf, ra, offset, size);
+        if (offset + (off_t)size > ra->next) ra->next = offset + size;
+    } else {
+        random_read(uf, ra);
+        ra->next = offset + size;
+    }
+
+    pthread_mutex_unlock(&ra->lock);
+}
+
+void readahead_release(ufile_t *uf) {
+    if (!uf->ra) return;
+
+    pthread_mutex_destroy(&uf->ra->lock);
+    free(uf->ra);
+    uf->ra = NULL;
+}
+
+void readahead_stats(FILE *f) {
+    if (!uopt.readahead) return;
+
+    fprintf(f, "readahead_windows %lu\n", st_windows);
+    fprintf(f, "readahead_grown %lu\n", st_grown);
+    fprintf(f, "readahead_random %lu\n", st_random);
+}
@@ -0,0 +1,16 @@
+//
+// Access pattern detection and readahead hints for branch files
+//
+
+#ifndef ULAKEFS_FUSE_READAHEAD_H
+#define ULAKEFS_FUSE_READAHEAD_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "Ulakefs.h"
+
+void readahead_read(ufile_t *uf, off_t offset, size_t size);
+void readahead_release(ufile_t *uf);
+void readahead_stats(FILE *f);
+
+#endif //ULAKEFS_FUSE_READAHEAD_H
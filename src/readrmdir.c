@@ -14,32 +14,80 @@
 #include "Ulakefs.h"
 #include "options.h"
 #include "debug.h"
+#include "branches.h"
 #include "hashtable.h"
 #include "general.h"
 #include "readrmdir.h"
+#include "ctl.h"
+#include "stripe.h"
+#include "manifest.h"
+#include "wostore.h"
+
+// a directory of a branch, listed from the manifest if the branch has one
+struct branch_dir {
+    DIR *dp;
+    manifest_dir_t md;
+    bool manifest;
+};
+
+/**
+ * Open path on branch, p is path with the branch prefix. Returns false
+ * if the directory cannot be read.
+ */
+static bool branch_opendir(int branch, const char *path, const char *p, struct branch_dir *d) {
+    int res = manifest_opendir(branch, path, &d->md);
+    d->manifest = res != 1;
+    if (d->manifest) return res == 0;
+
+    d->dp = opendir(p);
+    return d->dp != NULL;
+}
+
+/**
+ * Next name of d, st gets the inode number and type. NULL at the end.
+ */
+static const char *branch_readdir(struct branch_dir *d, struct stat *st) {
+    if (d->manifest) return manifest_readdir(&d->md, st);
+
+    struct dirent *de = readdir(d->dp);
+    if (!de) return NULL;
+
+    memset(st, 0, sizeof(*st));
+    st->st_ino = de->d_ino;
+    st->st_mode = de->d_type << 12;
+
+    return de->d_name;
+}
+
+static void branch_closedir(struct branch_dir *d) {
+    if (!d->manifest) closedir(d->dp);
+}
 
 /**
   * Hide metadata. This causes a slight slowdown this is optional
   *
   */
-static bool hide_meta_files(int branch, const char *path, struct dirent *de)
+static bool hide_meta_files(int branch, const char *path, const char *name)
 {
+    // the manifest of an immutable branch does not list itself either
+    if (BRANCHES[branch].immutable && strcmp(BRANCHES[branch].path, path) == 0
+        && strncmp(name, MANIFEST_NAME, strlen(MANIFEST_NAME)) == 0
+        && (!name[strlen(MANIFEST_NAME)] || strcmp(name + strlen(MANIFEST_NAME), "~") == 0)) {
+        RETURN(true);
+    }
 
     if (uopt.hide_meta_files == false) RETURN(false);
 
-    fprintf(stderr, "uopt.branches[branch].path = %s path = %s\n", uopt.branches[branch].path, path);
-    fprintf(stderr, "METANAME = %s, de->d_name = %s\n", METANAME, de->d_name);
-
     // TODO Would it be faster to add hash comparison?
 
     // HIDE out .ulakefs directory
-    if (strcmp(uopt.branches[branch].path, path) == 0
-        && strcmp(METANAME, de->d_name) == 0) {
+    if (strcmp(BRANCHES[branch].path, path) == 0
+        && strcmp(METANAME, name) == 0) {
         RETURN(true);
     }
 
     // HIDE fuse META files
-    if (strncmp(FUSE_META_FILE, de->d_name, FUSE_META_LENGTH) == 0) {
+    if (strncmp(FUSE_META_FILE, name, FUSE_META_LENGTH) == 0) {
         RETURN(true);
     }
 
@@ -49,9 +97,8 @@ static bool hide_meta_files(int branch, const char *path, struct dirent *de)
 /**
  * Check if fname has a hiding tag and return its status.
  * Also, add this file and to the hiding hash table.
- * Warning: If fname has the tag, fname gets modified.
  */
-static bool is_hiding(struct hashtable *hides, char *fname) {
+static bool is_hiding(struct hashtable *hides, const char *fname) {
     DBG("%s\n", fname);
 
     char *tag;
@@ -59,13 +106,14 @@ static bool is_hiding(struct hashtable *hides, char *fname) {
     tag = whiteout_tag(fname);
     if (tag) {
         // even more important, ignore the file without the tag!
-        // hint: tag is a pointer to the flag-suffix within de->d_name
-        *tag = '\0'; // this modifies fname!
+        // hint: tag is a pointer to the flag-suffix within fname
+        char *key = strndup(fname, tag - fname);
 
         // add to hides (only if not there already)
-        if (!hashtable_search(hides, fname)) {
-            char *key = strdup(fname);
+        if (key && !hashtable_search(hides, key)) {
             hashtable_insert(hides, key, key);
+        } else {
+            free(key);
         }
 
         RETURN(true);
@@ -80,18 +128,24 @@ static bool is_hiding(struct hashtable *hides, char *fname) {
 static void read_whiteouts(const char *path, struct hashtable *whiteouts, int branch) {
     DBG("%s\n", path);
 
+    if (uopt.whiteout_store) {
+        wostore_read(path, branch, whiteouts);
+        return;
+    }
+
     char p[PATHLEN_MAX];
-    if (BUILD_PATH(p, uopt.branches[branch].path, METADIR, path)) return;
+    if (BUILD_PATH(p, BRANCHES[branch].path, METADIR, path)) return;
 
-    DIR *dp = opendir(p);
-    if (dp == NULL) return;
+    struct branch_dir d;
+    if (!branch_opendir(branch, p + BRANCHES[branch].path_len - 1, p, &d)) return;
 
-    struct dirent *de;
-    while ((de = readdir(dp)) != NULL) {
-        is_hiding(whiteouts, de->d_name);
+    const char *name;
+    struct stat st;
+    while ((name = branch_readdir(&d, &st)) != NULL) {
+        is_hiding(whiteouts, name);
     }
 
-    closedir(dp);
+    branch_closedir(&d);
 }
 
 /**
@@ -99,6 +153,8 @@ static void read_whiteouts(const char *path, struct hashtable *whiteouts, int br
  */
 
 int ulakefs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    branches_enter(NULL);
+
     DBG("%s\n", path);
 
     (void)offset;
@@ -106,6 +162,8 @@ int ulakefs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t o
     int i = 0;
     int rc = 0;
 
+    if (ctl_path(path)) RETURN(ctl_readdir(path, buf, filler));
+
     // we will store already added files here to handle same file names across different branches
     struct hashtable *files = create_hashtable(16, string_hash, string_equal);
 
@@ -115,11 +173,11 @@ int ulakefs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t o
 
     bool subdir_hidden = false;
 
-    for (i = 0; i < uopt.nbranches; i++) {
+    for (i = 0; i < NBRANCHES; i++) {
         if (subdir_hidden) break;
 
         char p[PATHLEN_MAX];
-        if (BUILD_PATH(p, uopt.branches[i].path, path)) {
+        if (BUILD_PATH(p, BRANCHES[i].path, path)) {
             rc = -ENAMETOOLONG;
             goto out;
         }
@@ -131,41 +189,39 @@ int ulakefs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t o
             goto out;
         }
 
+        // whiteouts of this branch only hide lower branches, an opaque
+        // or hidden directory ends the listing here and needs none
         if (res > 0) subdir_hidden = true;
 
-        DIR *dp = opendir(p);
-        if (dp == NULL) {
-            if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
+        struct branch_dir d;
+        if (!branch_opendir(i, path, p, &d)) {
+            if (uopt.cow_enabled && !subdir_hidden) read_whiteouts(path, whiteouts, i);
             continue;
         }
 
-        struct dirent *de;
-        while ((de = readdir(dp)) != NULL) {
+        const char *name;
+        struct stat st;
+        while ((name = branch_readdir(&d, &st)) != NULL) {
             // already added in some other branch
-            if (hashtable_search(files, de->d_name) != NULL) continue;
+            if (hashtable_search(files, (void *)name) != NULL) continue;
 
             // check if we need file hiding
             if (uopt.cow_enabled) {
                 // file should be hidden from the user
-                if (hashtable_search(whiteouts, de->d_name) != NULL) continue;
+                if (hashtable_search(whiteouts, (void *)name) != NULL) continue;
             }
 
-            if (hide_meta_files(i, p, de) == true) continue;
+            if (hide_meta_files(i, p, name) == true) continue;
 
             // fill with something dummy, we're interested in key existence only
-            char *key = strdup(de->d_name);
+            char *key = strdup(name);
             hashtable_insert(files, key, key);
 
-            struct stat st;
-            memset(&st, 0, sizeof(st));
-            st.st_ino = de->d_ino;
-            st.st_mode = de->d_type << 12;
-
-            if (filler(buf, de->d_name, &st, 0)) break;
+            if (filler(buf, name, &st, 0)) break;
         }
 
-        closedir(dp);
-        if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
+        branch_closedir(&d);
+        if (uopt.cow_enabled && !subdir_hidden) read_whiteouts(path, whiteouts, i);
     }
 
     out:
@@ -194,11 +250,11 @@ int dir_not_empty(const char *path) {
 
     bool subdir_hidden = false;
 
-    for (i = 0; i < uopt.nbranches; i++) {
+    for (i = 0; i < NBRANCHES; i++) {
         if (subdir_hidden) break;
 
         char p[PATHLEN_MAX];
-        if (BUILD_PATH(p, uopt.branches[i].path, path)) {
+        if (BUILD_PATH(p, BRANCHES[i].path, path)) {
             rc = -ENAMETOOLONG;
             goto out;
         }
@@ -210,37 +266,40 @@ int dir_not_empty(const char *path) {
             goto out;
         }
 
+        // whiteouts of this branch only hide lower branches, an opaque
+        // or hidden directory ends the listing here and needs none
         if (res > 0) subdir_hidden = true;
 
-        DIR *dp = opendir(p);
-        if (dp == NULL) {
-            if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
+        struct branch_dir d;
+        if (!branch_opendir(i, path, p, &d)) {
+            if (uopt.cow_enabled && !subdir_hidden) read_whiteouts(path, whiteouts, i);
             continue;
         }
 
-        struct dirent *de;
-        while ((de = readdir(dp)) != NULL) {
+        const char *name;
+        struct stat st;
+        while ((name = branch_readdir(&d, &st)) != NULL) {
             // Ignore . and ..
-            if ((strcmp(de->d_name, ".") == 0) ||  (strcmp(de->d_name, "..") == 0)) {
+            if ((strcmp(name, ".") == 0) ||  (strcmp(name, "..") == 0)) {
                 continue;
             }
 
             // check if we need file hiding
             if (uopt.cow_enabled) {
                 // file should be hidden from the user
-                if (hashtable_search(whiteouts, de->d_name) != NULL) continue;
+                if (hashtable_search(whiteouts, (void *)name) != NULL) continue;
             }
 
-            if (hide_meta_files(i, p, de) == true) continue;
+            if (hide_meta_files(i, p, name) == true) continue;
 
             // When we arrive here, a valid entry was found
             not_empty = 1;
-            closedir(dp);
+            branch_closedir(&d);
             goto out;
         }
 
-        closedir(dp);
-        if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
+        branch_closedir(&d);
+        if (uopt.cow_enabled && !subdir_hidden) read_whiteouts(path, whiteouts, i);
     }
 
     out:
@@ -259,7 +318,7 @@ static int rmdir_rw(const char *path, int branch_rw) {
     DBG("%s\n", path);
 
     char p[PATHLEN_MAX];
-    if (BUILD_PATH(p, uopt.branches[branch_rw].path, path)) return ENAMETOOLONG;
+    if (BUILD_PATH(p, BRANCHES[branch_rw].path, path)) return ENAMETOOLONG;
 
     int res = rmdir(p);
     if (res == -1) return errno;
@@ -302,6 +361,8 @@ static int rmdir_ro(const char *path, int branch_ro) {
   * rmdir() call
   */
 int ulakefs_rmdir(const char *path) {
+    branches_enter(NULL);
+
     DBG("%s\n", path);
 
     if (dir_not_empty(path)) return -ENOTEMPTY;
@@ -310,7 +371,7 @@ int ulakefs_rmdir(const char *path) {
     if (i == -1) return -errno;
 
     int res;
-    if (!uopt.branches[i].rw) {
+    if (!BRANCHES[i].rw) {
         // read-only branch
         if (!uopt.cow_enabled) {
             res = EROFS;
@@ -360,7 +421,7 @@ static int unlink_rw(const char *path, int branch_rw) {
     DBG("%s\n", path);
 
     char p[PATHLEN_MAX];
-    if (BUILD_PATH(p, uopt.branches[branch_rw].path, path)) RETURN(ENAMETOOLONG);
+    if (BUILD_PATH(p, BRANCHES[branch_rw].path, path)) RETURN(ENAMETOOLONG);
 
     int res = unlink(p);
     if (res == -1) RETURN(errno);
@@ -372,12 +433,14 @@ static int unlink_rw(const char *path, int branch_rw) {
   * unlink() call
   */
 int ulakefs_unlink(const char *path) {
+    branches_enter(NULL);
+
     DBG("%s\n", path);
     int i = find_rorw_branch(path);
     if (i == -1) RETURN(errno);
 
     int res;
-    if (!uopt.branches[i].rw) {
+    if (!BRANCHES[i].rw) {
         // read-only branch
         if (!uopt.cow_enabled) {
             res = EROFS;
@@ -388,6 +451,7 @@ int ulakefs_unlink(const char *path) {
         // read-write branch
         res = unlink_rw(path, i);
         if (res == 0) {
+            stripe_unlink(path, i);
             // No need to be root, whiteouts are created as root!
             maybe_whiteout(path, i, WHITEOUT_FILE);
         }
@@ -0,0 +1,352 @@
+//
+// Multithreaded fuse session loop with a configurable worker pool
+//
+/*
+ * fuse_loop_mt() of libfuse 2 has no knobs: every worker reads the same
+ * /dev/fuse fd and up to 10 idle workers are kept. This loop follows the
+ * same design (a worker that takes the last idle slot starts another one),
+ * but the pool is bounded by -o threads and -o max_idle_threads.
+ *
+ * With -o clone_fd every worker reads from its own /dev/fuse fd, cloned
+ * from the session fd with FUSE_DEV_IOC_CLONE. Requests still come from
+ * the common kernel queue, but a worker only contends on its own fd and
+ * replies on the fd it received the request from. With -o pin_threads
+ * workers are pinned round-robin to the online CPUs.
+ */
+#define _GNU_SOURCE // pthread_setaffinity_np()
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "session.h"
+
+#if defined __linux__ && !defined FUSE_DEV_IOC_CLONE
+#define FUSE_DEV_IOC_CLONE _IOR(229, 0, uint32_t) // from linux/fuse.h
+#endif
+
+struct worker {
+    struct worker *prev, *next;
+    pthread_t thread;
+    struct fuse_chan *ch;	// cloned channel or the session channel
+    size_t bufsize;
+    char *buf;
+};
+
+struct session {
+    struct fuse_session *se;
+    struct fuse_chan *ch;	// the session channel
+    struct worker main;		// list head
+    pthread_mutex_t lock;
+    int numworker;
+    int numavail;
+    int next_cpu;
+    sem_t finish;
+    int error;
+};
+
+static struct session session;
+
+#ifdef FUSE_DEV_IOC_CLONE
+/**
+ * Channel receive of a cloned fd, same as the kernel channel of libfuse
+ */
+static int clone_receive(struct fuse_chan **chp, char *buf, size_t size) {
+    struct fuse_chan *ch = *chp;
+
+    while (1) {
+        ssize_t res = read(fuse_chan_fd(ch), buf, size);
+        int err = errno;
+
+        if (fuse_session_exited(session.se)) return 0;
+        if (res != -1) return res;
+
+        // ENOENT means the operation was interrupted, it's safe to restart
+        if (err == ENOENT) continue;
+
+        if (err == ENODEV) {
+            // umounted
+            fuse_session_exit(session.se);
+            return 0;
+        }
+        if (err != EINTR && err != EAGAIN)
+            USYSLOG(LOG_ERR, "%s: reading the fuse device failed: %s\n",
+                    __func__, strerror(err));
+        return -err;
+    }
+}
+
+static int clone_send(struct fuse_chan *ch, const struct iovec iov[], size_t count) {
+    if (!iov) return 0;
+
+    ssize_t res = writev(fuse_chan_fd(ch), iov, count);
+    if (res == -1) {
+        int err = errno;
+
+        // ENOENT means the operation was interrupted
+        if (!fuse_session_exited(session.se) && err != ENOENT)
+            USYSLOG(LOG_ERR, "%s: writing the fuse device failed: %s\n",
+                    __func__, strerror(err));
+        return -err;
+    }
+
+    return 0;
+}
+
+static void clone_destroy(struct fuse_chan *ch) {
+    close(fuse_chan_fd(ch));
+}
+
+static struct fuse_chan_ops clone_ops = {
+    .receive = clone_receive,
+    .send = clone_send,
+    .destroy = clone_destroy,
+};
+
+/**
+ * Open a new /dev/fuse fd attached to the session, NULL if the kernel does
+ * not support cloning
+ */
+static struct fuse_chan *clone_chan(void) {
+    int fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+    if (fd == -1) return NULL;
+
+    uint32_t masterfd = fuse_chan_fd(session.ch);
+    if (ioctl(fd, FUSE_DEV_IOC_CLONE, &masterfd) == -1) {
+        DBG("cloning the fuse fd failed: %s\n", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    struct fuse_chan *ch = fuse_chan_new(&clone_ops, fd,
+                                         fuse_chan_bufsize(session.ch), NULL);
+    if (!ch) close(fd);
+
+    return ch;
+}
+#endif
+
+static void list_add_worker(struct worker *w, struct worker *next) {
+    struct worker *prev = next->prev;
+    w->next = next;
+    w->prev = prev;
+    prev->next = w;
+    next->prev = w;
+}
+
+static void list_del_worker(struct worker *w) {
+    struct worker *prev = w->prev;
+    struct worker *next = w->next;
+    prev->next = next;
+    next->prev = prev;
+}
+
+static void free_worker(struct worker *w) {
+    if (w->ch != session.ch) fuse_chan_destroy(w->ch);
+    free(w->buf);
+    free(w);
+}
+
+static int start_thread(void);
+
+static void *worker_thread(void *arg) {
+    struct worker *w = arg;
+
+    while (!fuse_session_exited(session.se)) {
+        struct fuse_chan *ch = w->ch;
+        struct fuse_buf fbuf;
+        memset(&fbuf, 0, sizeof(fbuf));
+        fbuf.mem = w->buf;
+        fbuf.size = w->bufsize;
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        int res = fuse_session_receive_buf(session.se, &fbuf, &ch);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (res == -EINTR) continue;
+        if (res <= 0) {
+            if (res < 0) {
+                fuse_session_exit(session.se);
+                session.error = -1;
+            }
+            break;
+        }
+
+        pthread_mutex_lock(&session.lock);
+        session.numavail--;
+        if (session.numavail == 0
+            && (!uopt.session_threads || session.numworker < uopt.session_threads))
+            start_thread();
+        pthread_mutex_unlock(&session.lock);
+
+        fuse_session_process_buf(session.se, &fbuf, ch);
+
+        pthread_mutex_lock(&session.lock);
+        session.numavail++;
+        if (session.numavail > uopt.session_max_idle) {
+            if (fuse_session_exited(session.se)) {
+                pthread_mutex_unlock(&session.lock);
+                return NULL;
+            }
+            list_del_worker(w);
+            session.numavail--;
+            session.numworker--;
+            pthread_mutex_unlock(&session.lock);
+
+            pthread_detach(w->thread);
+            free_worker(w);
+            return NULL;
+        }
+        pthread_mutex_unlock(&session.lock);
+    }
+
+    sem_post(&session.finish);
+
+    return NULL;
+}
+
+/**
+ * Start another worker, session.lock MUST be held
+ */
+static int start_thread(void) {
+    struct worker *w = calloc(1, sizeof(struct worker));
+    if (!w) {
+        USYSLOG(LOG_ERR, "%s: allocating a worker failed\n", __func__);
+        return -1;
+    }
+
+    w->ch = session.ch;
+#ifdef FUSE_DEV_IOC_CLONE
+    if (uopt.clone_fd) {
+        struct fuse_chan *ch = clone_chan();
+        if (ch) w->ch = ch;
+    }
+#endif
+
+    w->bufsize = fuse_chan_bufsize(w->ch);
+    w->buf = malloc(w->bufsize);
+    if (!w->buf) {
+        USYSLOG(LOG_ERR, "%s: allocating the worker buffer failed\n", __func__);
+        free_worker(w);
+        return -1;
+    }
+
+    // signals go to the main thread, which exits the session
+    sigset_t oldset, newset;
+    sigemptyset(&newset);
+    sigaddset(&newset, SIGTERM);
+    sigaddset(&newset, SIGINT);
+    sigaddset(&newset, SIGHUP);
+    sigaddset(&newset, SIGQUIT);
+    pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+    int res = pthread_create(&w->thread, NULL, worker_thread, w);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (res) {
+        USYSLOG(LOG_ERR, "%s: creating a worker failed: %s\n",
+                __func__, strerror(res));
+        free_worker(w);
+        return -1;
+    }
+
+#ifdef __linux__
+    if (uopt.pin_threads) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (ncpus > 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET((int)(session.next_cpu++ % ncpus), &set);
+            pthread_setaffinity_np(w->thread, sizeof(set), &set);
+        }
+    }
+#endif
+
+    list_add_worker(w, &session.main);
+    session.numavail++;
+    session.numworker++;
+
+    return 0;
+}
+
+static int session_loop(struct fuse *fuse) {
+    session.se = fuse_get_session(fuse);
+    session.ch = fuse_session_next_chan(session.se, NULL);
+    session.main.thread = pthread_self();
+    session.main.prev = session.main.next = &session.main;
+    sem_init(&session.finish, 0, 0);
+    pthread_mutex_init(&session.lock, NULL);
+
+    pthread_mutex_lock(&session.lock);
+    int res = start_thread();
+    pthread_mutex_unlock(&session.lock);
+
+    if (res == 0) {
+        // woken up by a worker or interrupted by the signal handler
+        while (!fuse_session_exited(session.se))
+            sem_wait(&session.finish);
+
+        pthread_mutex_lock(&session.lock);
+        struct worker *w;
+        for (w = session.main.next; w != &session.main; w = w->next)
+            pthread_cancel(w->thread);
+        pthread_mutex_unlock(&session.lock);
+
+        while (session.main.next != &session.main) {
+            w = session.main.next;
+            pthread_join(w->thread, NULL);
+            list_del_worker(w);
+            free_worker(w);
+        }
+
+        res = session.error;
+    }
+
+    pthread_mutex_destroy(&session.lock);
+    sem_destroy(&session.finish);
+
+    return res;
+}
+
+/**
+ * Replacement of fuse_main(), used with any of the worker pool options
+ */
+int session_main(int argc, char *argv[]) {
+    char *mountpoint;
+    int multithreaded;
+
+    struct fuse *fuse = fuse_setup(argc, argv, &ulakefs_oper, sizeof(ulakefs_oper),
+                                   &mountpoint, &multithreaded, NULL);
+    if (!fuse) return 1;
+
+    int res;
+    if (multithreaded)
+        res = session_loop(fuse);
+    else
+        res = fuse_loop(fuse);
+
+    fuse_teardown(fuse, mountpoint);
+
+    return res == -1 ? 1 : 0;
+}
+
+void session_stats(FILE *f) {
+    if (!session.se) return;
+
+    pthread_mutex_lock(&session.lock);
+    fprintf(f, "session_workers %d\n", session.numworker);
+    fprintf(f, "session_idle %d\n", session.numavail);
+    pthread_mutex_unlock(&session.lock);
+}
@@ -0,0 +1,13 @@
+//
+// Multithreaded fuse session loop with a configurable worker pool
+//
+
+#ifndef ULAKEFS_FUSE_SESSION_H
+#define ULAKEFS_FUSE_SESSION_H
+
+#include <stdio.h>
+
+int session_main(int argc, char *argv[]);
+void session_stats(FILE *f);
+
+#endif //ULAKEFS_FUSE_SESSION_H
@@ -0,0 +1,370 @@
+//
+// statfs() of the union, optionally served from a background snapshot
+//
+/*
+ * The device of every branch is looked up once, branches on the same
+ * device as an earlier branch or in the same mirror group are not counted
+ * twice. Which branches count is worked out once per branch snapshot, a
+ * statfs() only sums up.
+ *
+ * With -o statfs_interval=secs every distinct device has its own refresher
+ * thread, which queries the branch in this interval, and statfs() only sums
+ * up the latest answers. A hanging branch therefore only blocks its own
+ * thread. Branches added at runtime get their thread on first use. A
+ * branch without an answer for -o statfs_timeout seconds is stale, it is
+ * left out of the sums and listed in .ulakefs.ctl/stats.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#ifdef linux
+#include <sys/vfs.h>
+#endif
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "branches.h"
+#include "statfs.h"
+
+struct branch_statfs {
+    struct statvfs st;	// last answer of the branch
+    time_t updated;	// CLOCK_MONOTONIC seconds of the last answer, 0 = never
+    time_t started;	// CLOCK_MONOTONIC seconds the refresher started, 0 = none
+    bool stale;
+};
+
+static pthread_mutex_t statfs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct branch_statfs *snapshot;	// per branch id, NULL without statfs_interval
+static dev_t devs[BRANCHES_MAX];	// device of the branch id, (dev_t)-1 if unknown
+static int dev_known[BRANCHES_MAX];
+static const branch_set_t *first_set;	// the snapshot firsts[] belongs to
+static int firsts[BRANCHES_MAX];	// dev_first() per position of first_set
+
+/**
+ * Wrapper function to convert the result of statfs() to statvfs()
+ * libfuse uses statvfs, since it conforms to POSIX. Unfortunately,
+ * glibc's statvfs parses /proc/mounts, which then results in reading
+ * the filesystem itself again - which would result in a deadlock.
+ */
+static int statvfs_local(const char *path, struct statvfs *stbuf) {
+#ifdef linux
+    /* glibc's statvfs walks /proc/mounts and stats entries found there
+     * in order to extract their mount flags, which may deadlock if they
+     * are mounted under the ulakefs. As a result, we have to do this
+     * ourselves.
+     */
+    struct statfs stfs;
+    int res = statfs(path, &stfs);
+    if (res == -1) RETURN(res);
+
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->f_bsize = stfs.f_bsize;
+    if (stfs.f_frsize) {
+        stbuf->f_frsize = stfs.f_frsize;
+    } else {
+        stbuf->f_frsize = stfs.f_bsize;
+    }
+    stbuf->f_blocks = stfs.f_blocks;
+    stbuf->f_bfree = stfs.f_bfree;
+    stbuf->f_bavail = stfs.f_bavail;
+    stbuf->f_files = stfs.f_files;
+    stbuf->f_ffree = stfs.f_ffree;
+    stbuf->f_favail = stfs.f_ffree; /* nobody knows */
+
+    /* We don't worry about flags, exactly because this would
+     * require reading /proc/mounts, and avoiding that and the
+     * resulting deadlocks is exactly what we're trying to avoid
+     * by doing this rather than using statvfs.
+     */
+    stbuf->f_flag = 0;
+    stbuf->f_namemax = stfs.f_namelen;
+
+    RETURN(0);
+#else
+    RETURN(statvfs(path, stbuf));
+#endif
+}
+
+static time_t now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * Device of branch i
+ */
+static dev_t branch_dev(int i) {
+    int id = BRANCHES[i].id;
+    if (__sync_fetch_and_add(&dev_known[id], 0)) return devs[id];
+
+    struct stat st;
+    if (fstat(BRANCHES[i].fd, &st) == -1) {
+        USYSLOG(LOG_WARNING, "%s: stat of branch %s failed: %s\n",
+                __func__, BRANCHES[i].path, strerror(errno));
+        st.st_dev = (dev_t)-1;
+    }
+
+    devs[id] = st.st_dev;
+    __sync_lock_test_and_set(&dev_known[id], 1);
+
+    return st.st_dev;
+}
+
+/**
+ * First branch on the same device as branch i or in its mirror group,
+ * statfs_lock MUST be held. Computed for all branches once the calling
+ * thread works on another snapshot than the last caller.
+ */
+static int dev_first_locked(int i) {
+    if (first_set == BRANCH_SET()) return firsts[i];
+
+    int k;
+    for (k = 0; k < NBRANCHES; k++) {
+        dev_t dev = branch_dev(k);
+
+        int j;
+        for (j = 0; j < k; j++) {
+            // members of a mirror group hold the same data
+            if ((dev != (dev_t)-1 && branch_dev(j) == dev)
+                || (BRANCHES[k].mirror && BRANCHES[j].mirror == BRANCHES[k].mirror)) break;
+        }
+        firsts[k] = j;
+    }
+    first_set = BRANCH_SET();
+
+    return firsts[i];
+}
+
+static int dev_first(int i) {
+    pthread_mutex_lock(&statfs_lock);
+    int first = dev_first_locked(i);
+    pthread_mutex_unlock(&statfs_lock);
+
+    return first;
+}
+
+/**
+ * Refresh the snapshot of one branch in the background, ends once the
+ * branch was removed
+ */
+static void *refresh_thread(void *arg) {
+    int id = (int)(intptr_t)arg;
+    struct branch_statfs *b = &snapshot[id];
+
+    while (1) {
+        branches_enter(NULL);
+        int i = branches_index(id);
+        if (i < 0) break;
+
+        struct statvfs st;
+        int res = statvfs_local(BRANCHES[i].path, &st);
+        int err = errno;
+
+        pthread_mutex_lock(&statfs_lock);
+        if (res == 0) {
+            b->st = st;
+            b->updated = now_sec();
+            if (b->stale) {
+                b->stale = false;
+                USYSLOG(LOG_INFO, "statfs of branch %s answers again\n",
+                        BRANCHES[i].path);
+            }
+        } else {
+            DBG("statfs of %s failed: %s\n", BRANCHES[i].path, strerror(err));
+        }
+        pthread_mutex_unlock(&statfs_lock);
+
+        sleep(uopt.statfs_interval);
+    }
+
+    pthread_mutex_lock(&statfs_lock);
+    b->started = 0;
+    b->updated = 0;
+    pthread_mutex_unlock(&statfs_lock);
+
+    return NULL;
+}
+
+/**
+ * Start the refresher of branch id, statfs_lock MUST be held
+ */
+static int refresher_start(int id) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thread;
+    int res = pthread_create(&thread, &attr, refresh_thread, (void *)(intptr_t)id);
+    pthread_attr_destroy(&attr);
+
+    if (res == 0) snapshot[id].started = now_sec();
+
+    return res;
+}
+
+/**
+ * Start the refresher threads, called from ulakefs_init()
+ */
+int statfs_init(void) {
+    if (!uopt.statfs_interval) RETURN(0);
+
+    if (!uopt.statfs_timeout) uopt.statfs_timeout = 3 * uopt.statfs_interval;
+
+    snapshot = calloc(BRANCHES_MAX, sizeof(struct branch_statfs));
+    if (!snapshot) RETURN(-ENOMEM);
+
+    int i, res = 0;
+    pthread_mutex_lock(&statfs_lock);
+    for (i = 0; i < NBRANCHES && !res; i++) {
+        if (dev_first_locked(i) == i) res = refresher_start(BRANCHES[i].id);
+    }
+    pthread_mutex_unlock(&statfs_lock);
+
+    if (res) {
+        // some threads might run already, keep them but answer live
+        uopt.statfs_interval = 0;
+        RETURN(-res);
+    }
+
+    RETURN(0);
+}
+
+/**
+ * statvfs of branch i, from the snapshot if there is one.
+ * Returns 1 if the branch is stale or has not answered yet.
+ */
+static int branch_statvfs(int i, struct statvfs *st) {
+    if (!uopt.statfs_interval) return statvfs_local(BRANCHES[i].path, st);
+
+    pthread_mutex_lock(&statfs_lock);
+
+    struct branch_statfs *b = &snapshot[BRANCHES[i].id];
+    if (!b->started && refresher_start(BRANCHES[i].id)) {
+        pthread_mutex_unlock(&statfs_lock);
+        return statvfs_local(BRANCHES[i].path, st);
+    }
+    time_t last = b->updated ? b->updated : b->started;
+
+    if (now_sec() - last > (time_t)uopt.statfs_timeout) {
+        if (!b->stale) {
+            b->stale = true;
+            USYSLOG(LOG_WARNING, "statfs of branch %s did not answer for %u s\n",
+                    BRANCHES[i].path, uopt.statfs_timeout);
+        }
+        pthread_mutex_unlock(&statfs_lock);
+        return 1;
+    }
+
+    if (!b->updated) {
+        // the first answer is still pending
+        pthread_mutex_unlock(&statfs_lock);
+        return 1;
+    }
+
+    *st = b->st;
+    pthread_mutex_unlock(&statfs_lock);
+
+    return 0;
+}
+
+/**
+ * statvfs of a single branch for the create policies, 0 on success
+ */
+int statfs_branch(int branch, struct statvfs *st) {
+    // only the first branch of a device has a snapshot
+    return branch_statvfs(dev_first(branch), st);
+}
+
+/**
+ * Convert a number of frsize blocks into base blocks without floating point
+ */
+static fsblkcnt_t normalize(fsblkcnt_t blocks, unsigned long frsize, unsigned long base) {
+    if (frsize == base) return blocks;
+    if (frsize > base && frsize % base == 0) return blocks * (frsize / base);
+    if (base > frsize && base % frsize == 0) return blocks / (base / frsize);
+
+    return blocks / base * frsize + blocks % base * frsize / base;
+}
+
+/**
+ * statvfs of the union
+ *
+ * Note: We do not set the fsid, as fuse ignores it anyway.
+ */
+int statfs_get(struct statvfs *stbuf) {
+    bool first = true;
+
+    int i, first_of[BRANCHES_MAX];
+    pthread_mutex_lock(&statfs_lock);
+    dev_first_locked(0);
+    memcpy(first_of, firsts, NBRANCHES * sizeof(int));
+    pthread_mutex_unlock(&statfs_lock);
+
+    for (i = 0; i < NBRANCHES; i++) {
+        // Eliminate same devices
+        if (first_of[i] != i) continue;
+
+        struct statvfs stb;
+        int res = branch_statvfs(i, &stb);
+        if (res == -1) RETURN(-errno);
+        if (res == 1) continue; // stale
+
+        if (first) {
+            memcpy(stbuf, &stb, sizeof(*stbuf));
+            first = false;
+            stbuf->f_fsid = stb.f_fsid << 8;
+            continue;
+        }
+
+        // Filesystem can have different block sizes -> normalize to first's block size
+        unsigned long frsize = stb.f_frsize, base = stbuf->f_frsize;
+
+        if (BRANCHES[i].rw) {
+            stbuf->f_blocks += normalize(stb.f_blocks, frsize, base);
+            stbuf->f_bfree += normalize(stb.f_bfree, frsize, base);
+            stbuf->f_bavail += normalize(stb.f_bavail, frsize, base);
+
+            stbuf->f_files += stb.f_files;
+            stbuf->f_ffree += stb.f_ffree;
+            stbuf->f_favail += stb.f_favail;
+        } else if (!uopt.statfs_omit_ro) {
+            // omitting the RO branches is not correct regarding
+            // the block counts but it actually fixes the
+            // percentage of free space. so, let the user decide.
+            stbuf->f_blocks += normalize(stb.f_blocks, frsize, base);
+            stbuf->f_files  += stb.f_files;
+        }
+
+        if (!(stb.f_flag & ST_RDONLY)) stbuf->f_flag &= ~ST_RDONLY;
+        if (!(stb.f_flag & ST_NOSUID)) stbuf->f_flag &= ~ST_NOSUID;
+
+        if (stb.f_namemax < stbuf->f_namemax) stbuf->f_namemax = stb.f_namemax;
+    }
+
+    // no branch answered yet
+    if (first) RETURN(-EAGAIN);
+
+    RETURN(0);
+}
+
+void statfs_stats(FILE *f) {
+    if (!snapshot) return;
+
+    pthread_mutex_lock(&statfs_lock);
+    int i;
+    for (i = 0; i < NBRANCHES; i++) {
+        if (snapshot[BRANCHES[i].id].stale) fprintf(f, "statfs_stale %s\n", BRANCHES[i].path);
+    }
+    pthread_mutex_unlock(&statfs_lock);
+}
@@ -0,0 +1,16 @@
+//
+// statfs() of the union, optionally served from a background snapshot
+//
+
+#ifndef ULAKEFS_FUSE_STATFS_H
+#define ULAKEFS_FUSE_STATFS_H
+
+#include <stdio.h>
+#include <sys/statvfs.h>
+
+int statfs_init(void);
+int statfs_get(struct statvfs *stbuf);
+int statfs_branch(int branch, struct statvfs *st);
+void statfs_stats(FILE *f);
+
+#endif //ULAKEFS_FUSE_STATFS_H
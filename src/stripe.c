@@ -0,0 +1,570 @@
+//
+// Striping of large files across rw-branches
+//
+/*
+ * Files below -o stripe_prefix=/a:/b are split into chunks of
+ * -o stripe_chunk bytes, which go round-robin to all rw-branches. Chunk c
+ * is stored on member c % n at offset (c / n) * chunk. Member 0 is the
+ * union file itself on the branch it was created on (the head), the other
+ * members are <branch>/.ulakefs/<path>_STRIPE~.
+ *
+ * A file is created as an ordinary file and striped only when a write
+ * through the mount first reaches beyond its first chunk. Chunk 0 is the
+ * start of the head in both layouts, so no data has to be moved. A file
+ * which already is larger than one chunk at that point, e.g. extended by
+ * truncate() of its path, stays an ordinary file.
+ *
+ * The manifest <head>/.ulakefs/<path>_LAYOUT~ holds the chunk size and the
+ * paths of the member branches, so branches may be reordered between
+ * mounts. Owner, mode and times are those of the head. The size of the
+ * union file follows from the sizes of the members.
+ *
+ * A request is split at chunk boundaries and every part goes to its member.
+ * As fuse requests are at most max_read/max_write bytes, the parallelism
+ * comes from concurrent requests of the multithreaded loop hitting
+ * different members.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "branches.h"
+#include "general.h"
+#include "policy.h"
+#include "syncgroup.h"
+#include "stripe.h"
+
+#define STRIPE_MAX 32	// members of a file
+
+struct stripe {
+    off_t chunk;
+    int n;
+    int branch[STRIPE_MAX];
+    int fd[STRIPE_MAX];	// fd[0] is the fd of the open file, -1 for missing members
+};
+
+static char **prefixes;
+static int nprefixes;
+
+// serializes the striping of growing files
+static pthread_mutex_t grow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long st_created, st_opened;
+
+/**
+ * Parse the colon separated list of -o stripe_prefix=/a:/b
+ */
+int stripe_add_prefixes(const char *arg) {
+    char *buf = strdup(arg);
+    if (!buf) return -1;
+
+    char *ptr = buf;
+    char *prefix;
+    while ((prefix = strsep(&ptr, ROOT_SEP)) != NULL) {
+        size_t len = strlen(prefix);
+        while (len > 1 && prefix[len - 1] == '/') prefix[--len] = '\0';
+
+        if (prefix[0] != '/') {
+            fprintf(stderr, "stripe_prefix %s is not absolute\n", prefix);
+            free(buf);
+            return -1;
+        }
+
+        char **p = realloc(prefixes, (nprefixes + 1) * sizeof(char *));
+        if (!p) {
+            free(buf);
+            return -1;
+        }
+        prefixes = p;
+        prefixes[nprefixes++] = strdup(prefix);
+    }
+
+    free(buf);
+    return 0;
+}
+
+/**
+ * Check if path is below one of the configured prefixes
+ */
+bool stripe_path(const char *path) {
+    int i;
+    for (i = 0; i < nprefixes; i++) {
+        size_t len = strlen(prefixes[i]);
+
+        if (len == 1) return true; // "/"
+        if (strncmp(path, prefixes[i], len) == 0 && path[len] == '/') return true;
+    }
+
+    return false;
+}
+
+static int meta_path(char *p, int branch, const char *path, const char *tag) {
+    if (BUILD_PATH(p, BRANCHES[branch].path, METADIR, path)) return -1;
+    if (strlen(p) + strlen(tag) >= PATHLEN_MAX) return -1;
+    strcat(p, tag);
+
+    return 0;
+}
+
+/**
+ * Path of member m of s
+ */
+static int member_path(char *p, const struct stripe *s, int m, const char *path) {
+    if (m == 0) return BUILD_PATH(p, BRANCHES[s->branch[0]].path, path) ? -1 : 0;
+
+    return meta_path(p, s->branch[m], path, STRIPETAG);
+}
+
+/**
+ * Read the manifest of path on branch. Returns 1 if path is striped, 0 if
+ * not and -errno if the manifest cannot be used.
+ */
+static int layout_load(const char *path, int branch, struct stripe *s) {
+    if (!stripe_path(path)) return 0;
+
+    char p[PATHLEN_MAX];
+    if (meta_path(p, branch, path, LAYOUTTAG)) return -ENAMETOOLONG;
+
+    FILE *f = fopen(p, "r");
+    if (!f) return errno == ENOENT ? 0 : -errno;
+
+    memset(s, 0, sizeof(*s));
+
+    char line[PATHLEN_MAX + 16];
+    int res = 1;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+
+        if (strncmp(line, "chunk_size ", 11) == 0) {
+            s->chunk = strtoll(line + 11, NULL, 10);
+        } else if (strncmp(line, "branch ", 7) == 0) {
+            int i;
+            for (i = 0; i < NBRANCHES; i++) {
+                if (strcmp(BRANCHES[i].path, line + 7) == 0) break;
+            }
+            if (i == NBRANCHES || s->n == STRIPE_MAX) {
+                USYSLOG(LOG_ERR, "%s: member branch %s of %s is not mounted\n",
+                        __func__, line + 7, path);
+                res = -EIO;
+                break;
+            }
+            s->branch[s->n++] = i;
+        }
+    }
+    fclose(f);
+
+    if (res == 1 && (s->chunk <= 0 || s->n == 0 || s->branch[0] != branch)) {
+        USYSLOG(LOG_ERR, "%s: broken manifest %s\n", __func__, p);
+        res = -EIO;
+    }
+
+    return res;
+}
+
+bool stripe_striped(const char *path, int branch) {
+    struct stripe s;
+    return layout_load(path, branch, &s) != 0;
+}
+
+/**
+ * Make the file path on branch striped. Returns 1 if it is striped, 0 if
+ * there are not enough rw-branches and -1 on errors.
+ */
+static int stripe_create(const char *path, int branch) {
+    struct stripe s;
+    memset(&s, 0, sizeof(s));
+    s.chunk = uopt.stripe_chunk;
+    s.branch[s.n++] = branch;
+
+    int i;
+    for (i = 0; i < NBRANCHES && s.n < STRIPE_MAX; i++) {
+        if (BRANCHES[i].rw && i != branch) s.branch[s.n++] = i;
+    }
+    if (s.n < 2) return 0; // nothing to stripe across
+
+    char p[PATHLEN_MAX];
+    int m;
+    for (m = 1; m < s.n; m++) {
+        if (member_path(p, &s, m, path) || meta_mkdirs(p, &BRANCHES[s.branch[m]])) goto err;
+
+        int fd = open(p, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd == -1) goto err;
+        close(fd);
+    }
+
+    if (meta_path(p, branch, path, LAYOUTTAG) || meta_mkdirs(p, &BRANCHES[branch])) goto err;
+
+    FILE *f = fopen(p, "w");
+    if (!f) goto err;
+    fprintf(f, "chunk_size %lld\n", (long long)s.chunk);
+    for (m = 0; m < s.n; m++) fprintf(f, "branch %s\n", BRANCHES[s.branch[m]].path);
+    if (fclose(f)) goto err;
+
+    __sync_fetch_and_add(&st_created, 1);
+    return 1;
+
+    err:
+    USYSLOG(LOG_WARNING, "%s: %s stays unstriped: %s\n", __func__, path, strerror(errno));
+    for (m = 1; m < s.n; m++) {
+        if (member_path(p, &s, m, path) == 0) unlink(p);
+    }
+    return -1;
+}
+
+/**
+ * Open the other members of path if it is striped, uf->fd is the open head.
+ * Returns 1 if it is striped, 0 if not and -errno on errors.
+ */
+int stripe_open(const char *path, int flags, ufile_t *uf) {
+    struct stripe s;
+    int res = layout_load(path, uf->branch, &s);
+    if (res <= 0) return res;
+
+    // O_APPEND would make pwrite() ignore the offset of the member
+    if (flags & O_APPEND) {
+        int fl = fcntl(uf->fd, F_GETFL);
+        if (fl != -1) fcntl(uf->fd, F_SETFL, fl & ~O_APPEND);
+    }
+
+    int mflags = flags & (O_ACCMODE | O_TRUNC);
+    if ((flags & O_ACCMODE) != O_RDONLY) mflags |= O_CREAT;
+
+    s.fd[0] = uf->fd;
+    int m;
+    for (m = 1; m < s.n; m++) {
+        char p[PATHLEN_MAX];
+        if (member_path(p, &s, m, path)) {
+            res = -ENAMETOOLONG;
+            goto err;
+        }
+
+        s.fd[m] = open(p, mflags, S_IRUSR | S_IWUSR);
+        if (s.fd[m] == -1 && (errno != ENOENT || (flags & O_ACCMODE) != O_RDONLY)) {
+            res = -errno;
+            goto err;
+        }
+    }
+
+    uf->stripe = malloc(sizeof(s));
+    if (!uf->stripe) {
+        res = -ENOMEM;
+        goto err;
+    }
+    memcpy(uf->stripe, &s, sizeof(s));
+
+    __sync_fetch_and_add(&st_opened, 1);
+    return 1;
+
+    err:
+    while (--m > 0) {
+        if (s.fd[m] != -1) close(s.fd[m]);
+    }
+    return res;
+}
+
+/**
+ * Called before an access of the not yet striped file path through uf
+ * (uf->stripe_pending) reaches end. Once end is beyond the first chunk,
+ * the members of path are opened if another open striped it already.
+ * Otherwise a write (create) stripes the file if it is not larger than
+ * one chunk yet. Returns 0 or -errno.
+ */
+int stripe_grow(const char *path, ufile_t *uf, off_t end, bool create) {
+    if (!uf->stripe_pending || end <= uopt.stripe_chunk) return 0;
+
+    pthread_mutex_lock(&grow_lock);
+
+    struct stripe s;
+    bool created = false;
+    int res = layout_load(path, uf->branch, &s);
+    if (res == 0) {
+        struct stat st;
+        if (fstat(uf->fd, &st) == -1) {
+            res = -errno;
+        } else if (st.st_size > uopt.stripe_chunk) {
+            uf->stripe_pending = false; // stays an ordinary file
+        } else if (create) {
+            created = stripe_create(path, uf->branch) == 1;
+            if (created) res = 1; else uf->stripe_pending = false;
+        }
+    }
+
+    if (res == 1) {
+        int flags = fcntl(uf->fd, F_GETFL);
+        res = flags == -1 ? -errno : stripe_open(path, flags, uf);
+
+        // the file as it was is still complete in the head
+        if (res < 0 && created) stripe_unlink(path, uf->branch);
+        if (res == 1) {
+            uf->stripe_pending = false;
+            res = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&grow_lock);
+    return res;
+}
+
+/**
+ * Size of the union file from the sizes of the members
+ */
+static off_t logical_size(const struct stripe *s, const struct stat *st) {
+    off_t size = 0;
+
+    int m;
+    for (m = 0; m < s->n; m++) {
+        if (st[m].st_size <= 0) continue;
+
+        off_t local = (st[m].st_size - 1) / s->chunk;
+        off_t end = (local * s->n + m) * s->chunk + (st[m].st_size - 1) % s->chunk + 1;
+        if (end > size) size = end;
+    }
+
+    return size;
+}
+
+/**
+ * Size of member m if the union file has size bytes
+ */
+static off_t member_size(const struct stripe *s, int m, off_t size) {
+    off_t chunks = (size + s->chunk - 1) / s->chunk;
+    if (m >= chunks) return 0;
+
+    off_t local = (chunks - 1 - m) / s->n + 1; // chunks of member m
+    off_t last = (local - 1) * s->n + m;	// its last chunk
+
+    if (last == chunks - 1) return (local - 1) * s->chunk + (size - last * s->chunk);
+    return local * s->chunk;
+}
+
+static int stripe_fstat(const struct stripe *s, struct stat *st) {
+    int m;
+    for (m = 0; m < s->n; m++) {
+        if (s->fd[m] == -1) {
+            memset(&st[m], 0, sizeof(st[m]));
+        } else if (fstat(s->fd[m], &st[m]) == -1) {
+            return -errno;
+        }
+    }
+
+    return 0;
+}
+
+ssize_t stripe_pread(ufile_t *uf, char *buf, size_t size, off_t offset) {
+    struct stripe *s = uf->stripe;
+    off_t lsize = -1; // only needed for holes
+    size_t done = 0;
+
+    while (done < size) {
+        off_t off = offset + done;
+        off_t c = off / s->chunk;
+        off_t in = off % s->chunk;
+        int m = c % s->n;
+        size_t len = s->chunk - in;
+        if (len > size - done) len = size - done;
+
+        ssize_t res = 0;
+        if (s->fd[m] != -1) {
+            res = pread(s->fd[m], buf + done, len, (c / s->n) * s->chunk + in);
+            if (res == -1) return done ? (ssize_t)done : -1;
+        }
+        done += res;
+        if ((size_t)res == len) continue;
+
+        // the member ends here, this is a hole or the end of the file
+        if (lsize == -1) {
+            struct stat st[STRIPE_MAX];
+            int err = stripe_fstat(s, st);
+            if (err) {
+                errno = -err;
+                return done ? (ssize_t)done : -1;
+            }
+            lsize = logical_size(s, st);
+        }
+        if (offset + (off_t)done >= lsize) break;
+
+        size_t hole = len - res;
+        if ((off_t)(offset + done + hole) > lsize) hole = lsize - offset - done;
+        memset(buf + done, 0, hole);
+        done += hole;
+    }
+
+    return done;
+}
+
+ssize_t stripe_pwrite(ufile_t *uf, const char *buf, size_t size, off_t offset) {
+    struct stripe *s = uf->stripe;
+    size_t done = 0;
+
+    while (done < size) {
+        off_t off = offset + done;
+        off_t c = off / s->chunk;
+        off_t in = off % s->chunk;
+        int m = c % s->n;
+        size_t len = s->chunk - in;
+        if (len > size - done) len = size - done;
+
+        ssize_t res = pwrite(s->fd[m], buf + done, len, (c / s->n) * s->chunk + in);
+        if (res == -1) return done ? (ssize_t)done : -1;
+
+        policy_written(s->branch[m], res);
+        done += res;
+        if ((size_t)res < len) break;
+    }
+
+    return done;
+}
+
+/**
+ * Replace size and blocks of st, the lstat() of the head of path on
+ * branch, if path is striped
+ */
+int stripe_getattr(const char *path, int branch, struct stat *st) {
+    struct stripe s;
+    int res = layout_load(path, branch, &s);
+    if (res <= 0 || !S_ISREG(st->st_mode)) return res < 0 ? res : 0;
+
+    struct stat mst[STRIPE_MAX];
+    mst[0] = *st;
+
+    int m;
+    for (m = 1; m < s.n; m++) {
+        char p[PATHLEN_MAX];
+        if (member_path(p, &s, m, path)) return -ENAMETOOLONG;
+        if (stat(p, &mst[m]) == -1) {
+            if (errno != ENOENT) return -errno;
+            memset(&mst[m], 0, sizeof(mst[m]));
+        }
+        st->st_blocks += mst[m].st_blocks;
+    }
+    st->st_size = logical_size(&s, mst);
+
+    return 0;
+}
+
+int stripe_fgetattr(ufile_t *uf, struct stat *st) {
+    struct stat mst[STRIPE_MAX];
+    int res = stripe_fstat(uf->stripe, mst);
+    if (res) return res;
+
+    *st = mst[0];
+    int m;
+    for (m = 1; m < uf->stripe->n; m++) st->st_blocks += mst[m].st_blocks;
+    st->st_size = logical_size(uf->stripe, mst);
+
+    return 0;
+}
+
+static int truncate_members(const struct stripe *s, const char *path, off_t size) {
+    int m;
+    for (m = 0; m < s->n; m++) {
+        int res;
+        if (path) {
+            char p[PATHLEN_MAX];
+            if (member_path(p, s, m, path)) return -ENAMETOOLONG;
+            res = truncate(p, member_size(s, m, size));
+        } else {
+            if (s->fd[m] == -1) continue;
+            res = ftruncate(s->fd[m], member_size(s, m, size));
+        }
+        if (res == -1) return -errno;
+    }
+
+    return 0;
+}
+
+/**
+ * truncate() of a striped file, returns 1 if path is not striped
+ */
+int stripe_truncate(const char *path, int branch, off_t size) {
+    struct stripe s;
+    int res = layout_load(path, branch, &s);
+    if (res <= 0) return res < 0 ? res : 1;
+
+    return truncate_members(&s, path, size);
+}
+
+int stripe_ftruncate(ufile_t *uf, off_t size) {
+    return truncate_members(uf->stripe, NULL, size);
+}
+
+int stripe_fsync(ufile_t *uf, int isdatasync) {
+    struct stripe *s = uf->stripe;
+
+    int m;
+    for (m = 0; m < s->n; m++) {
+        if (s->fd[m] == -1) continue;
+        if (syncgroup_fsync(s->branch[m], s->fd[m], isdatasync) == -1) return -errno;
+    }
+
+    return 0;
+}
+
+/**
+ * Remove the members and the manifest after the head of path was unlinked
+ */
+void stripe_unlink(const char *path, int branch) {
+    struct stripe s;
+    if (layout_load(path, branch, &s) != 1) return;
+
+    char p[PATHLEN_MAX];
+    int m;
+    for (m = 1; m < s.n; m++) {
+        if (member_path(p, &s, m, path) == 0) unlink(p);
+    }
+    if (meta_path(p, branch, path, LAYOUTTAG) == 0) unlink(p);
+}
+
+/**
+ * Move the members and the manifest along with the head, which was renamed
+ * from from to to on branch
+ */
+int stripe_rename(const char *from, const char *to, int branch) {
+    struct stripe s;
+    int res = layout_load(from, branch, &s);
+    if (res <= 0) return res;
+
+    char f[PATHLEN_MAX], t[PATHLEN_MAX];
+    int m;
+    for (m = 1; m < s.n; m++) {
+        if (member_path(f, &s, m, from) || member_path(t, &s, m, to)) return -ENAMETOOLONG;
+        if (meta_mkdirs(t, &BRANCHES[s.branch[m]]) || (rename(f, t) == -1 && errno != ENOENT))
+            return -errno;
+    }
+
+    if (meta_path(f, branch, from, LAYOUTTAG) || meta_path(t, branch, to, LAYOUTTAG))
+        return -ENAMETOOLONG;
+    if (meta_mkdirs(t, &BRANCHES[branch]) || rename(f, t) == -1) return -errno;
+
+    return 0;
+}
+
+/**
+ * Close the members, the head is closed by the caller
+ */
+void stripe_release(ufile_t *uf) {
+    if (!uf->stripe) return;
+
+    int m;
+    for (m = 1; m < uf->stripe->n; m++) {
+        if (uf->stripe->fd[m] != -1) close(uf->stripe->fd[m]);
+    }
+    free(uf->stripe);
+    uf->stripe = NULL;
+}
+
+void stripe_stats(FILE *f) {
+    if (!nprefixes) return;
+
+    fprintf(f, "stripe_created %lu\n", st_created);
+    fprintf(f, "stripe_opened %lu\n", st_opened);
+}
@@ -0,0 +1,31 @@
+//
+// Striping of large files across rw-branches
+//
+
+#ifndef ULAKEFS_FUSE_STRIPE_H
+#define ULAKEFS_FUSE_STRIPE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "Ulakefs.h"
+
+int stripe_add_prefixes(const char *arg);
+bool stripe_path(const char *path);
+bool stripe_striped(const char *path, int branch);
+int stripe_open(const char *path, int flags, ufile_t *uf);
+int stripe_grow(const char *path, ufile_t *uf, off_t end, bool create);
+ssize_t stripe_pread(ufile_t *uf, char *buf, size_t size, off_t offset);
+ssize_t stripe_pwrite(ufile_t *uf, const char *buf, size_t size, off_t offset);
+int stripe_getattr(const char *path, int branch, struct stat *st);
+int stripe_fgetattr(ufile_t *uf, struct stat *st);
+int stripe_truncate(const char *path, int branch, off_t size);
+int stripe_ftruncate(ufile_t *uf, off_t size);
+int stripe_fsync(ufile_t *uf, int isdatasync);
+void stripe_unlink(const char *path, int branch);
+int stripe_rename(const char *from, const char *to, int branch);
+void stripe_release(ufile_t *uf);
+void stripe_stats(FILE *f);
+
+#endif //ULAKEFS_FUSE_STRIPE_H
@@ -0,0 +1,129 @@
+//
+// Group commit of concurrent fsync() calls per branch
+//
+/*
+ * Each fsync() of a small file costs a journal commit. With -o fsync_group
+ * the first fsync() on a branch becomes the leader of a batch: it waits for
+ * the window to collect more fsync() calls on the same branch and then
+ * flushes the whole branch filesystem with a single syncfs(). Afterwards
+ * every caller still runs fsync()/fdatasync() on its own fd. That is cheap
+ * now as nothing is dirty anymore, but it keeps the durability guarantee
+ * and the error reporting of the file.
+ */
+#define _GNU_SOURCE // syncfs()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "branches.h"
+#include "syncgroup.h"
+
+struct syncgroup {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned long batch;	// the batch new fsync() calls join
+    unsigned long synced;	// last batch flushed by syncfs()
+    bool leader;		// somebody collects batch
+    bool broken;		// syncfs() failed, sync files one by one
+};
+
+static struct syncgroup *groups; // one per branch id, NULL if disabled
+
+static unsigned long st_fsyncs, st_batches;
+
+/**
+ * Allocate the per branch state, called from ulakefs_init()
+ */
+int syncgroup_init(void) {
+    if (!uopt.fsync_group) RETURN(0);
+
+    groups = calloc(BRANCHES_MAX, sizeof(struct syncgroup));
+    if (!groups) {
+        uopt.fsync_group = 0;
+        RETURN(-ENOMEM);
+    }
+
+    int i;
+    for (i = 0; i < BRANCHES_MAX; i++) {
+        pthread_mutex_init(&groups[i].lock, NULL);
+        pthread_cond_init(&groups[i].cond, NULL);
+        groups[i].batch = 1;
+    }
+
+    RETURN(0);
+}
+
+/**
+ * Wait until a syncfs() of branch started after this call has finished
+ */
+static void syncgroup_wait(struct syncgroup *g, int branch) {
+    pthread_mutex_lock(&g->lock);
+
+    unsigned long my = g->batch;
+    while (g->synced < my && !g->broken) {
+        if (g->leader) {
+            pthread_cond_wait(&g->cond, &g->lock);
+            continue;
+        }
+
+        // lead batch my, it is the open batch as there was no leader
+        g->leader = true;
+        pthread_mutex_unlock(&g->lock);
+
+        usleep(uopt.fsync_group);
+
+        pthread_mutex_lock(&g->lock);
+        g->batch++; // later calls form the next batch
+        pthread_mutex_unlock(&g->lock);
+
+        int res = syncfs(BRANCHES[branch].fd);
+        int err = errno;
+
+        pthread_mutex_lock(&g->lock);
+        if (res == -1) {
+            USYSLOG(LOG_WARNING, "%s: syncfs() of branch %s failed, "
+                                 "fsync group disabled: %s\n",
+                    __func__, BRANCHES[branch].path, strerror(err));
+            g->broken = true;
+        }
+        g->synced = my;
+        g->leader = false;
+        __sync_fetch_and_add(&st_batches, 1);
+        pthread_cond_broadcast(&g->cond);
+    }
+
+    pthread_mutex_unlock(&g->lock);
+
+    __sync_fetch_and_add(&st_fsyncs, 1);
+}
+
+/**
+ * fsync() of fd, an open file on branch
+ */
+int syncgroup_fsync(int branch, int fd, int isdatasync) {
+    if (groups && branch >= 0 && BRANCHES[branch].rw)
+        syncgroup_wait(&groups[BRANCHES[branch].id], branch);
+
+#if _POSIX_SYNCHRONIZED_IO + 0 > 0
+    if (isdatasync) return fdatasync(fd);
+#else
+    (void)isdatasync;
+#endif
+
+    return fsync(fd);
+}
+
+void syncgroup_stats(FILE *f) {
+    if (!groups) return;
+
+    fprintf(f, "fsync_group_calls %lu\n", st_fsyncs);
+    fprintf(f, "fsync_group_batches %lu\n", st_batches);
+}
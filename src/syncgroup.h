@@ -0,0 +1,17 @@
+//
+// Group commit of concurrent fsync() calls per branch
+//
+
+#ifndef ULAKEFS_FUSE_SYNCGROUP_H
+#define ULAKEFS_FUSE_SYNCGROUP_H
+
+#include <stdio.h>
+
+// window of -o fsync_group without a value, in microseconds
+#define SYNCGROUP_WINDOW 2000
+
+int syncgroup_init(void);
+int syncgroup_fsync(int branch, int fd, int isdatasync);
+void syncgroup_stats(FILE *f);
+
+#endif //ULAKEFS_FUSE_SYNCGROUP_H
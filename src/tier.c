@@ -0,0 +1,498 @@
+//
+// Promotion of hot ro-branch files to a fast rw-branch
+//
+/*
+ * With -o tier_branch=N files of read-only branches, which are read by
+ * -o tier_hits opens within TIER_WINDOW seconds, are copied in the
+ * background (by the copy-up threads, so -o copyup_threads is required)
+ * to <branch N>/.ulakefs/<path>_TIER~. Later read-only opens use this copy
+ * while its size and mtime still match the file on the slow branch. The
+ * copy is not part of the union, writes still copy up from the original.
+ *
+ * Promoted copies are kept in LRU order and the least recently opened are
+ * removed (demoted) if they exceed -o tier_size or if less than
+ * TIER_MIN_FREE_PCT of the fast branch is free. Copies of a previous
+ * mount are found again at startup and are demoted first.
+ */
+#define _GNU_SOURCE // nftw() flags
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#ifdef linux
+#include <sys/vfs.h>
+#endif
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "branches.h"
+#include "general.h"
+#include "hashtable.h"
+#include "copyup.h"
+#include "tier.h"
+
+#define TIER_WINDOW 300		// s, reads older than this do not count
+#define TIER_INTERVAL 10	// s between checks for space pressure
+#define TIER_MIN_FREE_PCT 10	// demote if less of the fast branch is free
+#define TIER_MAX_COLD 65536	// files tracked that are not promoted
+
+enum tier_state {
+    TIER_COLD,
+    TIER_COPYING,
+    TIER_PROMOTED,
+};
+
+struct tier_entry {
+    struct tier_entry *prev, *next; // cold list or LRU, none while copying
+    char *path;		// key
+    enum tier_state state;
+    unsigned int hits;	// reading opens since window
+    time_t window;	// start of the current window
+    off_t size;		// of the promoted copy
+};
+
+static pthread_mutex_t tier_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tier_cond = PTHREAD_COND_INITIALIZER; // check space now
+static struct hashtable *entries;	// union path -> struct tier_entry
+static struct tier_entry lru;		// promoted, most recently opened first
+static struct tier_entry cold;		// tracked, most recently read first
+static unsigned int ncold;
+static unsigned long long tier_bytes;	// size of all promoted copies
+static bool started;
+static branch_entry_t fast;	// -o tier_branch as mounted, it stays in use if removed later
+
+static unsigned long st_hits, st_promotions, st_demotions, st_invalid, st_failed;
+
+static time_t now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void list_del(struct tier_entry *e) {
+    if (!e->prev) return;
+
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void list_add(struct tier_entry *head, struct tier_entry *e) {
+    e->next = head->next;
+    e->prev = head;
+    head->next->prev = e;
+    head->next = e;
+}
+
+/**
+ * Path of the promoted copy of path on the fast branch
+ */
+static int tier_path(char *p, const char *path) {
+    if (BUILD_PATH(p, fast.path, METADIR, path)) return -1;
+    if (strlen(p) + strlen(TIERTAG) >= PATHLEN_MAX) return -1;
+    strcat(p, TIERTAG);
+
+    return 0;
+}
+
+/**
+ * Forget a cold entry, tier_lock MUST be held
+ */
+static void tier_forget(struct tier_entry *e) {
+    list_del(e);
+    ncold--;
+    hashtable_remove(entries, e->path); // frees path
+    free(e);
+}
+
+/**
+ * Remove the promoted copy of e, tier_lock MUST be held. Open files keep
+ * reading the unlinked copy.
+ */
+static void tier_demote(struct tier_entry *e) {
+    char p[PATHLEN_MAX];
+    if (tier_path(p, e->path) == 0 && unlink(p) == -1 && errno != ENOENT)
+        USYSLOG(LOG_WARNING, "%s: removing %s failed: %s\n", __func__, p, strerror(errno));
+
+    list_del(e);
+    tier_bytes -= e->size;
+    e->size = 0;
+    e->hits = 0;
+    e->state = TIER_COLD;
+    list_add(&cold, e);
+    ncold++;
+
+    while (ncold > TIER_MAX_COLD) tier_forget(cold.prev);
+}
+
+/**
+ * The copy of e was not made, track it as cold again, tier_lock MUST be
+ * held
+ */
+static void tier_uncopy(struct tier_entry *e) {
+    e->state = TIER_COLD;
+    e->hits = 0;
+    list_add(&cold, e);
+    ncold++;
+}
+
+/**
+ * Called by a copy-up thread once the copy to_path is done
+ */
+static void tier_done(const char *to_path, int res, void *arg) {
+    char *path = arg;
+
+    struct stat st;
+    if (res == 0 && stat(to_path, &st) == -1) res = 1;
+
+    pthread_mutex_lock(&tier_lock);
+
+    struct tier_entry *e = hashtable_search(entries, path);
+    if (res || !e || e->state != TIER_COPYING) {
+        st_failed++;
+        unlink(to_path);
+        if (e && e->state == TIER_COPYING) tier_uncopy(e);
+    } else {
+        e->state = TIER_PROMOTED;
+        e->size = st.st_size;
+        tier_bytes += st.st_size;
+        list_add(&lru, e);
+        st_promotions++;
+        pthread_cond_signal(&tier_cond);
+    }
+
+    pthread_mutex_unlock(&tier_lock);
+
+    free(path);
+}
+
+/**
+ * Queue the copy of path from branch, its entry is already TIER_COPYING.
+ * Called without tier_lock, the lstat() of the slow branch may take long.
+ * Returns 0 if the copy is queued, arg is freed by tier_done() then.
+ */
+static int tier_copy(char *arg, int branch) {
+    char from[PATHLEN_MAX], to[PATHLEN_MAX];
+    if (BUILD_PATH(from, BRANCHES[branch].path, arg)) return -1;
+    if (tier_path(to, arg)) return -1;
+
+    struct stat st;
+    if (lstat(from, &st) == -1 || !S_ISREG(st.st_mode)) return -1;
+
+    // a single file must not take the budget of all others
+    if (uopt.tier_size && (unsigned long long)st.st_size > uopt.tier_size / 2) return -1;
+
+    if (meta_mkdirs(to, &fast)) {
+        DBG("creating the directories of %s failed: %s\n", to, strerror(errno));
+        return -1;
+    }
+
+    struct cow cow;
+    memset(&cow, 0, sizeof(cow));
+    cow.uid = getuid();
+    cow.umask = uopt.umask;
+    cow.from_path = from;
+    cow.to_path = to;
+    cow.stat = &st;
+
+    return copyup_queue(&cow, tier_done, arg) ? -1 : 0;
+}
+
+/**
+ * Promote path from branch, called without tier_lock
+ */
+static void tier_promote(const char *path, int branch) {
+    char *arg = strdup(path);
+    if (arg && tier_copy(arg, branch) == 0) return;
+
+    free(arg);
+
+    pthread_mutex_lock(&tier_lock);
+    struct tier_entry *e = hashtable_search(entries, (void *)path);
+    if (e && e->state == TIER_COPYING) tier_uncopy(e);
+    pthread_mutex_unlock(&tier_lock);
+}
+
+/**
+ * Use the promoted copy of path if there is a valid one, st is the stat()
+ * of the file on uf->branch. Returns 0 and sets uf->fd on a hit, -1
+ * otherwise.
+ */
+int tier_open(const char *path, const struct stat *st, ufile_t *uf) {
+    if (!started || BRANCHES[uf->branch].rw || !S_ISREG(st->st_mode)) return -1;
+
+    pthread_mutex_lock(&tier_lock);
+
+    struct tier_entry *e = hashtable_search(entries, (void *)path);
+    if (!e || e->state != TIER_PROMOTED) {
+        pthread_mutex_unlock(&tier_lock);
+        uf->tier_hit = true;
+        return -1;
+    }
+
+    char p[PATHLEN_MAX];
+    int fd = tier_path(p, path) ? -1 : open(p, O_RDONLY);
+
+    struct stat tst;
+    if (fd == -1 || fstat(fd, &tst) == -1
+        || tst.st_size != st->st_size || tst.st_mtime != st->st_mtime) {
+        // changed on the slow branch since the promotion
+        if (fd != -1) close(fd);
+        st_invalid++;
+        tier_demote(e);
+        pthread_mutex_unlock(&tier_lock);
+        uf->tier_hit = true;
+        return -1;
+    }
+
+    list_del(e);
+    list_add(&lru, e);
+    st_hits++;
+
+    pthread_mutex_unlock(&tier_lock);
+
+    uf->fd = fd;
+    return 0;
+}
+
+/**
+ * Count the first read of an open of a ro-branch file, called by read()
+ */
+void tier_read(const char *path, ufile_t *uf) {
+    if (!uf->tier_hit || !__sync_bool_compare_and_swap(&uf->tier_hit, true, false)) return;
+    if (!path) return;
+
+    pthread_mutex_lock(&tier_lock);
+
+    struct tier_entry *e = hashtable_search(entries, (void *)path);
+    if (!e) {
+        e = calloc(1, sizeof(struct tier_entry));
+        if (!e) goto out;
+        e->path = strdup(path);
+        if (!e->path || !hashtable_insert(entries, e->path, e)) {
+            free(e->path);
+            free(e);
+            goto out;
+        }
+        list_add(&cold, e);
+        ncold++;
+        while (ncold > TIER_MAX_COLD) tier_forget(cold.prev);
+    }
+
+    if (e->state != TIER_COLD) goto out;
+
+    time_t now = now_sec();
+    if (now - e->window > TIER_WINDOW) {
+        e->window = now;
+        e->hits = 0;
+    }
+    e->hits++;
+
+    list_del(e);
+    list_add(&cold, e);
+
+    // reserved here, the copy is set up after unlocking
+    bool promote = e->hits >= uopt.tier_hits;
+    if (promote) {
+        list_del(e);
+        ncold--;
+        e->state = TIER_COPYING;
+    }
+
+    pthread_mutex_unlock(&tier_lock);
+
+    // counts again from zero if the file cannot be promoted now
+    if (promote) tier_promote(path, uf->branch);
+    return;
+
+    out:
+    pthread_mutex_unlock(&tier_lock);
+}
+
+/**
+ * Bytes to demote to get below -o tier_size and TIER_MIN_FREE_PCT
+ */
+static unsigned long long tier_excess(void) {
+    unsigned long long excess = 0;
+
+    if (uopt.tier_size && tier_bytes > uopt.tier_size) excess = tier_bytes - uopt.tier_size;
+
+#ifdef linux
+    struct statfs stfs;
+    if (fstatfs(fast.fd, &stfs) == 0) {
+        unsigned long long bsize = stfs.f_frsize ? stfs.f_frsize : stfs.f_bsize;
+        unsigned long long min_free = stfs.f_blocks * bsize / 100 * TIER_MIN_FREE_PCT;
+        unsigned long long avail = stfs.f_bavail * bsize;
+
+        if (avail < min_free && min_free - avail > excess) excess = min_free - avail;
+    }
+#endif
+
+    return excess;
+}
+
+/**
+ * Collect the copies of a previous mount, without tier_lock as the walk
+ * may take long. They are registered by tier_scan_add().
+ */
+static size_t scan_prefix;
+static struct tier_entry *scanned;	// linked by next
+
+static int tier_scan_file(const char *fpath, const struct stat *sb, int typeflag,
+                          struct FTW *ftwbuf) {
+    (void)ftwbuf;
+
+    if (typeflag != FTW_F || !S_ISREG(sb->st_mode)) return 0;
+
+    size_t len = strlen(fpath);
+    size_t taglen = strlen(TIERTAG);
+    if (len <= scan_prefix + taglen || strcmp(fpath + len - taglen, TIERTAG)) return 0;
+
+    struct tier_entry *e = calloc(1, sizeof(struct tier_entry));
+    if (!e) return 0;
+    e->path = strndup(fpath + scan_prefix, len - scan_prefix - taglen);
+    if (!e->path) {
+        free(e);
+        return 0;
+    }
+    e->size = sb->st_size;
+
+    e->next = scanned;
+    scanned = e;
+
+    return 0;
+}
+
+/**
+ * Register the collected copies as promoted, least recently used first,
+ * tier_lock MUST be held
+ */
+static void tier_scan_add(void) {
+    while (scanned) {
+        struct tier_entry *e = scanned;
+        scanned = e->next;
+
+        // read since the mount, the copy is valid unless a new one is made
+        struct tier_entry *old = hashtable_search(entries, e->path);
+        if (old && old->state == TIER_COLD) {
+            list_del(old);
+            ncold--;
+            old->state = TIER_PROMOTED;
+            old->size = e->size;
+            tier_bytes += e->size;
+            list_add(&lru, old);
+        }
+        if (old || !hashtable_insert(entries, e->path, e)) {
+            free(e->path);
+            free(e);
+            continue;
+        }
+
+        e->state = TIER_PROMOTED;
+        tier_bytes += e->size;
+
+        // behind the copies of this mount
+        e->next = &lru;
+        e->prev = lru.prev;
+        lru.prev->next = e;
+        lru.prev = e;
+    }
+}
+
+static void *tier_thread(void *arg) {
+    (void)arg;
+
+    char meta[PATHLEN_MAX];
+    if (BUILD_PATH(meta, fast.path, METANAME) == 0) {
+        scan_prefix = strlen(meta);
+        nftw(meta, tier_scan_file, 16, FTW_PHYS);
+    }
+
+    pthread_mutex_lock(&tier_lock);
+    tier_scan_add();
+    while (1) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += TIER_INTERVAL;
+        pthread_cond_timedwait(&tier_cond, &tier_lock, &ts);
+
+        unsigned long long excess = tier_excess();
+        while (excess && lru.prev != &lru) {
+            struct tier_entry *e = lru.prev;
+            unsigned long long size = e->size;
+
+            tier_demote(e);
+            st_demotions++;
+            excess = size >= excess ? 0 : excess - size;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Check the tier branch and start the demotion thread, called from
+ * ulakefs_init() after copyup_init()
+ */
+int tier_init(void) {
+    if (uopt.tier_branch < 0) RETURN(0);
+
+    if (uopt.tier_branch >= NBRANCHES || !BRANCHES[uopt.tier_branch].rw) {
+        USYSLOG(LOG_ERR, "tier_branch %d is not a rw-branch\n", uopt.tier_branch);
+        RETURN(-EINVAL);
+    }
+    fast = BRANCHES[uopt.tier_branch];
+
+    if (!copyup_enabled()) {
+        USYSLOG(LOG_ERR, "tier_branch requires copyup_threads\n");
+        RETURN(-EINVAL);
+    }
+
+    lru.prev = lru.next = &lru;
+    cold.prev = cold.next = &cold;
+
+    entries = create_hashtable(16, string_hash, string_equal);
+    if (!entries) RETURN(-ENOMEM);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thread;
+    int res = pthread_create(&thread, &attr, tier_thread, NULL);
+    pthread_attr_destroy(&attr);
+    if (res) RETURN(-res);
+
+    started = true;
+
+    RETURN(0);
+}
+
+bool tier_enabled(void) {
+    return started;
+}
+
+void tier_stats(FILE *f) {
+    if (!started) return;
+
+    pthread_mutex_lock(&tier_lock);
+    fprintf(f, "tier_hits %lu\n", st_hits);
+    fprintf(f, "tier_promotions %lu\n", st_promotions);
+    fprintf(f, "tier_demotions %lu\n", st_demotions);
+    fprintf(f, "tier_invalidated %lu\n", st_invalid);
+    fprintf(f, "tier_failed %lu\n", st_failed);
+    fprintf(f, "tier_tracked %u\n", ncold);
+    fprintf(f, "tier_bytes %llu\n", tier_bytes);
+    pthread_mutex_unlock(&tier_lock);
+}
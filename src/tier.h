@@ -0,0 +1,19 @@
+//
+// Promotion of hot ro-branch files to a fast rw-branch
+//
+
+#ifndef ULAKEFS_FUSE_TIER_H
+#define ULAKEFS_FUSE_TIER_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "Ulakefs.h"
+
+int tier_init(void);
+bool tier_enabled(void);
+int tier_open(const char *path, const struct stat *st, ufile_t *uf);
+void tier_read(const char *path, ufile_t *uf);
+void tier_stats(FILE *f);
+
+#endif //ULAKEFS_FUSE_TIER_H
@@ -0,0 +1,823 @@
+//
+// Compact per-directory whiteout store
+//
+/*
+ * By default every whiteout is a file or directory <name>_HIDDEN~ in the
+ * tree mirrored below .ulakefs/ of a branch. rm -rf of a large lower tree
+ * creates one marker per file, and every readdir() reads all markers of
+ * the directory again. With -o whiteout_store the whiteouts of a directory
+ * are records in the single file .ulakefs/<dir>/_WHITEOUTS~ instead:
+ *
+ *   '+' name '\0'	name is hidden
+ *   '-' name '\0'	name is visible again
+ *
+ * New records are appended with one write(). The file is read with one
+ * read() when the directory is needed first and kept as a set in memory,
+ * lookups and readdir() are answered from the set afterwards. Once most
+ * records of a file are dead, a background thread writes the live names
+ * sorted to a new file and renames it over the old one. A record torn by a
+ * crash at the end of the file is ignored.
+ *
+ * The lock of the cache is never held for I/O. Appends and the rename of
+ * a compaction take one of WOSTORE_LOCKS locks picked by the directory,
+ * so they keep the order of the set, and I/O on one directory does not
+ * stall the others.
+ *
+ * _HIDDEN~ markers of the old format are still honoured. On rw-branches
+ * the compaction thread moves them into the record file once their
+ * directory is loaded, on ro-branches they are read along with the
+ * records. The records are read
+ * only with the option, a mount without it does not see them.
+ *
+ * As with -o dirmap, changes made directly on the branches bypassing the
+ * mount are not seen until the sets are dropped from memory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "Ulakefs.h"
+#include "options.h"
+#include "debug.h"
+#include "branches.h"
+#include "hashtable.h"
+#include "hashtable_itr.h"
+#include "manifest.h"
+#include "wostore.h"
+
+#define WOSTORE_DIRS 65536	// cached directories before all sets are dropped
+#define WOSTORE_NAMES (4UL << 20)	// cached names before all sets are dropped
+#define WOSTORE_SLACK 64	// dead records tolerated in any record file
+#define WOSTORE_LOCKS 64	// locks serializing the writes to record files
+
+#define KEYLEN (PATHLEN_MAX + 16)
+
+struct wo_dir {
+    int id;			// of the branch
+    char *dir;		// normalized, "" for the root
+    struct hashtable *names;	// hidden names, keys only
+    unsigned long records;	// in the record file, live and dead
+    unsigned long stamp;	// changed by every modification of the set
+    bool legacy;		// _HIDDEN~ markers are left in the meta directory
+    bool queued;		// waiting for compaction
+};
+
+struct wo_job {
+    char *key;
+    struct wo_job *next;
+};
+
+static pthread_mutex_t wostore_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wostore_cond = PTHREAD_COND_INITIALIZER;
+static struct hashtable *dirs;	// "id:dir" -> struct wo_dir
+static unsigned long nnames;	// in all cached sets
+static unsigned long changes;	// bumped by modifications, loads check it
+static unsigned long stamps;
+static bool compacting;		// the compaction thread runs
+static struct wo_job *jobs, **jobs_tail = &jobs;
+static pthread_mutex_t io_locks[WOSTORE_LOCKS];
+
+static unsigned long st_hits, st_loads, st_appends, st_migrated, st_compactions, st_drops;
+
+/**
+ * Copy path to norm without doubled and trailing slashes, the root is ""
+ */
+static int normalize(char *norm, const char *path) {
+    size_t len = 0;
+    const char *s;
+    for (s = path; *s; s++) {
+        if (*s == '/' && len && norm[len - 1] == '/') continue;
+        if (len == PATHLEN_MAX - 1) return -ENAMETOOLONG;
+        norm[len++] = *s;
+    }
+    while (len && norm[len - 1] == '/') len--;
+    norm[len] = '\0';
+
+    return 0;
+}
+
+static void make_key(char *key, int branch, const char *dir) {
+    snprintf(key, KEYLEN, "%d:%s", BRANCHES[branch].id, dir);
+}
+
+/**
+ * The lock of the record file of the set with key
+ */
+static pthread_mutex_t *io_lock(const char *key) {
+    return &io_locks[string_hash((void *)key) % WOSTORE_LOCKS];
+}
+
+static int record_path(char *p, int branch, const char *dir) {
+    return BUILD_PATH(p, BRANCHES[branch].path, METADIR, dir, WHITEOUTS_NAME);
+}
+
+static bool set_add(struct wo_dir *d, const char *name) {
+    if (hashtable_search(d->names, (void *)name)) return false;
+
+    char *key = strdup(name);
+    if (!key || !hashtable_insert(d->names, key, key)) {
+        free(key);
+        return false;
+    }
+
+    return true;
+}
+
+static bool set_del(struct wo_dir *d, const char *name) {
+    // the value is the freed key, only tell whether there was one
+    return hashtable_remove(d->names, (void *)name) != NULL;
+}
+
+static void free_dir(struct wo_dir *d) {
+    if (!d) return;
+
+    if (d->names) hashtable_destroy(d->names, 0);
+    free(d->dir);
+    free(d);
+}
+
+/**
+ * Replay the records of a record file into d
+ */
+static void parse_records(struct wo_dir *d, const char *buf, size_t size) {
+    size_t pos = 0;
+
+    while (pos < size) {
+        const char *end = memchr(buf + pos, '\0', size - pos);
+        if (!end) break; // torn by a crash while appending
+
+        const char *name = buf + pos + 1;
+        if (name <= end && *name && !strchr(name, '/')) {
+            if (buf[pos] == '+') set_add(d, name);
+            else if (buf[pos] == '-') set_del(d, name);
+        }
+
+        d->records++;
+        pos = end - buf + 1;
+    }
+}
+
+/**
+ * Read the record file and the _HIDDEN~ markers of dir on branch. NULL if
+ * they cannot be read, a directory without whiteouts gets an empty set.
+ */
+static struct wo_dir *load_dir(int branch, const char *dir) {
+    struct wo_dir *d = calloc(1, sizeof(struct wo_dir));
+    if (!d) return NULL;
+
+    d->id = BRANCHES[branch].id;
+    d->dir = strdup(dir);
+    d->names = create_hashtable(16, string_hash, string_equal);
+    if (!d->dir || !d->names) goto err;
+
+    char p[PATHLEN_MAX];
+    if (BUILD_PATH(p, BRANCHES[branch].path, METADIR, dir)) goto err;
+
+    // the meta directory is missing for most directories
+    manifest_dir_t md;
+    DIR *dp = NULL;
+    int res = manifest_opendir(branch, p + BRANCHES[branch].path_len - 1, &md);
+    if (res == 1) {
+        dp = opendir(p);
+        res = dp ? 0 : -1;
+    }
+    if (res == -1) {
+        if (errno == ENOENT || errno == ENOTDIR) return d;
+        goto err;
+    }
+
+    while (1) {
+        const char *name;
+        if (dp) {
+            struct dirent *de = readdir(dp);
+            name = de ? de->d_name : NULL;
+        } else {
+            struct stat st;
+            name = manifest_readdir(&md, &st);
+        }
+        if (!name) break;
+
+        const char *tag = whiteout_tag(name);
+        if (!tag) continue;
+
+        char *key = strndup(name, tag - name);
+        if (key) set_add(d, key);
+        free(key);
+        d->legacy = true;
+    }
+    if (dp) closedir(dp);
+
+    if (record_path(p, branch, dir)) goto err;
+
+    int fd = open(p, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOENT) return d;
+        goto err;
+    }
+
+    struct stat st;
+    char *buf = NULL;
+    if (fstat(fd, &st) == -1 || !(buf = malloc(st.st_size + 1))) {
+        close(fd);
+        goto err;
+    }
+
+    size_t done = 0;
+    while (done < (size_t)st.st_size) {
+        ssize_t n = read(fd, buf + done, st.st_size - done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    close(fd);
+
+    parse_records(d, buf, done);
+    free(buf);
+
+    return d;
+
+    err:
+    USYSLOG(LOG_WARNING, "%s: reading the whiteouts of %s on %s failed: %s\n", __func__,
+            *dir ? dir : "/", BRANCHES[branch].path, strerror(errno));
+    free_dir(d);
+    return NULL;
+}
+
+/**
+ * Append a record for name to the record file of dir, called with its
+ * io_lock() held so appends and compaction do not interleave
+ */
+static int append(int branch, const char *dir, char op, const char *name) {
+    char p[PATHLEN_MAX];
+    if (record_path(p, branch, dir)) return -ENAMETOOLONG;
+
+    size_t len = strlen(name);
+    if (len > NAME_MAX) return -ENAMETOOLONG;
+
+    char rec[NAME_MAX + 2];
+    rec[0] = op;
+    memcpy(rec + 1, name, len + 1);
+
+    int fd = open(p, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd == -1) return -errno;
+
+    ssize_t res = write(fd, rec, len + 2);
+    int err = errno;
+    close(fd);
+    if (res != (ssize_t)(len + 2)) return res == -1 ? -err : -EIO;
+
+    __sync_fetch_and_add(&st_appends, 1);
+    return 0;
+}
+
+static void drop_all(void) {
+    if (hashtable_count(dirs)) {
+        struct hashtable_itr *itr = hashtable_iterator(dirs);
+        if (!itr) return;
+        do {
+            free_dir(hashtable_iterator_value(itr));
+        } while (hashtable_iterator_advance(itr));
+        free(itr);
+    }
+
+    hashtable_destroy(dirs, 0);
+    dirs = create_hashtable(64, string_hash, string_equal);
+    nnames = 0;
+    st_drops++;
+}
+
+/**
+ * Queue d for compaction if most of its records are dead or markers of
+ * the old format are left, called with the lock held
+ */
+static void maybe_compact(int branch, struct wo_dir *d, const char *key) {
+    if (!compacting || d->queued || !BRANCHES[branch].rw) return;
+    if (!d->legacy && d->records <= 2 * hashtable_count(d->names) + WOSTORE_SLACK) return;
+
+    struct wo_job *job = malloc(sizeof(struct wo_job));
+    if (!job || !(job->key = strdup(key))) {
+        free(job);
+        return;
+    }
+    job->next = NULL;
+    *jobs_tail = job;
+    jobs_tail = &job->next;
+
+    d->queued = true;
+    pthread_cond_signal(&wostore_cond);
+}
+
+/**
+ * The set of dir on branch, loaded if it is not cached. Returns with the
+ * lock held, *owned is set if the set is not cached and must be freed by
+ * put_dir(). NULL if the whiteouts cannot be read.
+ */
+static struct wo_dir *get_dir(int branch, const char *dir, bool *owned) {
+    char key[KEYLEN];
+    make_key(key, branch, dir);
+
+    pthread_mutex_lock(&wostore_lock);
+    struct wo_dir *d = dirs ? hashtable_search(dirs, key) : NULL;
+    if (d) {
+        st_hits++;
+        *owned = false;
+        return d;
+    }
+    unsigned long started = changes;
+    pthread_mutex_unlock(&wostore_lock);
+
+    d = load_dir(branch, dir);
+
+    pthread_mutex_lock(&wostore_lock);
+    st_loads++;
+    *owned = true;
+
+    // a record appended meanwhile might be missing in d
+    if (!d || changes != started || !dirs) return d;
+
+    struct wo_dir *other = hashtable_search(dirs, key);
+    if (other) {
+        free_dir(d);
+        *owned = false;
+        return other;
+    }
+
+    if (hashtable_count(dirs) >= WOSTORE_DIRS || nnames >= WOSTORE_NAMES) {
+        drop_all();
+        if (!dirs) return d;
+    }
+
+    char *k = strdup(key);
+    if (!k || !hashtable_insert(dirs, k, d)) {
+        free(k);
+        return d;
+    }
+    *owned = false;
+    nnames += hashtable_count(d->names);
+    d->stamp = ++stamps;
+
+    maybe_compact(branch, d, key);
+
+    return d;
+}
+
+static void put_dir(struct wo_dir *d, bool owned) {
+    if (owned) free_dir(d);
+    pthread_mutex_unlock(&wostore_lock);
+}
+
+/**
+ * A record hiding name or making it visible was appended to the record
+ * file of the set with key, update the set if it is cached
+ */
+static void recorded(int branch, const char *key, const char *name, bool hidden) {
+    pthread_mutex_lock(&wostore_lock);
+    changes++;
+
+    struct wo_dir *d = dirs ? hashtable_search(dirs, (void *)key) : NULL;
+    if (d) {
+        d->records++;
+        if (hidden && set_add(d, name)) nnames++;
+        if (!hidden && set_del(d, name)) nnames--;
+        d->stamp = ++stamps;
+        maybe_compact(branch, d, key);
+    }
+
+    pthread_mutex_unlock(&wostore_lock);
+}
+
+/**
+ * Is name in dir hidden on branch? 1 if it is.
+ */
+static int lookup(int branch, const char *dir, const char *name) {
+    bool owned;
+    struct wo_dir *d = get_dir(branch, dir, &owned);
+    int res = d && hashtable_search(d->names, (void *)name) ? 1 : 0;
+    put_dir(d, owned);
+
+    return res;
+}
+
+/**
+ * Does a whiteout on branch hide path itself?
+ */
+int wostore_hidden(const char *path, int branch) {
+    char norm[PATHLEN_MAX];
+    if (normalize(norm, path)) RETURN(-ENAMETOOLONG);
+
+    char *slash = strrchr(norm, '/');
+    if (!slash) RETURN(0); // the root
+
+    *slash = '\0';
+    RETURN(lookup(branch, norm, slash + 1));
+}
+
+/**
+ * Does a whiteout on branch hide path or one of its parents? The store
+ * variant of path_hidden().
+ */
+int wostore_path_hidden(const char *path, int branch) {
+    char norm[PATHLEN_MAX];
+    if (normalize(norm, path)) RETURN(-ENAMETOOLONG);
+
+    // norm up to walk is the directory, the name follows walk
+    char *walk = strchr(norm, '/');
+    while (walk) {
+        char *next = strchr(walk + 1, '/');
+
+        *walk = '\0';
+        if (next) *next = '\0';
+        int res = lookup(branch, norm, walk + 1);
+        *walk = '/';
+        if (next) *next = '/';
+
+        if (res) RETURN(res);
+        walk = next;
+    }
+
+    RETURN(0);
+}
+
+/**
+ * Hide path on the rw-branch, the meta directory of its parent exists
+ */
+int wostore_add(const char *path, int branch) {
+    DBG("%s\n", path);
+
+    char norm[PATHLEN_MAX];
+    if (normalize(norm, path)) RETURN(-ENAMETOOLONG);
+
+    char *slash = strrchr(norm, '/');
+    if (!slash) RETURN(-EINVAL); // the root
+    *slash = '\0';
+    const char *name = slash + 1;
+
+    char key[KEYLEN];
+    make_key(key, branch, norm);
+    pthread_mutex_t *io = io_lock(key);
+    pthread_mutex_lock(io);
+
+    // a set loaded while the record is written must not be cached
+    bool owned;
+    struct wo_dir *d = get_dir(branch, norm, &owned);
+    bool hidden = d && hashtable_search(d->names, (void *)name);
+    if (!hidden) changes++;
+    put_dir(d, owned);
+
+    int res = hidden ? 0 : append(branch, norm, '+', name);
+    if (res == 0 && !hidden) recorded(branch, key, name, true);
+
+    pthread_mutex_unlock(io);
+    RETURN(res);
+}
+
+/**
+ * Make path visible again on branch. 1 if a whiteout was removed.
+ */
+int wostore_remove(const char *path, int branch) {
+    char norm[PATHLEN_MAX];
+    if (normalize(norm, path)) RETURN(-ENAMETOOLONG);
+
+    char *slash = strrchr(norm, '/');
+    if (!slash) RETURN(0);
+    *slash = '\0';
+    const char *name = slash + 1;
+
+    char key[KEYLEN];
+    make_key(key, branch, norm);
+    pthread_mutex_t *io = io_lock(key);
+    pthread_mutex_lock(io);
+
+    bool owned;
+    struct wo_dir *d = get_dir(branch, norm, &owned);
+    bool hidden = d && hashtable_search(d->names, (void *)name);
+    bool legacy = d && d->legacy;
+    if (hidden) changes++;
+    put_dir(d, owned);
+
+    if (!hidden) {
+        pthread_mutex_unlock(io);
+        RETURN(0);
+    }
+
+    int res = append(branch, norm, '-', name);
+
+    // a marker of the old format would hide name again
+    if (legacy) {
+        char p[PATHLEN_MAX];
+        if (BUILD_PATH(p, BRANCHES[branch].path, METADIR, norm, name)
+            || strlen(p) + strlen(HIDETAG) >= PATHLEN_MAX) {
+            res = -ENAMETOOLONG;
+        } else {
+            strcat(p, HIDETAG);
+            if (unlink(p) == -1 && errno == EISDIR) rmdir(p);
+        }
+    }
+
+    if (res == 0) recorded(branch, key, name, false);
+
+    pthread_mutex_unlock(io);
+    RETURN(res == 0 ? 1 : res);
+}
+
+/**
+ * Add the names hidden in the directory path on branch to whiteouts
+ */
+void wostore_read(const char *path, int branch, struct hashtable *whiteouts) {
+    char norm[PATHLEN_MAX];
+    if (normalize(norm, path)) return;
+
+    bool owned;
+    struct wo_dir *d = get_dir(branch, norm, &owned);
+
+    if (d && hashtable_count(d->names)) {
+        struct hashtable_itr *itr = hashtable_iterator(d->names);
+        if (itr) {
+            do {
+                char *name = hashtable_iterator_key(itr);
+                if (hashtable_search(whiteouts, name)) continue;
+
+                char *key = strdup(name);
+                if (key && !hashtable_insert(whiteouts, key, key)) free(key);
+            } while (hashtable_iterator_advance(itr));
+            free(itr);
+        }
+    }
+
+    put_dir(d, owned);
+}
+
+/**
+ * The record files of path and below on branch were removed, drop their sets
+ */
+void wostore_purge(const char *path, int branch) {
+    char norm[PATHLEN_MAX];
+    if (normalize(norm, path)) return;
+    size_t len = strlen(norm);
+    int id = BRANCHES[branch].id;
+
+    pthread_mutex_lock(&wostore_lock);
+    changes++;
+
+    if (dirs && hashtable_count(dirs)) {
+        struct hashtable_itr *itr = hashtable_iterator(dirs);
+        int more = itr != NULL;
+        while (more) {
+            struct wo_dir *d = hashtable_iterator_value(itr);
+            if (d->id == id && strncmp(d->dir, norm, len) == 0
+                && (d->dir[len] == '\0' || d->dir[len] == '/')) {
+                nnames -= hashtable_count(d->names);
+                free_dir(d);
+                more = hashtable_iterator_remove(itr);
+            } else {
+                more = hashtable_iterator_advance(itr);
+            }
+        }
+        free(itr);
+    }
+
+    pthread_mutex_unlock(&wostore_lock);
+}
+
+static int name_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Remove the _HIDDEN~ markers in the meta directory of dir on branch whose
+ * names are among the sorted names of its record file. Returns how many
+ * were removed, *left is set if markers stay.
+ */
+static unsigned long remove_markers(int branch, const char *dir, char **names, unsigned int n,
+                                    bool *left) {
+    char p[PATHLEN_MAX];
+    *left = true;
+    if (BUILD_PATH(p, BRANCHES[branch].path, METADIR, dir)) return 0;
+    size_t len = strlen(p);
+
+    DIR *dp = opendir(p);
+    if (!dp) {
+        *left = errno != ENOENT;
+        return 0;
+    }
+
+    unsigned long removed = 0;
+    *left = false;
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL) {
+        char *tag = whiteout_tag(de->d_name);
+        if (!tag) continue;
+
+        if (len + 1 + strlen(de->d_name) >= PATHLEN_MAX) {
+            *left = true;
+            continue;
+        }
+        snprintf(p + len, PATHLEN_MAX - len, "/%s", de->d_name);
+
+        // a marker created by a mount without the option is not recorded
+        *tag = '\0';
+        const char *name = de->d_name;
+        if (!bsearch(&name, names, n, sizeof(char *), name_cmp)) {
+            *left = true;
+            continue;
+        }
+
+        int res = unlink(p);
+        if (res == -1 && errno == EISDIR) res = rmdir(p);
+        if (res == 0) removed++; else *left = true;
+    }
+    closedir(dp);
+
+    return removed;
+}
+
+/**
+ * Write the live names of the set with key sorted to a new record file
+ * and rename it over the old one, unless the set changed meanwhile. The
+ * _HIDDEN~ markers of the names are removed afterwards.
+ */
+static void compact(const char *key) {
+    pthread_mutex_lock(&wostore_lock);
+    struct wo_dir *d = dirs ? hashtable_search(dirs, (void *)key) : NULL;
+    if (!d) {
+        pthread_mutex_unlock(&wostore_lock);
+        return;
+    }
+    d->queued = false;
+
+    int id = d->id;
+    unsigned long stamp = d->stamp;
+    bool legacy = d->legacy;
+    unsigned int n = hashtable_count(d->names);
+    char *dir = strdup(d->dir);
+
+    // copy the names, the records are as long as the names with their \0
+    // plus the leading '+'
+    size_t size = 0, copied = 0;
+    char *buf = NULL, *sorted = NULL;
+    char **names = malloc((n ? n : 1) * sizeof(char *));
+    struct hashtable_itr *itr = n && dir && names ? hashtable_iterator(d->names) : NULL;
+    if (itr) {
+        do {
+            size += strlen(hashtable_iterator_key(itr)) + 2;
+        } while (hashtable_iterator_advance(itr));
+        free(itr);
+
+        buf = malloc(size);
+        itr = buf ? hashtable_iterator(d->names) : NULL;
+    }
+    if (itr) {
+        size_t off = 0;
+        do {
+            names[copied++] = buf + off;
+            off += sprintf(buf + off, "%s", (char *)hashtable_iterator_key(itr)) + 1;
+        } while (hashtable_iterator_advance(itr));
+        free(itr);
+    }
+    pthread_mutex_unlock(&wostore_lock);
+
+    if (!dir || !names || copied != n) goto out;
+
+    // all records in one write
+    qsort(names, n, sizeof(char *), name_cmp);
+    sorted = malloc(size ? size : 1);
+    if (!sorted) goto out;
+    size_t off = 0, i;
+    for (i = 0; i < n; i++) {
+        sorted[off] = '+';
+        off += sprintf(sorted + off + 1, "%s", names[i]) + 2;
+    }
+
+    branches_enter(NULL);
+    int branch = branches_index(id);
+    if (branch == -1) goto out;
+
+    char p[PATHLEN_MAX], tmp[PATHLEN_MAX];
+    if (record_path(p, branch, dir) || strlen(p) + 1 >= PATHLEN_MAX) goto out;
+    snprintf(tmp, PATHLEN_MAX, "%s~", p);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd == -1) goto out;
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t res = write(fd, sorted + done, size - done);
+        if (res == -1 && errno == EINTR) continue;
+        if (res <= 0) break;
+        done += res;
+    }
+    if (done < size || fsync(fd) == -1) {
+        close(fd);
+        unlink(tmp);
+        goto out;
+    }
+    close(fd);
+
+    // appends hold the io lock, the stamp stays until the rename is done
+    pthread_mutex_t *io = io_lock(key);
+    pthread_mutex_lock(io);
+
+    pthread_mutex_lock(&wostore_lock);
+    d = dirs ? hashtable_search(dirs, (void *)key) : NULL;
+    bool current = d && d->stamp == stamp;
+    pthread_mutex_unlock(&wostore_lock);
+
+    if (current && rename(tmp, p) == 0) {
+        bool left = false;
+        unsigned long migrated = legacy ? remove_markers(branch, dir, names, n, &left) : 0;
+
+        pthread_mutex_lock(&wostore_lock);
+        d = dirs ? hashtable_search(dirs, (void *)key) : NULL;
+        if (d) {
+            d->records = n;
+            d->legacy = left;
+        }
+        st_compactions++;
+        st_migrated += migrated;
+        pthread_mutex_unlock(&wostore_lock);
+    } else {
+        unlink(tmp);
+    }
+
+    pthread_mutex_unlock(io);
+
+    out:
+    free(sorted);
+    free(buf);
+    free(names);
+    free(dir);
+}
+
+static void *compact_thread(void *arg) {
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&wostore_lock);
+        while (!jobs) pthread_cond_wait(&wostore_cond, &wostore_lock);
+
+        struct wo_job *job = jobs;
+        jobs = job->next;
+        if (!jobs) jobs_tail = &jobs;
+        pthread_mutex_unlock(&wostore_lock);
+
+        compact(job->key);
+        free(job->key);
+        free(job);
+    }
+
+    return NULL;
+}
+
+/**
+ * Allocate the cache and start the compaction thread, called from
+ * ulakefs_init()
+ */
+int wostore_init(void) {
+    if (!uopt.whiteout_store) RETURN(0);
+
+    int i;
+    for (i = 0; i < WOSTORE_LOCKS; i++) pthread_mutex_init(&io_locks[i], NULL);
+
+    pthread_mutex_lock(&wostore_lock);
+    dirs = create_hashtable(64, string_hash, string_equal);
+    pthread_mutex_unlock(&wostore_lock);
+    if (!dirs) RETURN(-ENOMEM); // sets are loaded for each lookup
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thread;
+    int res = pthread_create(&thread, &attr, compact_thread, NULL);
+    pthread_attr_destroy(&attr);
+    if (res) RETURN(-res);
+
+    pthread_mutex_lock(&wostore_lock);
+    compacting = true;
+    pthread_mutex_unlock(&wostore_lock);
+
+    RETURN(0);
+}
+
+void wostore_stats(FILE *f) {
+    if (!uopt.whiteout_store) return;
+
+    pthread_mutex_lock(&wostore_lock);
+    fprintf(f, "wostore_dirs %u\n", dirs ? hashtable_count(dirs) : 0);
+    fprintf(f, "wostore_names %lu\n", nnames);
+    fprintf(f, "wostore_hits %lu\n", st_hits);
+    fprintf(f, "wostore_loads %lu\n", st_loads);
+    fprintf(f, "wostore_appends %lu\n", st_appends);
+    fprintf(f, "wostore_migrated %lu\n", st_migrated);
+    fprintf(f, "wostore_compactions %lu\n", st_compactions);
+    fprintf(f, "wostore_drops %lu\n", st_drops);
+    pthread_mutex_unlock(&wostore_lock);
+}
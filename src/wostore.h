@@ -0,0 +1,22 @@
+//
+// Compact per-directory whiteout store
+//
+
+#ifndef ULAKEFS_FUSE_WOSTORE_H
+#define ULAKEFS_FUSE_WOSTORE_H
+
+#include <stdio.h>
+#include "hashtable.h"
+
+#define WHITEOUTS_NAME "_WHITEOUTS~"	// record file in the meta directory of a directory
+
+int wostore_init(void);
+int wostore_hidden(const char *path, int branch);
+int wostore_path_hidden(const char *path, int branch);
+int wostore_add(const char *path, int branch);
+int wostore_remove(const char *path, int branch);
+void wostore_read(const char *path, int branch, struct hashtable *whiteouts);
+void wostore_purge(const char *path, int branch);
+void wostore_stats(FILE *f);
+
+#endif //ULAKEFS_FUSE_WOSTORE_H
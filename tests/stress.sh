@@ -0,0 +1,187 @@
+#!/bin/bash
+#
+# Concurrent mutations on a RO+RW union mounted with the multithreaded
+# session loop. Workers create, unlink, rename, copy up and list files in
+# parallel, each in its own part of the tree, so the final state is known
+# and checked, once while mounted and once more after a remount.
+#
+# Usage: stress.sh /path/to/ulakefs [extra mount options]
+# Needs /dev/fuse and fusermount, exits with 77 (skipped) without them.
+# STRESS_FILES sets the files per worker (200), STRESS_THREADS the FUSE
+# workers (8).
+#
+
+ULAKEFS=$1
+EXTRA_OPTS=$2
+FILES=${STRESS_FILES:-200}
+THREADS=${STRESS_THREADS:-8}
+
+if [ ! -x "$ULAKEFS" ]; then
+    echo "Usage: $0 /path/to/ulakefs [extra mount options]" >&2
+    exit 2
+fi
+if [ ! -c /dev/fuse ] || ! command -v fusermount >/dev/null; then
+    echo "SKIP: no /dev/fuse or fusermount"
+    exit 77
+fi
+
+TMP=$(mktemp -d)
+RO=$TMP/ro
+RW=$TMP/rw
+MNT=$TMP/mnt
+ERRORS=$TMP/errors
+mkdir -p "$RO" "$RW" "$MNT"
+: > "$ERRORS"
+
+fail() {
+    echo "FAIL: $*" | tee -a "$ERRORS" >&2
+}
+
+mounted() {
+    grep -q " $MNT fuse" /proc/mounts
+}
+
+do_mount() {
+    "$ULAKEFS" -f -o cow,threads=$THREADS${EXTRA_OPTS:+,$EXTRA_OPTS} \
+        "$RW=RW:$RO=RO" "$MNT" &
+    PID=$!
+
+    local i
+    for i in $(seq 50); do
+        mounted && return 0
+        sleep 0.1
+    done
+    fail "mounting $MNT timed out"
+    kill $PID 2>/dev/null
+    exit 1
+}
+
+do_umount() {
+    fusermount -u "$MNT" || fail "unmounting $MNT failed"
+    wait $PID || fail "ulakefs exited with $?"
+}
+
+cleanup() {
+    mounted && fusermount -u -z "$MNT"
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+# lower files: copied up, unlinked and renamed by the workers
+mkdir -p "$RO/cow" "$RO/del" "$RO/ren" "$RO/list"
+for i in $(seq $FILES); do
+    echo "ro $i" > "$RO/cow/f$i"
+    echo "ro $i" > "$RO/del/f$i"
+    echo "ro $i" > "$RO/ren/f$i"
+    echo "ro $i" > "$RO/list/f$i"
+done
+
+do_mount
+
+# new files, every odd one is removed again
+worker_create() {
+    mkdir -p "$MNT/new" 2>/dev/null
+    local i
+    for i in $(seq $FILES); do
+        echo "new $i" > "$MNT/new/f$i" || fail "create new/f$i"
+        if [ $((i % 2)) = 1 ]; then
+            rm "$MNT/new/f$i" || fail "unlink new/f$i"
+        fi
+    done
+}
+
+# appending copies the lower file up first
+worker_cow() {
+    local i
+    for i in $(seq $FILES); do
+        echo "rw $i" >> "$MNT/cow/f$i" || fail "append cow/f$i"
+    done
+}
+
+# unlinking lower files needs whiteouts
+worker_del() {
+    local i
+    for i in $(seq $FILES); do
+        rm "$MNT/del/f$i" || fail "unlink del/f$i"
+    done
+}
+
+# renaming lower files copies them up and hides the old name
+worker_ren() {
+    local i
+    for i in $(seq $FILES); do
+        mv "$MNT/ren/f$i" "$MNT/ren/g$i" || fail "rename ren/f$i"
+    done
+}
+
+# listings while the others change the tree, no name twice
+worker_readdir() {
+    local n
+    for n in $(seq 20); do
+        local d
+        for d in cow del ren list new; do
+            [ -d "$MNT/$d" ] || continue
+            local dups
+            dups=$(ls -f "$MNT/$d" | sort | uniq -d)
+            [ -z "$dups" ] || fail "readdir $d returned duplicates: $dups"
+        done
+        [ "$(ls "$MNT/list" | wc -l)" = "$FILES" ] || fail "readdir list lost files"
+    done
+}
+
+# reads of lower files and of the control files, which have no branch
+worker_read() {
+    local n i
+    for n in $(seq 5); do
+        for i in $(seq $FILES); do
+            [ "$(cat "$MNT/list/f$i" 2>&1)" = "ro $i" ] || fail "read list/f$i"
+        done
+        cat "$MNT/.ulakefs.ctl/stats" > /dev/null || fail "read .ulakefs.ctl/stats"
+    done
+}
+
+PIDS=""
+for w in worker_create worker_cow worker_del worker_ren worker_readdir worker_readdir \
+         worker_read; do
+    $w &
+    PIDS="$PIDS $!"
+done
+wait $PIDS
+
+check() {
+    local i
+    for i in $(seq $FILES); do
+        if [ $((i % 2)) = 1 ]; then
+            [ ! -e "$MNT/new/f$i" ] || fail "$1: new/f$i not removed"
+        else
+            [ "$(cat "$MNT/new/f$i" 2>&1)" = "new $i" ] || fail "$1: new/f$i content"
+        fi
+        [ "$(cat "$MNT/cow/f$i" 2>&1)" = "$(printf 'ro %s\nrw %s' $i $i)" ] \
+            || fail "$1: cow/f$i content"
+        [ ! -e "$MNT/del/f$i" ] || fail "$1: del/f$i visible"
+        [ ! -e "$MNT/ren/f$i" ] || fail "$1: ren/f$i visible"
+        [ "$(cat "$MNT/ren/g$i" 2>&1)" = "ro $i" ] || fail "$1: ren/g$i content"
+    done
+    [ -z "$(ls -A "$MNT/del")" ] || fail "$1: del not empty"
+    [ "$(ls "$MNT/ren" | wc -l)" = "$FILES" ] || fail "$1: ren has stray files"
+    [ "$(ls "$MNT/new" | wc -l)" = "$((FILES / 2))" ] || fail "$1: new has stray files"
+}
+
+check mounted
+
+# the lower branch is never written
+for i in $(seq $FILES); do
+    [ "$(cat "$RO/cow/f$i")" = "ro $i" ] || fail "ro branch changed: cow/f$i"
+    [ -e "$RO/del/f$i" ] || fail "ro branch changed: del/f$i"
+done
+
+do_umount
+do_mount
+check remounted
+do_umount
+
+if [ -s "$ERRORS" ]; then
+    echo "$(wc -l < "$ERRORS") failures"
+    exit 1
+fi
+echo "OK"